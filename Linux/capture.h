@@ -0,0 +1,82 @@
+// Traffic capture format, shared by the server (writer) and replay.cpp (reader).
+//
+// File:   8-byte magic, then records back to back until EOF
+// Record: fixed-size header (see CaptureRecord), then request_length bytes
+//         of the raw request exactly as the client sent it
+// Integers are little-endian regardless of host byte order.
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <string_view>
+
+constexpr char CAPTURE_MAGIC[8] = {'H', 'T', 'C', 'A', 'P', '0', '0', '1'};
+constexpr size_t CAPTURE_RECORD_HEADER_SIZE = 31;
+
+enum CaptureFlags : uint8_t {
+    CAPTURE_TRUNCATED = 0x1,     // Request bytes incomplete; the record is not replayable
+    CAPTURE_LENGTH_KNOWN = 0x2,  // response_length is valid
+    CAPTURE_BODY_HASHED = 0x4,   // body_hash is valid
+    CAPTURE_TLS = 0x8            // Arrived over TLS; replayed in plaintext
+};
+
+struct CaptureRecord {
+    uint64_t arrival_ns = 0;       // Since the capture started
+    uint32_t request_length = 0;
+    uint16_t status = 0;
+    uint8_t flags = 0;
+    uint64_t response_length = 0;  // Response body bytes
+    uint64_t body_hash = 0;        // capture_hash() of the response body
+};
+
+// FNV-1a, 64-bit. Chain calls to hash a body that arrives in pieces.
+constexpr uint64_t CAPTURE_HASH_SEED = 14695981039346656037ull;
+
+inline uint64_t capture_hash(uint64_t hash, const void* data, size_t length) {
+    const unsigned char* bytes = static_cast<const unsigned char*>(data);
+    for (size_t i = 0; i < length; ++i) {
+        hash = (hash ^ bytes[i]) * 1099511628211ull;
+    }
+    return hash;
+}
+
+inline void capture_put(std::string& out, uint64_t value, int bytes) {
+    for (int i = 0; i < bytes; ++i) {
+        out += static_cast<char>((value >> (8 * i)) & 0xff);
+    }
+}
+
+inline uint64_t capture_get(const char* data, int bytes) {
+    uint64_t value = 0;
+    for (int i = 0; i < bytes; ++i) {
+        value |= static_cast<uint64_t>(static_cast<unsigned char>(data[i])) << (8 * i);
+    }
+    return value;
+}
+
+// Serialize a record header followed by its request bytes
+inline std::string encode_capture_record(const CaptureRecord& record, std::string_view request) {
+    std::string out;
+    out.reserve(CAPTURE_RECORD_HEADER_SIZE + request.size());
+    capture_put(out, record.arrival_ns, 8);
+    capture_put(out, request.size(), 4);
+    capture_put(out, record.status, 2);
+    capture_put(out, record.flags, 1);
+    capture_put(out, record.response_length, 8);
+    capture_put(out, record.body_hash, 8);
+    out.append(request);
+    return out;
+}
+
+// Parse a record header from CAPTURE_RECORD_HEADER_SIZE bytes
+inline CaptureRecord decode_capture_record(const char* data) {
+    CaptureRecord record;
+    record.arrival_ns = capture_get(data, 8);
+    record.request_length = static_cast<uint32_t>(capture_get(data + 8, 4));
+    record.status = static_cast<uint16_t>(capture_get(data + 12, 2));
+    record.flags = static_cast<uint8_t>(capture_get(data + 14, 1));
+    record.response_length = capture_get(data + 15, 8);
+    record.body_hash = capture_get(data + 23, 8);
+    return record;
+}
@@ -9,25 +9,52 @@
 #include <unordered_set>
 #include <vector>
 #include <sstream>
+#include <iomanip>
 #include <algorithm>
 #include <filesystem>
 #include <memory>
+#include <deque>
+#include <condition_variable>
+#include <list>
+#include <cmath>
 #include <csignal>
 #include <cstring>
 #include <cstdlib>
 #include <cerrno>
 #include <string_view>
+#include <optional>
+#include <functional>
+#include <utility>
+#include <exception>
 
 // POSIX includes
 #include <sys/socket.h>
 #include <sys/stat.h>
 #include <sys/wait.h>
 #include <sys/select.h>
+#include <sys/sendfile.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <sys/mman.h>
+#include <sys/ioctl.h>
+#include <sys/eventfd.h>
+#include <poll.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <linux/sockios.h>
 #include <arpa/inet.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <pwd.h>
+#include <strings.h>
+
+#ifdef ENABLE_TLS
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+#endif
+
+#include "capture.h"
+#include "pack.h"
 
 using namespace std;
 namespace fs = std::filesystem;
@@ -39,15 +66,132 @@ constexpr const char* SERVER_NAME = "SecureHTTP/1.1";
 constexpr size_t MAX_REQUEST_SIZE = 8192;  // 8KB max request
 constexpr size_t MAX_BODY_SIZE = 1024 * 1024;  // 1MB max body
 constexpr size_t MAX_FILE_SIZE = 10 * 1024 * 1024;  // 10MB max file
-constexpr int MAX_CONCURRENT_THREADS = 100;
+constexpr int MAX_CONCURRENT_THREADS = 512;  // Hard ceiling; request concurrency is adaptive
 constexpr int REQUEST_TIMEOUT_SECONDS = 5;
 constexpr int MAX_CONNECTIONS_PER_IP = 10;
+constexpr int PHP_TIMEOUT_SECONDS = 5;
+constexpr size_t MAX_CHUNK_LINE = 1024;  // Max chunk-size line incl. extensions
+constexpr size_t BODY_BUFFER_SIZE = 16384;  // Body bytes moved per read/write
+
+// Egress scheduling. Response bytes go out in quanta granted by deficit
+// round-robin across connections; small responses and the first quantum of
+// every response are served ahead of bulk transfers.
+constexpr bool EGRESS_SCHEDULER = true;
+constexpr size_t EGRESS_QUANTUM = 64 * 1024;           // Bytes per round-robin turn
+constexpr size_t EGRESS_SMALL_RESPONSE = 64 * 1024;    // Responses this size go entirely at priority
+constexpr size_t EGRESS_WINDOW = 1024 * 1024;          // Granted bytes being written, all connections
+constexpr uint64_t EGRESS_GLOBAL_RATE = 0;             // Bytes/s across all connections, 0 = unlimited
+constexpr uint64_t EGRESS_CONNECTION_RATE = 0;         // Bytes/s per connection, 0 = unlimited
+constexpr int EGRESS_NOTSENT_LOWAT = 128 * 1024;       // Unsent bytes the kernel may queue per socket
+constexpr int EGRESS_GRANT_TIMEOUT_MS = 250;           // A grant still being written after this leaves the window
+
+// Memory budget for buffered request bodies, file content and PHP output.
+// When it is tight, small files are sent with sendfile() instead of being
+// read into memory, PHP output reads pause and HTTP/2 request bodies stop
+// being credited to the client.
+constexpr size_t MEMORY_BUDGET = 256 * 1024 * 1024;
+constexpr size_t MEMORY_CHARGE_STEP = 64 * 1024;  // PHP output is charged in steps of this size
+constexpr int MEMORY_WAIT_MS = 5000;               // Longest wait for budget before a request gives up
+
+// Request coalescing. Concurrent cache misses for the same file, and
+// identical body-less GET/HEAD requests for the same PHP script, share one
+// read or execution. Followers stop waiting after COALESCE_TIMEOUT_MS and do
+// the work themselves.
+constexpr int COALESCE_TIMEOUT_MS = 10000;
+
+// Static asset cache. Files up to ASSET_CACHE_MAX_FILE_SIZE are kept in memory
+// and shared by every response that serves them; larger files use sendfile().
+constexpr size_t ASSET_CACHE_MAX_BYTES = 64 * 1024 * 1024;
+constexpr size_t ASSET_CACHE_MAX_FILE_SIZE = 256 * 1024;
+
+// Prebuilt asset pack (see pack.cpp). When the file exists it is mapped at
+// startup and the paths it holds are served from the mapping with their
+// precomputed type, ETag and gzip variant; other paths use WEB_ROOT.
+constexpr const char* ASSET_PACK_FILE = "./site.pack";
+
+// Adaptive admission control. Each request class gets its own concurrency
+// limit, moved by the latency gradient between [min_limit, max_limit].
+struct AdmissionClassConfig {
+    const char* name;
+    double initial_limit;
+    double min_limit;
+    double max_limit;
+    int queue_timeout_ms;  // How long a request may wait for a slot
+};
+// Indexed by RequestClass, so listed in its priority order
+const AdmissionClassConfig admission_classes[] = {
+    {"static", 64, 8, 512, 1000},
+    {"native", 64, 8, 512, 1000},
+    {"dynamic", 8, 2, 64, 5000},
+    {"upstream", 32, 4, 256, 5000}
+};
+constexpr size_t MAX_ADMISSION_QUEUE = 256;  // Waiters across all classes
+constexpr double ADMISSION_RTT_TOLERANCE = 1.5;  // Latency growth tolerated before backing off
+
+// Request tracing. Sample rate and slow-request threshold can be changed at
+// runtime through /__admin/trace; dumps go to TRACE_DUMP_FILE on SIGUSR1.
+constexpr double DEFAULT_TRACE_SAMPLE_RATE = 0.0;  // Fraction of requests exported
+constexpr int DEFAULT_SLOW_REQUEST_MS = 1000;      // 0 disables the slow-request log
+constexpr size_t TRACE_EVENTS_PER_THREAD = 4096;   // Ring buffer size per thread
+constexpr size_t TRACE_MAX_SPANS = 32;             // Spans kept per request
+constexpr const char* TRACE_DUMP_FILE = "./trace.json";
+
+// Reverse proxy. Requests whose path starts with a route's prefix are
+// forwarded unchanged to one of its backends over pooled keep-alive
+// connections. Backends are IPv4 "host:port"; longest prefix wins.
+enum class LoadBalancing { RoundRobin, LeastConnections, ConsistentHash };
+struct UpstreamRoute {
+    const char* prefix;
+    vector<string> backends;
+    LoadBalancing balancing;
+};
+const vector<UpstreamRoute> upstream_routes = {
+    // {"/api/", {"127.0.0.1:9001", "127.0.0.1:9002"}, LoadBalancing::LeastConnections},
+};
+constexpr size_t UPSTREAM_POOL_SIZE = 32;          // Idle keep-alive connections kept per backend
+constexpr int UPSTREAM_IDLE_TIMEOUT_SECONDS = 30;  // Idle connections older than this are closed
+constexpr int UPSTREAM_CONNECT_TIMEOUT_MS = 1000;
+constexpr int UPSTREAM_TIMEOUT_SECONDS = 30;       // Per read/write on an upstream connection
+constexpr size_t UPSTREAM_MAX_HEADER_SIZE = 16384;
+constexpr int UPSTREAM_MAX_FAILURES = 5;           // Consecutive failures before ejection
+constexpr int UPSTREAM_EJECTION_SECONDS = 10;      // Doubled for each repeat ejection...
+constexpr int UPSTREAM_MAX_EJECTION_SECONDS = 300; // ...up to this
+constexpr int UPSTREAM_HASH_POINTS = 100;          // Ring points per backend for ConsistentHash
+
+// Traffic capture for replay.cpp. HTTP/1.x requests are recorded with their
+// arrival time, status and body hash; toggle at runtime with /__admin/capture.
+constexpr bool CAPTURE_ON_START = false;
+constexpr const char* CAPTURE_FILE = "./capture.bin";
+constexpr size_t CAPTURE_MAX_REQUEST_BYTES = 65536;      // Larger requests are marked truncated
+constexpr size_t CAPTURE_QUEUE_BYTES = 8 * 1024 * 1024;  // Records are dropped beyond this backlog
+constexpr uint64_t CAPTURE_MAX_FILE_BYTES = 1ull << 30;  // Capture stops at this size
+
+// HTTP/2 configuration
+// Each open stream runs on its own worker thread, so the stream limit is
+// also the per-connection worker pool; it is advertised in SETTINGS.
+constexpr int MAX_H2_CONCURRENT_STREAMS = 16;   // Streams (and workers) per connection
+constexpr int H2_IDLE_TIMEOUT_SECONDS = 30;     // Idle connection lifetime
+constexpr size_t H2_STREAM_SEND_BUFFER = 65536; // Streamed response bytes queued per stream
+
+// TLS configuration (build with -DENABLE_TLS -lssl -lcrypto)
+constexpr int TLS_PORT = 8443;
+constexpr const char* TLS_CERT_FILE = "./cert.pem";
+constexpr const char* TLS_KEY_FILE = "./key.pem";
+constexpr long TLS_SESSION_CACHE_SIZE = 20000;  // Cached sessions for ID-based resumption
+constexpr long TLS_SESSION_TIMEOUT_SECONDS = 3600;
+constexpr int TLS_TICKETS_PER_HANDSHAKE = 2;
 
 // Global thread management
 atomic<int> active_threads{0};
 mutex connections_mutex;
 unordered_map<string, int> ip_connections;
 
+#ifdef ENABLE_TLS
+// Shared by every TLS connection so session tickets and cached sessions
+// issued on one connection resume on any other
+SSL_CTX* tls_context = nullptr;
+#endif
+
 // MIME type mappings
 const unordered_map<string, string> mime_types = {
     {".html", "text/html"},
@@ -66,34 +210,304 @@ const unordered_map<string, string> mime_types = {
     {".xml", "application/xml"}
 };
 
+// Request classes for admission control, in priority order: when the wait
+// queue overflows, waiters of the lowest-priority class are shed first.
+// Native handlers rank right after static files, so health checks keep
+// answering while PHP and proxied requests are shed.
+enum class RequestClass { Static = 0, Native = 1, Dynamic = 2, Upstream = 3 };
+constexpr size_t REQUEST_CLASS_COUNT = 4;
+static_assert(size(admission_classes) == REQUEST_CLASS_COUNT);
+
+class AdmissionController;
+
+// A granted concurrency slot. The slot is held until the response has been
+// sent; the latency sample is taken when the handler completes.
+class AdmissionPermit {
+public:
+    AdmissionPermit(AdmissionController& controller, RequestClass request_class)
+        : controller_(controller), request_class_(request_class), start_(chrono::steady_clock::now()) {}
+    ~AdmissionPermit();
+    AdmissionPermit(const AdmissionPermit&) = delete;
+    AdmissionPermit& operator=(const AdmissionPermit&) = delete;
+
+    // Record the handler latency for this request
+    void complete();
+
+private:
+    AdmissionController& controller_;
+    RequestClass request_class_;
+    chrono::steady_clock::time_point start_;
+    bool completed_ = false;
+};
+
+// Adaptive concurrency limiter with per-class limits and a shared deadline
+// queue. Limits follow the gradient between long-term and recent latency
+// (Gradient2): latency rising above the baseline shrinks the limit, stable
+// latency lets it grow by about sqrt(limit) headroom.
+class AdmissionController {
+public:
+    AdmissionController();
+
+    // Wait for a slot in the class. Returns null when the request was shed
+    // or its queue deadline passed.
+    shared_ptr<AdmissionPermit> acquire(RequestClass request_class);
+
+    string stats();
+
+private:
+    friend class AdmissionPermit;
+
+    struct Waiter {
+        RequestClass request_class;
+        condition_variable ready;
+        bool granted = false;
+        bool shed = false;
+    };
+
+    struct ClassState {
+        double limit = 0;
+        int in_flight = 0;
+        double short_rtt_ns = 0;  // Fast-moving average of recent latency
+        double long_rtt_ns = 0;   // Slow-moving baseline
+        list<Waiter*> queue;      // Oldest first
+        uint64_t admitted = 0;
+        uint64_t shed = 0;
+        uint64_t timed_out = 0;
+    };
+
+    void release(RequestClass request_class);
+    void record_latency(RequestClass request_class, chrono::nanoseconds latency);
+    void grant_waiters(ClassState& state);
+
+    mutex lock_;
+    ClassState classes_[REQUEST_CLASS_COUNT];
+    size_t waiting_ = 0;
+};
+
+// Request methods the server implements
+const unordered_set<string> allowed_methods = {"GET", "POST", "HEAD"};
+
 // HTTP status codes
 const unordered_map<int, string> status_messages = {
+    {100, "Continue"},
+    {101, "Switching Protocols"},
     {200, "OK"},
+    {201, "Created"},
+    {204, "No Content"},
+    {301, "Moved Permanently"},
+    {302, "Found"},
+    {303, "See Other"},
+    {304, "Not Modified"},
+    {307, "Temporary Redirect"},
+    {308, "Permanent Redirect"},
     {400, "Bad Request"},
+    {401, "Unauthorized"},
     {403, "Forbidden"},
     {404, "Not Found"},
     {405, "Method Not Allowed"},
     {413, "Payload Too Large"},
     {414, "URI Too Long"},
     {500, "Internal Server Error"},
+    {502, "Bad Gateway"},
     {503, "Service Unavailable"}
 };
 
+class BufferChain;
+struct EgressFlow;
+
+// A client byte stream, optionally wrapped in TLS. All socket I/O goes
+// through here so the HTTP layer doesn't care which one it is talking to.
+struct Connection {
+    int fd = -1;
+#ifdef ENABLE_TLS
+    SSL* ssl = nullptr;
+    bool ktls_send = false;  // Kernel encrypts records, so sendfile stays zero-copy
+#endif
+    EgressFlow* egress = nullptr;  // Egress scheduler state, when responses are scheduled
+
+    bool wait_readable(int timeout_ms);
+    bool wait_writable(int timeout_ms);
+    size_t send_space();
+    ssize_t recv_some(char* buffer, size_t length);
+    bool send_all(const void* data, size_t length);
+    bool send_iov(struct iovec* iov, size_t count);
+    bool send_file(int file_fd, off_t offset, size_t length);
+    bool send_chain(string_view prefix, const BufferChain& chain, size_t offset = 0, size_t length = SIZE_MAX);
+};
+
+// Owned file descriptor, closed when the last reference goes away
+struct FileDescriptor {
+    int fd;
+    explicit FileDescriptor(int fd) : fd(fd) {}
+    ~FileDescriptor() { close(fd); }
+    FileDescriptor(const FileDescriptor&) = delete;
+    FileDescriptor& operator=(const FileDescriptor&) = delete;
+};
+
+// An immutable run of response bytes. Memory slices point into storage kept
+// alive by owner (or into static storage when owner is null); file slices
+// name a byte range of an open file that is sent with sendfile(). Slices are
+// cheap to copy, so one cached body can back any number of responses.
+struct BufferSlice {
+    shared_ptr<const void> owner;
+    const char* data = nullptr;       // Memory slices
+    shared_ptr<FileDescriptor> file;  // File slices
+    off_t offset = 0;
+    size_t length = 0;
+
+    bool is_file() const { return file != nullptr; }
+};
+
+// A response body as a chain of shared slices, written with writev() and
+// sendfile() without being flattened into one buffer
+class BufferChain {
+public:
+    // Take ownership of a heap buffer
+    void append(string bytes);
+    // Share a buffer that other responses may also be using
+    void append(shared_ptr<const string> bytes);
+    // Bytes in static storage, such as the built-in error pages
+    void append_static(string_view bytes);
+    // Bytes inside storage kept alive by owner, such as a mapped file
+    void append(shared_ptr<const void> owner, string_view bytes);
+    void append_file(shared_ptr<FileDescriptor> file, off_t offset, size_t length);
+    void append(const BufferChain& other);
+
+    size_t size() const { return size_; }
+    bool empty() const { return size_ == 0; }
+    const vector<BufferSlice>& slices() const { return slices_; }
+
+    // Drop the first length bytes, e.g. once they have been sent
+    void remove_prefix(size_t length);
+
+private:
+    void push(BufferSlice slice);
+
+    vector<BufferSlice> slices_;
+    size_t size_ = 0;
+};
+
+// A request body consumed incrementally by the handler, whichever protocol
+// it arrives over
+class RequestBody {
+public:
+    virtual ~RequestBody() = default;
+
+    // What read_some() returns when nothing arrived within its timeout
+    static constexpr ssize_t WOULD_BLOCK = -2;
+
+    // Read up to length decoded body bytes. Returns >0 bytes, 0 at end of body, -1 on error
+    virtual ssize_t read(char* out, size_t length) = 0;
+
+    // Like read(), but wait at most timeout_ms for the peer. Returns
+    // WOULD_BLOCK, with the body left intact, if nothing is ready by then.
+    virtual ssize_t read_some(char* out, size_t length, int timeout_ms) = 0;
+
+    // Descriptor that turns readable when read_some() may make progress
+    virtual int wait_fd() = 0;
+
+    virtual bool finished() const = 0;
+    virtual bool failed() const = 0;
+    virtual bool too_large() const = 0;
+    virtual size_t total() const = 0;
+
+    // Discard the rest of the body so the client sees our response instead of a reset
+    void drain();
+};
+
+// Incremental reader for a message body framed by Content-Length, chunked
+// transfer coding or (upstream responses only) connection close. Bytes are
+// pulled from the socket only as the consumer asks for them, so a slow
+// consumer throttles the sender through TCP flow control.
+class BodyReader : public RequestBody {
+public:
+    // Content length meaning "until the peer closes the connection"
+    static constexpr size_t UNTIL_CLOSE = SIZE_MAX;
+
+    BodyReader(Connection& conn, string buffered, size_t content_length, bool chunked, bool expect_continue,
+               size_t max_size = MAX_BODY_SIZE, int timeout_seconds = REQUEST_TIMEOUT_SECONDS)
+        : conn_(conn), buffer_(move(buffered)), remaining_(content_length),
+          chunked_(chunked), expect_continue_(expect_continue),
+          max_size_(max_size), timeout_seconds_(timeout_seconds) {
+        state_ = chunked ? State::ChunkSize : (content_length > 0 ? State::Data : State::Done);
+    }
+
+    ssize_t read(char* out, size_t length) override;
+    ssize_t read_some(char* out, size_t length, int timeout_ms) override;
+    int wait_fd() override { return conn_.fd; }
+
+    bool finished() const override { return state_ == State::Done; }
+    bool failed() const override { return state_ == State::Error; }
+    bool too_large() const override { return too_large_; }
+    size_t total() const override { return total_; }
+
+    // Bytes received past the end of the body, which rule out connection reuse
+    bool has_excess() const { return pos_ < buffer_.size(); }
+
+    // Copy raw bytes read from the socket to sink, up to limit bytes in total
+    void tap(string* sink, size_t limit) {
+        tap_ = sink;
+        tap_limit_ = limit;
+    }
+    bool tap_overflowed() const { return tap_overflowed_; }
+
+private:
+    enum class State { ChunkSize, Data, ChunkDataEnd, Trailers, Done, Error };
+
+    bool fill(int timeout_ms);
+    bool read_line(string& line, int timeout_ms);
+
+    Connection& conn_;
+    string buffer_;
+    size_t pos_ = 0;
+    size_t remaining_;
+    size_t total_ = 0;
+    bool chunked_;
+    bool expect_continue_;
+    size_t max_size_;
+    int timeout_seconds_;
+    bool too_large_ = false;
+    bool closed_ = false;
+    bool timed_out_ = false;  // The last fill() failed only because the peer was quiet
+    State state_;
+    string* tap_ = nullptr;
+    size_t tap_limit_ = 0;
+    bool tap_overflowed_ = false;
+};
+
 struct HttpRequest {
     string method;
     string path;
     string version;
     unordered_map<string, string> headers;
-    string body;
+    size_t content_length = 0;
+    bool chunked = false;  // Body length not known up front
+    RequestBody* body = nullptr;  // Streaming body, null when the request has none
+    int error_status = 400;
     bool valid = false;
+
+    bool has_body() const { return chunked || content_length > 0; }
+};
+
+// Response body produced while it is being sent, such as a proxied upstream
+// response
+class ResponseStream {
+public:
+    virtual ~ResponseStream() = default;
+
+    // Read up to length body bytes. Returns >0 bytes, 0 at end of body, -1 on error
+    virtual ssize_t read(char* out, size_t length) = 0;
+
+    // Body length, when the producer declared it up front
+    virtual optional<size_t> length() const = 0;
 };
 
 struct HttpResponse {
     int status_code = 200;
     unordered_map<string, string> headers;
-    string body;
-    vector<uint8_t> binary_data;
-    bool is_binary = false;
+    BufferChain body;
+    shared_ptr<ResponseStream> stream;  // Sent after body, when set
+    shared_ptr<AdmissionPermit> permit;  // Concurrency slot held until the response is sent
 };
 
 // Utility functions
@@ -107,517 +521,5643 @@ void log_info(const string& message) {
          << ": " << message << endl;
 }
 
-// URL decode function
-string url_decode(const string& encoded) {
-    string decoded;
-    decoded.reserve(encoded.length());
-    
-    for (size_t i = 0; i < encoded.length(); ++i) {
-        if (encoded[i] == '%' && i + 2 < encoded.length()) {
-            try {
-                int value = stoi(encoded.substr(i + 1, 2), nullptr, 16);
-                if (value >= 0 && value <= 255) {
-                    decoded += static_cast<char>(value);
-                    i += 2;
-                } else {
-                    decoded += encoded[i];
-                }
-            } catch (...) {
-                decoded += encoded[i];
-            }
-        } else if (encoded[i] == '+') {
-            decoded += ' ';
-        } else {
-            decoded += encoded[i];
-        }
+bool Connection::wait_readable(int timeout_ms) {
+#ifdef ENABLE_TLS
+    // Records already decrypted by OpenSSL won't show up on the socket
+    if (ssl && SSL_pending(ssl) > 0) {
+        return true;
     }
-    return decoded;
+#endif
+    struct pollfd pfd = {fd, POLLIN, 0};
+    return poll(&pfd, 1, timeout_ms) > 0;
 }
 
-// Sanitize path to prevent directory traversal
-string sanitize_path(const string& path) {
-    if (path.empty() || path[0] != '/') {
-        return "";
+bool Connection::wait_writable(int timeout_ms) {
+    struct pollfd pfd = {fd, POLLOUT, 0};
+    return poll(&pfd, 1, timeout_ms) > 0 && !(pfd.revents & (POLLERR | POLLHUP));
+}
+
+// Bytes the socket should take without blocking: room in the send buffer,
+// and under TCP_NOTSENT_LOWAT when the scheduler set it. An estimate, since
+// the kernel also counts buffer overhead.
+size_t Connection::send_space() {
+    int buffer_size = 0;
+    socklen_t option_length = sizeof(buffer_size);
+    int queued = 0;
+    int unsent = 0;
+    if (getsockopt(fd, SOL_SOCKET, SO_SNDBUF, &buffer_size, &option_length) == -1 ||
+        ioctl(fd, SIOCOUTQ, &queued) == -1 || ioctl(fd, SIOCOUTQNSD, &unsent) == -1) {
+        return SIZE_MAX;
     }
-    
-    // URL decode first
-    string decoded = url_decode(path);
-    
-    // Reject paths with null bytes or other dangerous characters
-    if (decoded.find('\0') != string::npos || 
-        decoded.find("..") != string::npos ||
-        decoded.find('\\') != string::npos) {
-        return "";
+    size_t space = buffer_size > queued ? buffer_size - queued : 0;
+    if (egress) {
+        space = min<size_t>(space, unsent < EGRESS_NOTSENT_LOWAT ? EGRESS_NOTSENT_LOWAT - unsent : 0);
     }
-    
-    // Convert to filesystem path
-    fs::path requested_path = fs::path(WEB_ROOT) / decoded.substr(1);
-    
-    try {
-        // Get canonical path to resolve any remaining .. or symlinks
-        fs::path canonical = fs::canonical(fs::path(WEB_ROOT));
-        fs::path target;
-        
-        if (fs::exists(requested_path)) {
-            target = fs::canonical(requested_path);
-        } else {
-            target = fs::weakly_canonical(requested_path);
+    return space;
+}
+
+ssize_t Connection::recv_some(char* buffer, size_t length) {
+#ifdef ENABLE_TLS
+    if (ssl) {
+        int bytes_read = SSL_read(ssl, buffer, static_cast<int>(min(length, size_t(INT32_MAX))));
+        if (bytes_read <= 0) {
+            return SSL_get_error(ssl, bytes_read) == SSL_ERROR_ZERO_RETURN ? 0 : -1;
         }
-        
-        // Ensure the resolved path is within web root
-        string canonical_str = canonical.string();
-        string target_str = target.string();
-        
-        if (target_str.substr(0, canonical_str.length()) != canonical_str) {
-            return "";  // Path traversal attempt
+        return bytes_read;
+    }
+#endif
+    return recv(fd, buffer, length, 0);
+}
+
+bool Connection::send_all(const void* data, size_t length) {
+    const char* bytes = static_cast<const char*>(data);
+    while (length > 0) {
+        ssize_t sent;
+#ifdef ENABLE_TLS
+        if (ssl) {
+            sent = SSL_write(ssl, bytes, static_cast<int>(min(length, size_t(INT32_MAX))));
+        } else
+#endif
+        {
+            sent = send(fd, bytes, length, MSG_NOSIGNAL);
         }
-        
-        return target.string();
-    } catch (const fs::filesystem_error&) {
-        return "";
+        if (sent <= 0) {
+            if (sent == -1 && errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+        bytes += sent;
+        length -= sent;
     }
+    return true;
 }
 
-// Check if file is forbidden (hidden/system files)
-bool is_forbidden_file(const string& path) {
-    fs::path p(path);
-    string filename = p.filename().string();
-    
-    // Reject hidden files and dangerous extensions
-    if (filename.empty() || filename[0] == '.' ||
-        filename == "Thumbs.db" || filename == "desktop.ini" ||
-        path.find("/.") != string::npos) {
+bool Connection::send_file(int file_fd, off_t offset, size_t length) {
+#ifdef ENABLE_TLS
+    if (ssl && !ktls_send) {
+        // Userspace encryption fallback: the bytes have to pass through us
+        char buffer[BODY_BUFFER_SIZE];
+        while (length > 0) {
+            ssize_t bytes_read = pread(file_fd, buffer, min(length, sizeof(buffer)), offset);
+            if (bytes_read <= 0) {
+                return false;
+            }
+            if (!send_all(buffer, bytes_read)) {
+                return false;
+            }
+            offset += bytes_read;
+            length -= bytes_read;
+        }
         return true;
     }
-    
-    // Check for system/config file patterns
-    static const unordered_set<string> forbidden_patterns = {
-        ".htaccess", ".htpasswd", ".git", ".svn", ".env", 
-        "web.config", ".DS_Store", "__pycache__"
-    };
-    
-    for (const auto& pattern : forbidden_patterns) {
-        if (filename.find(pattern) != string::npos) {
-            return true;
+#endif
+    while (length > 0) {
+        ssize_t sent;
+#ifdef ENABLE_TLS
+        if (ssl) {
+            sent = SSL_sendfile(ssl, file_fd, offset, length, 0);
+        } else
+#endif
+        {
+            sent = sendfile(fd, file_fd, &offset, length);
+        }
+        if (sent <= 0) {
+            if (sent == -1 && errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+#ifdef ENABLE_TLS
+        if (ssl) {
+            offset += sent;
         }
+#endif
+        length -= sent;
     }
-    
-    return false;
-}
-
-// Get MIME type from file extension
-string get_mime_type(const string& path) {
-    fs::path p(path);
-    string ext = p.extension().string();
-    transform(ext.begin(), ext.end(), ext.begin(), ::tolower);
-    
-    auto it = mime_types.find(ext);
-    return (it != mime_types.end()) ? it->second : "application/octet-stream";
+    return true;
 }
 
-// Read file with size limit
-bool read_file_safe(const string& filepath, vector<uint8_t>& content) {
-    try {
-        ifstream file(filepath, ios::binary);
-        if (!file.is_open()) {
-            return false;
+// Write a batch of memory buffers, in one sendmsg() per pass on plaintext
+// sockets. The iovec array is consumed.
+bool Connection::send_iov(struct iovec* iov, size_t count) {
+#ifdef ENABLE_TLS
+    if (ssl) {
+        for (size_t i = 0; i < count; ++i) {
+            if (!send_all(iov[i].iov_base, iov[i].iov_len)) {
+                return false;
+            }
         }
-        
-        // Get file size
-        file.seekg(0, ios::end);
-        size_t file_size = file.tellg();
-        file.seekg(0, ios::beg);
-        
-        if (file_size > MAX_FILE_SIZE) {
-            log_error("File too large: " + filepath);
+        return true;
+    }
+#endif
+    while (count > 0) {
+        struct msghdr message = {};
+        message.msg_iov = iov;
+        message.msg_iovlen = count;
+        ssize_t sent = sendmsg(fd, &message, MSG_NOSIGNAL);
+        if (sent <= 0) {
+            if (sent == -1 && errno == EINTR) {
+                continue;
+            }
             return false;
         }
-        
-        content.resize(file_size);
-        file.read(reinterpret_cast<char*>(content.data()), file_size);
-        
-        return file.good() || file.eof();
-    } catch (...) {
-        return false;
+        while (count > 0 && static_cast<size_t>(sent) >= iov->iov_len) {
+            sent -= iov->iov_len;
+            ++iov;
+            --count;
+        }
+        if (count > 0) {
+            iov->iov_base = static_cast<char*>(iov->iov_base) + sent;
+            iov->iov_len -= sent;
+        }
     }
+    return true;
 }
 
-// Parse HTTP request with proper validation
-HttpRequest parse_request(const string& raw_request) {
-    HttpRequest request;
-    istringstream stream(raw_request);
-    string line;
-    
-    // Parse request line
-    if (!getline(stream, line) || line.empty()) {
-        return request;
-    }
-    
-    // Remove carriage return if present
-    if (!line.empty() && line.back() == '\r') {
-        line.pop_back();
-    }
-    
-    istringstream request_line(line);
-    if (!(request_line >> request.method >> request.path >> request.version)) {
-        return request;
+// Write prefix followed by length bytes of chain starting at offset. Runs of
+// memory slices are gathered into one writev-style send; file slices go
+// through send_file().
+bool Connection::send_chain(string_view prefix, const BufferChain& chain, size_t offset, size_t length) {
+    constexpr size_t MAX_IOV = 64;
+    struct iovec iov[MAX_IOV];
+    size_t count = 0;
+    if (!prefix.empty()) {
+        iov[count++] = {const_cast<char*>(prefix.data()), prefix.size()};
     }
-    
-    // Validate HTTP method
-    static const unordered_set<string> allowed_methods = {"GET", "POST", "HEAD"};
-    if (allowed_methods.find(request.method) == allowed_methods.end()) {
-        return request;
+
+    for (const BufferSlice& slice : chain.slices()) {
+        if (length == 0) {
+            break;
+        }
+        if (offset >= slice.length) {
+            offset -= slice.length;
+            continue;
+        }
+        size_t take = min(slice.length - offset, length);
+        if (slice.is_file() || count == MAX_IOV) {
+            if (count > 0 && !send_iov(iov, count)) {
+                return false;
+            }
+            count = 0;
+        }
+        if (slice.is_file()) {
+            if (!send_file(slice.file->fd, slice.offset + offset, take)) {
+                return false;
+            }
+        } else {
+            iov[count++] = {const_cast<char*>(slice.data + offset), take};
+        }
+        offset = 0;
+        length -= take;
     }
-    
-    // Validate HTTP version
-    if (request.version != "HTTP/1.0" && request.version != "HTTP/1.1") {
-        return request;
+    return count == 0 || send_iov(iov, count);
+}
+
+void BufferChain::push(BufferSlice slice) {
+    if (slice.length == 0) {
+        return;
     }
-    
-    // Parse headers
-    size_t content_length = 0;
+    size_ += slice.length;
+    slices_.push_back(move(slice));
+}
+
+void BufferChain::append(string bytes) {
+    append(make_shared<const string>(move(bytes)));
+}
+
+void BufferChain::append(shared_ptr<const string> bytes) {
+    BufferSlice slice;
+    slice.data = bytes->data();
+    slice.length = bytes->size();
+    slice.owner = move(bytes);
+    push(move(slice));
+}
+
+void BufferChain::append_static(string_view bytes) {
+    BufferSlice slice;
+    slice.data = bytes.data();
+    slice.length = bytes.size();
+    push(move(slice));
+}
+
+void BufferChain::append(shared_ptr<const void> owner, string_view bytes) {
+    BufferSlice slice;
+    slice.owner = move(owner);
+    slice.data = bytes.data();
+    slice.length = bytes.size();
+    push(move(slice));
+}
+
+void BufferChain::append_file(shared_ptr<FileDescriptor> file, off_t offset, size_t length) {
+    BufferSlice slice;
+    slice.file = move(file);
+    slice.offset = offset;
+    slice.length = length;
+    push(move(slice));
+}
+
+void BufferChain::append(const BufferChain& other) {
+    for (const BufferSlice& slice : other.slices_) {
+        push(slice);
+    }
+}
+
+void BufferChain::remove_prefix(size_t length) {
+    length = min(length, size_);
+    size_ -= length;
+    size_t whole = 0;
+    while (whole < slices_.size() && length >= slices_[whole].length) {
+        length -= slices_[whole++].length;
+    }
+    slices_.erase(slices_.begin(), slices_.begin() + whole);
+    if (length > 0) {
+        BufferSlice& front = slices_.front();
+        if (front.is_file()) {
+            front.offset += length;
+        } else {
+            front.data += length;
+        }
+        front.length -= length;
+    }
+}
+
+// ---------------------------------------------------------------------------
+// Request tracing
+// ---------------------------------------------------------------------------
+
+atomic<uint32_t> trace_sample_ppm{static_cast<uint32_t>(DEFAULT_TRACE_SAMPLE_RATE * 1000000)};
+atomic<uint32_t> slow_request_ms{DEFAULT_SLOW_REQUEST_MS};
+atomic<uint64_t> next_request_id{1};
+
+uint64_t monotonic_ns() {
+    return chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+struct TraceEvent {
+    const char* name;
+    char detail[64];  // Request line for the top-level span, empty otherwise
+    uint64_t start_ns;
+    uint64_t duration_ns;
+    uint64_t request_id;
+    uint32_t tid;
+};
+
+// Ring of finished events for one thread. The lock is only contended while a dump runs.
+struct TraceBuffer {
+    mutex lock;
+    vector<TraceEvent> events = vector<TraceEvent>(TRACE_EVENTS_PER_THREAD);
+    size_t next = 0;
+    size_t count = 0;
+};
+
+// Buffers are recycled as connection threads come and go, so memory stays
+// bounded by peak thread count while events outlive the thread that wrote them
+class TraceRegistry {
+public:
+    TraceBuffer* acquire() {
+        lock_guard<mutex> lock(lock_);
+        if (!free_.empty()) {
+            TraceBuffer* buffer = free_.back();
+            free_.pop_back();
+            return buffer;
+        }
+        buffers_.push_back(make_unique<TraceBuffer>());
+        return buffers_.back().get();
+    }
+
+    void release(TraceBuffer* buffer) {
+        lock_guard<mutex> lock(lock_);
+        free_.push_back(buffer);
+    }
+
+    // Write every buffered event as Chrome trace-event JSON
+    void dump(ostream& out);
+
+private:
+    mutex lock_;
+    vector<unique_ptr<TraceBuffer>> buffers_;
+    vector<TraceBuffer*> free_;
+};
+
+TraceRegistry trace_registry;
+
+struct ThreadTraceBuffer {
+    TraceBuffer* buffer = nullptr;
+    ~ThreadTraceBuffer() {
+        if (buffer) {
+            trace_registry.release(buffer);
+        }
+    }
+};
+thread_local ThreadTraceBuffer thread_trace_buffer;
+
+uint32_t current_tid() {
+    thread_local uint32_t tid = static_cast<uint32_t>(syscall(SYS_gettid));
+    return tid;
+}
+
+// Spans collected for the request running on this thread. Each thread owns
+// one fixed-size slot that is reset per request, so untraced and fast
+// requests cost no allocation; spans are copied out only by finish().
+struct RequestTrace {
+    uint64_t id = 0;
+    bool sampled = false;
+    uint64_t start_ns = 0;
+    char label[64];
+    TraceEvent spans[TRACE_MAX_SPANS];
+    size_t span_count = 0;
+};
+thread_local RequestTrace trace_slot;
+thread_local RequestTrace* current_trace = nullptr;
+
+// Times a stage of the current request; a no-op when the request isn't traced
+class TraceSpan {
+public:
+    explicit TraceSpan(const char* name) : trace_(current_trace), name_(name) {
+        if (trace_) {
+            start_ns_ = monotonic_ns();
+        }
+    }
+
+    ~TraceSpan() {
+        if (trace_ && trace_->span_count < TRACE_MAX_SPANS) {
+            TraceEvent& event = trace_->spans[trace_->span_count++];
+            event.name = name_;
+            event.detail[0] = '\0';
+            event.start_ns = start_ns_;
+            event.duration_ns = monotonic_ns() - start_ns_;
+            event.request_id = trace_->id;
+            event.tid = current_tid();
+        }
+    }
+
+    TraceSpan(const TraceSpan&) = delete;
+    TraceSpan& operator=(const TraceSpan&) = delete;
+
+private:
+    RequestTrace* trace_;
+    const char* name_;
+    uint64_t start_ns_ = 0;
+};
+
+// Owns the trace of one request. Spans are always collected while tracing or
+// the slow-request log is on; at the end they go to the thread's ring buffer
+// if the request was sampled, and to the log if it was slow.
+class RequestTraceScope {
+public:
+    RequestTraceScope() {
+        uint32_t sample_ppm = trace_sample_ppm.load(memory_order_relaxed);
+        if (sample_ppm == 0 && slow_request_ms.load(memory_order_relaxed) == 0) {
+            return;
+        }
+        // The slot is per thread; a nested scope leaves the outer trace alone
+        if (current_trace == &trace_slot) {
+            return;
+        }
+        trace_ = &trace_slot;
+        trace_->id = next_request_id.fetch_add(1, memory_order_relaxed);
+        trace_->sampled = sample_ppm >= 1000000 || (trace_->id * 2654435761u) % 1000000 < sample_ppm;
+        trace_->start_ns = monotonic_ns();
+        trace_->label[0] = '\0';
+        trace_->span_count = 0;
+        current_trace = trace_;
+    }
+
+    ~RequestTraceScope() { finish(); }
+
+    RequestTraceScope(const RequestTraceScope&) = delete;
+    RequestTraceScope& operator=(const RequestTraceScope&) = delete;
+
+    void set_label(string_view method, string_view path) {
+        if (trace_) {
+            snprintf(trace_->label, sizeof(trace_->label), "%.*s %.*s", static_cast<int>(method.size()),
+                     method.data(), static_cast<int>(path.size()), path.data());
+        }
+    }
+
+    // Drop the trace, e.g. when the connection turns out to be HTTP/2
+    void discard() {
+        if (trace_) {
+            current_trace = nullptr;
+            trace_ = nullptr;
+        }
+    }
+
+private:
+    void finish();
+
+    RequestTrace* trace_ = nullptr;
+};
+
+void RequestTraceScope::finish() {
+    if (!trace_) {
+        return;
+    }
+    current_trace = nullptr;
+    
+    uint64_t duration_ns = monotonic_ns() - trace_->start_ns;
+    uint32_t threshold_ms = slow_request_ms.load(memory_order_relaxed);
+    
+    if (threshold_ms > 0 && duration_ns >= threshold_ms * 1000000ull) {
+        stringstream breakdown;
+        breakdown << "Slow request #" << trace_->id << " " << trace_->label << " took "
+                  << duration_ns / 1000000.0 << "ms:";
+        for (size_t i = 0; i < trace_->span_count; ++i) {
+            breakdown << " " << trace_->spans[i].name << "=" << trace_->spans[i].duration_ns / 1000000.0 << "ms";
+        }
+        log_error(breakdown.str());
+    }
+    
+    if (trace_->sampled) {
+        if (!thread_trace_buffer.buffer) {
+            thread_trace_buffer.buffer = trace_registry.acquire();
+        }
+        TraceBuffer& buffer = *thread_trace_buffer.buffer;
+        lock_guard<mutex> lock(buffer.lock);
+        auto append = [&buffer](const TraceEvent& event) {
+            buffer.events[buffer.next] = event;
+            buffer.next = (buffer.next + 1) % buffer.events.size();
+            buffer.count = min(buffer.count + 1, buffer.events.size());
+        };
+        
+        TraceEvent request_event;
+        request_event.name = "request";
+        snprintf(request_event.detail, sizeof(request_event.detail), "%s", trace_->label);
+        request_event.start_ns = trace_->start_ns;
+        request_event.duration_ns = duration_ns;
+        request_event.request_id = trace_->id;
+        request_event.tid = current_tid();
+        append(request_event);
+        for (size_t i = 0; i < trace_->span_count; ++i) {
+            append(trace_->spans[i]);
+        }
+    }
+    trace_ = nullptr;
+}
+
+string json_escape(const string& value) {
+    string escaped;
+    for (char c : value) {
+        if (c == '"' || c == '\\') {
+            escaped += '\\';
+            escaped += c;
+        } else if (static_cast<unsigned char>(c) < 0x20) {
+            char hex[8];
+            snprintf(hex, sizeof(hex), "\\u%04x", c);
+            escaped += hex;
+        } else {
+            escaped += c;
+        }
+    }
+    return escaped;
+}
+
+void TraceRegistry::dump(ostream& out) {
+    // Snapshot the buffer list; buffers are never freed, only recycled
+    vector<TraceBuffer*> buffers;
+    {
+        lock_guard<mutex> lock(lock_);
+        for (auto& buffer : buffers_) {
+            buffers.push_back(buffer.get());
+        }
+    }
+    
+    out << fixed << setprecision(3);
+    out << "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[";
+    bool first = true;
+    pid_t pid = getpid();
+    for (TraceBuffer* buffer : buffers) {
+        lock_guard<mutex> lock(buffer->lock);
+        size_t start = (buffer->next + buffer->events.size() - buffer->count) % buffer->events.size();
+        for (size_t i = 0; i < buffer->count; ++i) {
+            const TraceEvent& event = buffer->events[(start + i) % buffer->events.size()];
+            out << (first ? "" : ",") << "{\"name\":\"" << event.name
+                << "\",\"cat\":\"http\",\"ph\":\"X\",\"ts\":" << event.start_ns / 1000.0
+                << ",\"dur\":" << event.duration_ns / 1000.0
+                << ",\"pid\":" << pid << ",\"tid\":" << event.tid
+                << ",\"args\":{\"request\":" << event.request_id;
+            if (event.detail[0]) {
+                out << ",\"detail\":\"" << json_escape(event.detail) << "\"";
+            }
+            out << "}}";
+            first = false;
+        }
+    }
+    out << "]}";
+}
+
+// Write the trace to TRACE_DUMP_FILE each time SIGUSR1 arrives
+void trace_dump_thread() {
+    sigset_t signals;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGUSR1);
+    
+    while (true) {
+        int signal_number;
+        if (sigwait(&signals, &signal_number) != 0) {
+            continue;
+        }
+        ofstream file(TRACE_DUMP_FILE, ios::trunc);
+        trace_registry.dump(file);
+        if (file.good()) {
+            log_info("Trace written to " + string(TRACE_DUMP_FILE));
+        } else {
+            log_error("Failed to write trace to " + string(TRACE_DUMP_FILE));
+        }
+    }
+}
+
+// ---------------------------------------------------------------------------
+// Traffic capture
+// ---------------------------------------------------------------------------
+
+// Records requests to CAPTURE_FILE for replay.cpp. Request threads only
+// serialize a record and queue it; a writer thread does the file I/O. When
+// the writer falls CAPTURE_QUEUE_BYTES behind, records are dropped (and
+// counted) rather than slowing requests down.
+class TrafficCapture {
+public:
+    bool enabled() const { return enabled_.load(memory_order_relaxed); }
+
+    // Begin a new capture, replacing any previous file
+    bool start();
+    // Stop capturing once queued records are on disk
+    void stop();
+
+    void record(chrono::steady_clock::time_point arrival, const string& request, bool truncated,
+                bool tls, const HttpResponse& response);
+
+    string stats();
+
+    void writer_loop();
+
+private:
+    atomic<bool> enabled_{false};
+    mutex lock_;
+    condition_variable ready_;
+    condition_variable closed_;
+    deque<string> queue_;
+    size_t queued_bytes_ = 0;
+    bool close_requested_ = false;
+    int fd_ = -1;
+    chrono::steady_clock::time_point start_;
+    uint64_t file_bytes_ = 0;
+    uint64_t records_ = 0;
+    uint64_t dropped_ = 0;
+};
+
+TrafficCapture traffic_capture;
+
+bool TrafficCapture::start() {
+    stop();
+    int fd = open(CAPTURE_FILE, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    if (fd == -1) {
+        log_error("Failed to open capture file " + string(CAPTURE_FILE) + ": " + strerror(errno));
+        return false;
+    }
+    
+    lock_guard<mutex> lock(lock_);
+    fd_ = fd;
+    start_ = chrono::steady_clock::now();
+    queue_.emplace_back(CAPTURE_MAGIC, sizeof(CAPTURE_MAGIC));
+    queued_bytes_ = file_bytes_ = sizeof(CAPTURE_MAGIC);
+    records_ = dropped_ = 0;
+    enabled_ = true;
+    ready_.notify_one();
+    log_info("Capturing traffic to " + string(CAPTURE_FILE));
+    return true;
+}
+
+void TrafficCapture::stop() {
+    unique_lock<mutex> lock(lock_);
+    enabled_ = false;
+    if (fd_ == -1) {
+        return;
+    }
+    close_requested_ = true;
+    ready_.notify_one();
+    closed_.wait(lock, [this] { return fd_ == -1; });
+    log_info("Traffic capture stopped after " + to_string(records_) + " records");
+}
+
+void TrafficCapture::record(chrono::steady_clock::time_point arrival, const string& request, bool truncated,
+                            bool tls, const HttpResponse& response) {
+    CaptureRecord record;
+    record.status = static_cast<uint16_t>(response.status_code);
+    record.flags = (truncated ? CAPTURE_TRUNCATED : 0) | (tls ? CAPTURE_TLS : 0);
+    
+    // Hash in-memory bodies only; reading files or streams back would cost
+    // more than the request did
+    if (!response.stream) {
+        record.response_length = response.body.size();
+        record.flags |= CAPTURE_LENGTH_KNOWN;
+        bool in_memory = none_of(response.body.slices().begin(), response.body.slices().end(),
+                                 [](const BufferSlice& slice) { return slice.is_file(); });
+        if (in_memory) {
+            record.body_hash = CAPTURE_HASH_SEED;
+            for (const BufferSlice& slice : response.body.slices()) {
+                record.body_hash = capture_hash(record.body_hash, slice.data, slice.length);
+            }
+            record.flags |= CAPTURE_BODY_HASHED;
+        }
+    } else if (auto stream_length = response.stream->length()) {
+        record.response_length = response.body.size() + *stream_length;
+        record.flags |= CAPTURE_LENGTH_KNOWN;
+    }
+    
+    lock_guard<mutex> lock(lock_);
+    if (!enabled_) {
+        return;
+    }
+    record.arrival_ns = arrival > start_ ? chrono::duration_cast<chrono::nanoseconds>(arrival - start_).count() : 0;
+    string encoded = encode_capture_record(record, request);
+    if (file_bytes_ + encoded.size() > CAPTURE_MAX_FILE_BYTES) {
+        log_error("Capture file limit reached, stopping capture");
+        enabled_ = false;
+        close_requested_ = true;
+        ready_.notify_one();
+        return;
+    }
+    if (queued_bytes_ + encoded.size() > CAPTURE_QUEUE_BYTES) {
+        dropped_++;
+        return;
+    }
+    queued_bytes_ += encoded.size();
+    file_bytes_ += encoded.size();
+    records_++;
+    queue_.push_back(move(encoded));
+    ready_.notify_one();
+}
+
+string TrafficCapture::stats() {
+    lock_guard<mutex> lock(lock_);
+    return "{\"enabled\":" + string(enabled_ ? "true" : "false") + ",\"file\":\"" + json_escape(CAPTURE_FILE) +
+           "\",\"records\":" + to_string(records_) + ",\"dropped\":" + to_string(dropped_) +
+           ",\"bytes\":" + to_string(file_bytes_) + "}";
+}
+
+void TrafficCapture::writer_loop() {
+    unique_lock<mutex> lock(lock_);
+    while (true) {
+        ready_.wait(lock, [this] { return !queue_.empty() || close_requested_; });
+        
+        deque<string> batch;
+        batch.swap(queue_);
+        queued_bytes_ = 0;
+        int fd = fd_;
+        lock.unlock();
+        
+        for (const string& chunk : batch) {
+            size_t written = 0;
+            while (written < chunk.size()) {
+                ssize_t result = write(fd, chunk.data() + written, chunk.size() - written);
+                if (result == -1 && errno == EINTR) {
+                    continue;
+                }
+                if (result <= 0) {
+                    log_error("Failed to write capture file: " + string(strerror(errno)));
+                    break;
+                }
+                written += result;
+            }
+        }
+        
+        lock.lock();
+        if (close_requested_ && queue_.empty()) {
+            close(fd_);
+            fd_ = -1;
+            close_requested_ = false;
+            closed_.notify_all();
+        }
+    }
+}
+
+AdmissionController admission;
+
+AdmissionController::AdmissionController() {
+    for (size_t i = 0; i < REQUEST_CLASS_COUNT; ++i) {
+        classes_[i].limit = admission_classes[i].initial_limit;
+    }
+}
+
+shared_ptr<AdmissionPermit> AdmissionController::acquire(RequestClass request_class) {
+    size_t class_index = static_cast<size_t>(request_class);
+    const AdmissionClassConfig& config = admission_classes[class_index];
+    ClassState& state = classes_[class_index];
+    
+    TraceSpan span("admission");
+    unique_lock<mutex> lock(lock_);
+    if (state.queue.empty() && state.in_flight < static_cast<int>(state.limit)) {
+        state.in_flight++;
+        state.admitted++;
+        return make_shared<AdmissionPermit>(*this, request_class);
+    }
+    
+    // Queue full: shed the oldest waiter of the lowest-priority class that
+    // isn't above ours, or this request if only higher-priority work waits
+    if (waiting_ >= MAX_ADMISSION_QUEUE) {
+        Waiter* victim = nullptr;
+        for (size_t i = REQUEST_CLASS_COUNT; i-- > class_index;) {
+            if (!classes_[i].queue.empty()) {
+                victim = classes_[i].queue.front();
+                classes_[i].queue.pop_front();
+                classes_[i].shed++;
+                break;
+            }
+        }
+        if (!victim) {
+            state.shed++;
+            return nullptr;
+        }
+        victim->shed = true;
+        waiting_--;
+        victim->ready.notify_one();
+    }
+    
+    Waiter waiter;
+    waiter.request_class = request_class;
+    auto position = state.queue.insert(state.queue.end(), &waiter);
+    waiting_++;
+    
+    auto deadline = chrono::steady_clock::now() + chrono::milliseconds(config.queue_timeout_ms);
+    bool signalled = waiter.ready.wait_until(lock, deadline, [&] { return waiter.granted || waiter.shed; });
+    
+    if (!signalled) {
+        state.queue.erase(position);
+        waiting_--;
+        state.timed_out++;
+        return nullptr;
+    }
+    if (waiter.shed) {
+        return nullptr;
+    }
+    return make_shared<AdmissionPermit>(*this, request_class);
+}
+
+// Hand freed slots to the oldest waiters. Caller holds lock_.
+void AdmissionController::grant_waiters(ClassState& state) {
+    while (!state.queue.empty() && state.in_flight < static_cast<int>(state.limit)) {
+        Waiter* waiter = state.queue.front();
+        state.queue.pop_front();
+        waiting_--;
+        state.in_flight++;
+        state.admitted++;
+        waiter->granted = true;
+        waiter->ready.notify_one();
+    }
+}
+
+void AdmissionController::release(RequestClass request_class) {
+    lock_guard<mutex> lock(lock_);
+    ClassState& state = classes_[static_cast<size_t>(request_class)];
+    state.in_flight--;
+    grant_waiters(state);
+}
+
+void AdmissionController::record_latency(RequestClass request_class, chrono::nanoseconds latency) {
+    size_t class_index = static_cast<size_t>(request_class);
+    const AdmissionClassConfig& config = admission_classes[class_index];
+    
+    lock_guard<mutex> lock(lock_);
+    ClassState& state = classes_[class_index];
+    double sample = static_cast<double>(latency.count());
+    
+    if (state.long_rtt_ns == 0) {
+        state.short_rtt_ns = state.long_rtt_ns = sample;
+        return;
+    }
+    state.short_rtt_ns += (sample - state.short_rtt_ns) * 0.1;
+    state.long_rtt_ns += (sample - state.long_rtt_ns) * 0.01;
+    
+    // Let the baseline recover quickly after a period of high latency
+    if (state.long_rtt_ns > state.short_rtt_ns * 2) {
+        state.long_rtt_ns = state.short_rtt_ns * 2;
+    }
+    
+    double gradient = clamp(ADMISSION_RTT_TOLERANCE * state.long_rtt_ns / state.short_rtt_ns, 0.5, 1.0);
+    double new_limit = state.limit * gradient + sqrt(state.limit);
+    
+    // Only grow when the current limit is actually being used
+    if (new_limit > state.limit && state.in_flight < state.limit / 2) {
+        return;
+    }
+    
+    state.limit = clamp(state.limit * 0.8 + new_limit * 0.2, config.min_limit, config.max_limit);
+    grant_waiters(state);
+}
+
+string AdmissionController::stats() {
+    lock_guard<mutex> lock(lock_);
+    stringstream out;
+    out << "{";
+    for (size_t i = 0; i < REQUEST_CLASS_COUNT; ++i) {
+        const ClassState& state = classes_[i];
+        out << (i ? "," : "") << "\"" << admission_classes[i].name << "\":{"
+            << "\"limit\":" << static_cast<int>(state.limit)
+            << ",\"in_flight\":" << state.in_flight
+            << ",\"queued\":" << state.queue.size()
+            << ",\"short_rtt_us\":" << static_cast<uint64_t>(state.short_rtt_ns / 1000)
+            << ",\"long_rtt_us\":" << static_cast<uint64_t>(state.long_rtt_ns / 1000)
+            << ",\"admitted\":" << state.admitted
+            << ",\"shed\":" << state.shed
+            << ",\"timed_out\":" << state.timed_out << "}";
+    }
+    out << "}";
+    return out.str();
+}
+
+void AdmissionPermit::complete() {
+    if (!completed_) {
+        completed_ = true;
+        controller_.record_latency(request_class_, chrono::steady_clock::now() - start_);
+    }
+}
+
+AdmissionPermit::~AdmissionPermit() {
+    complete();
+    controller_.release(request_class_);
+}
+
+// Response for a request shed by admission control
+HttpResponse overloaded_response() {
+    HttpResponse response;
+    response.status_code = 503;
+    response.body.append_static("<html><body><h1>503 Service Unavailable</h1><p>Server busy.</p></body></html>");
+    response.headers["Content-Type"] = "text/html";
+    response.headers["Retry-After"] = "1";
+    return response;
+}
+
+// ---------------------------------------------------------------------------
+// Egress scheduling
+// ---------------------------------------------------------------------------
+
+// Response bytes are classed per quantum: small responses and the first
+// quantum of every response are Priority, the rest of a large one is Bulk
+enum class EgressClass { Priority = 0, Bulk = 1 };
+constexpr size_t EGRESS_CLASS_COUNT = 2;
+const char* const egress_class_names[EGRESS_CLASS_COUNT] = {"priority", "bulk"};
+
+// Token bucket holding at most one quantum. A grant may overdraw it; the
+// debt delays the next one so the average rate holds.
+struct EgressBucket {
+    uint64_t rate;  // Bytes per second, 0 = unlimited
+    double tokens = EGRESS_QUANTUM;
+    chrono::steady_clock::time_point refilled = chrono::steady_clock::now();
+
+    explicit EgressBucket(uint64_t rate) : rate(rate) {}
+
+    // Time until the bucket is positive again; zero when it already is
+    chrono::nanoseconds delay(chrono::steady_clock::time_point now) {
+        if (rate == 0) {
+            return chrono::nanoseconds(0);
+        }
+        tokens = min<double>(EGRESS_QUANTUM, tokens + chrono::duration<double>(now - refilled).count() * rate);
+        refilled = now;
+        return tokens > 0 ? chrono::nanoseconds(0)
+                          : chrono::nanoseconds(static_cast<int64_t>((1 - tokens) * 1e9 / rate));
+    }
+
+    void take(size_t bytes) {
+        if (rate) {
+            tokens -= bytes;
+        }
+    }
+};
+
+// Bytes a flow may write now. Released once written, or reclaimed by the
+// scheduler when the write outlives EGRESS_GRANT_TIMEOUT_MS.
+struct EgressGrant {
+    uint64_t id = 0;
+    size_t bytes = 0;
+};
+
+// Scheduler state of one client connection
+struct EgressFlow {
+    size_t deficit = 0;  // Bytes left in the current round-robin turn
+    EgressBucket rate{EGRESS_CONNECTION_RATE};
+};
+
+// Deficit round-robin over connections with response bytes to send. A turn
+// adds EGRESS_QUANTUM to the flow's deficit and grants up to that much; a
+// flow with deficit left keeps its turn, otherwise it rejoins at the back of
+// its class queue. Priority is served strictly before Bulk, which cannot be
+// starved for long because Priority only ever carries small responses and
+// first quanta. The window caps granted bytes being written at once, so a
+// new small response waits behind at most a window's worth of bulk writes.
+//
+// Callers size their request to what the socket takes without blocking,
+// but a client that stops reading can still hold up a write. Its grant is
+// then reclaimed at the deadline, so stalled readers cannot pin the window
+// and stop egress for everyone else.
+class EgressScheduler {
+public:
+    // Wait for the flow's turn. Returns how many of the wanted bytes may be
+    // written now; release() the grant once they are written.
+    EgressGrant acquire(EgressFlow& flow, size_t wanted, EgressClass egress_class);
+    void release(const EgressGrant& grant);
+
+    string stats();
+
+private:
+    struct Waiter {
+        EgressFlow* flow = nullptr;
+        size_t wanted = 0;
+        chrono::steady_clock::time_point queued;
+        size_t granted = 0;
+        condition_variable ready;
+    };
+
+    struct ClassState {
+        deque<Waiter*> queue;
+        uint64_t grants = 0;
+        uint64_t bytes = 0;
+        uint64_t wait_total_ns = 0;
+        uint64_t wait_max_ns = 0;
+        double wait_recent_ns = 0;  // Moving average of queueing delay
+    };
+
+    // Grant to queued flows while the window and the global rate allow.
+    // Returns how long until dispatch may make progress again: the global
+    // rate cap refilling, or a grant reaching its deadline. Caller holds lock_.
+    chrono::nanoseconds dispatch();
+    void reclaim_expired(chrono::steady_clock::time_point now);
+
+    mutex lock_;
+    ClassState classes_[EGRESS_CLASS_COUNT];
+    size_t in_flight_ = 0;
+    EgressBucket rate_{EGRESS_GLOBAL_RATE};
+    uint64_t next_grant_ = 1;
+    unordered_map<uint64_t, size_t> outstanding_;  // Grant id to bytes counted in in_flight_
+    deque<pair<chrono::steady_clock::time_point, uint64_t>> deadlines_;  // In grant order
+    uint64_t reclaimed_ = 0;
+};
+
+EgressScheduler egress_scheduler;
+
+EgressGrant EgressScheduler::acquire(EgressFlow& flow, size_t wanted, EgressClass egress_class) {
+    // The connection's own cap is served by sitting out until its bucket refills
+    for (auto delay = flow.rate.delay(chrono::steady_clock::now()); delay.count() > 0;
+         delay = flow.rate.delay(chrono::steady_clock::now())) {
+        this_thread::sleep_for(delay);
+    }
+    
+    unique_lock<mutex> lock(lock_);
+    Waiter waiter;
+    waiter.flow = &flow;
+    waiter.wanted = wanted;
+    waiter.queued = chrono::steady_clock::now();
+    deque<Waiter*>& queue = classes_[static_cast<size_t>(egress_class)].queue;
+    if (flow.deficit > 0) {
+        queue.push_front(&waiter);  // Still inside its turn
+    } else {
+        queue.push_back(&waiter);
+    }
+    
+    while (waiter.granted == 0) {
+        auto delay = dispatch();
+        if (waiter.granted > 0) {
+            break;
+        }
+        if (delay.count() > 0) {
+            waiter.ready.wait_for(lock, delay);
+        } else {
+            waiter.ready.wait(lock);
+        }
+    }
+    EgressGrant grant;
+    grant.id = next_grant_++;
+    grant.bytes = waiter.granted;
+    outstanding_[grant.id] = grant.bytes;
+    deadlines_.emplace_back(chrono::steady_clock::now() + chrono::milliseconds(EGRESS_GRANT_TIMEOUT_MS), grant.id);
+    lock.unlock();
+    
+    flow.rate.take(grant.bytes);
+    return grant;
+}
+
+void EgressScheduler::reclaim_expired(chrono::steady_clock::time_point now) {
+    while (!deadlines_.empty() && deadlines_.front().first <= now) {
+        auto it = outstanding_.find(deadlines_.front().second);
+        if (it != outstanding_.end()) {
+            in_flight_ -= it->second;
+            outstanding_.erase(it);
+            reclaimed_++;
+        }
+        deadlines_.pop_front();
+    }
+}
+
+chrono::nanoseconds EgressScheduler::dispatch() {
+    auto now = chrono::steady_clock::now();
+    reclaim_expired(now);
+    while (true) {
+        ClassState* state = nullptr;
+        for (ClassState& candidate : classes_) {
+            if (!candidate.queue.empty()) {
+                state = &candidate;
+                break;
+            }
+        }
+        if (!state) {
+            break;
+        }
+        if (in_flight_ >= EGRESS_WINDOW) {
+            // Full; wake at the next deadline in case the oldest write is stuck
+            return deadlines_.empty() ? chrono::nanoseconds(0)
+                                      : max<chrono::nanoseconds>(deadlines_.front().first - now,
+                                                                 chrono::milliseconds(1));
+        }
+        
+        Waiter* waiter = state->queue.front();
+        auto delay = rate_.delay(now);
+        if (delay.count() > 0) {
+            // Make sure someone is awake to retry once the bucket refills
+            waiter->ready.notify_one();
+            return delay;
+        }
+        state->queue.pop_front();
+        
+        EgressFlow& flow = *waiter->flow;
+        if (flow.deficit == 0) {
+            flow.deficit = EGRESS_QUANTUM;
+        }
+        size_t granted = min(waiter->wanted, flow.deficit);
+        flow.deficit -= granted;
+        in_flight_ += granted;
+        rate_.take(granted);
+        
+        uint64_t waited_ns = chrono::duration_cast<chrono::nanoseconds>(now - waiter->queued).count();
+        state->grants++;
+        state->bytes += granted;
+        state->wait_total_ns += waited_ns;
+        state->wait_max_ns = max(state->wait_max_ns, waited_ns);
+        state->wait_recent_ns += (static_cast<double>(waited_ns) - state->wait_recent_ns) * 0.05;
+        
+        waiter->granted = granted;
+        waiter->ready.notify_one();
+    }
+    return chrono::nanoseconds(0);
+}
+
+void EgressScheduler::release(const EgressGrant& grant) {
+    lock_guard<mutex> lock(lock_);
+    auto it = outstanding_.find(grant.id);
+    if (it != outstanding_.end()) {
+        in_flight_ -= it->second;
+        outstanding_.erase(it);
+    }
+    dispatch();
+}
+
+string EgressScheduler::stats() {
+    lock_guard<mutex> lock(lock_);
+    stringstream out;
+    out << "{\"window\":" << EGRESS_WINDOW << ",\"in_flight\":" << in_flight_
+        << ",\"global_rate\":" << EGRESS_GLOBAL_RATE << ",\"connection_rate\":" << EGRESS_CONNECTION_RATE
+        << ",\"reclaimed\":" << reclaimed_;
+    for (size_t i = 0; i < EGRESS_CLASS_COUNT; ++i) {
+        const ClassState& state = classes_[i];
+        out << ",\"" << egress_class_names[i] << "\":{"
+            << "\"queued\":" << state.queue.size()
+            << ",\"grants\":" << state.grants
+            << ",\"bytes\":" << state.bytes
+            << ",\"avg_wait_us\":" << (state.grants ? state.wait_total_ns / state.grants / 1000 : 0)
+            << ",\"recent_wait_us\":" << static_cast<uint64_t>(state.wait_recent_ns / 1000)
+            << ",\"max_wait_us\":" << state.wait_max_ns / 1000 << "}";
+    }
+    out << "}";
+    return out.str();
+}
+
+// Write prefix then chain as the next part of a response, one granted
+// quantum at a time. sent counts response bytes written so far and is
+// advanced; total is the whole response size when known, which together
+// with sent decides each quantum's class.
+bool send_scheduled(Connection& conn, string_view prefix, const BufferChain& chain, size_t& sent,
+                    optional<size_t> total) {
+    size_t length = prefix.size() + chain.size();
+    if (!conn.egress) {
+        if (!conn.send_chain(prefix, chain)) {
+            return false;
+        }
+        sent += length;
+        return true;
+    }
+    
+    bool small = total && *total <= EGRESS_SMALL_RESPONSE;
+    for (size_t done = 0; done < length;) {
+        // Only a socket that can take data competes for a turn
+        if (!conn.wait_writable(REQUEST_TIMEOUT_SECONDS * 1000)) {
+            return false;
+        }
+        
+        // Ask only for what the socket takes without blocking
+        size_t wanted = min(length - done, max<size_t>(conn.send_space(), 1));
+        bool priority = small || sent < EGRESS_QUANTUM;
+        if (!small && priority) {
+            wanted = min(wanted, EGRESS_QUANTUM - sent);
+        }
+        EgressGrant grant = egress_scheduler.acquire(*conn.egress, wanted,
+                                                     priority ? EgressClass::Priority : EgressClass::Bulk);
+        
+        string_view head = done < prefix.size() ? prefix.substr(done, grant.bytes) : string_view();
+        size_t chain_offset = done < prefix.size() ? 0 : done - prefix.size();
+        bool ok = conn.send_chain(head, chain, chain_offset, grant.bytes - head.size());
+        egress_scheduler.release(grant);
+        if (!ok) {
+            return false;
+        }
+        done += grant.bytes;
+        sent += grant.bytes;
+    }
+    return true;
+}
+
+// ---------------------------------------------------------------------------
+// Memory accounting
+// ---------------------------------------------------------------------------
+
+enum class MemoryCategory { RequestBody = 0, FileContent = 1, PhpOutput = 2 };
+constexpr size_t MEMORY_CATEGORY_COUNT = 3;
+const char* const memory_category_names[MEMORY_CATEGORY_COUNT] = {"request_body", "file_content", "php_output"};
+
+// Server-wide count of buffered request bodies, file content and PHP output
+// against MEMORY_BUDGET. reserve() only charges what fits, optionally after
+// waiting for other requests to release; charge() records bytes that have
+// already arrived and may overshoot.
+//
+// A request that already holds budget and waits for more can deadlock with
+// another doing the same, so only one such holder may wait at a time; the
+// others are refused at once and release what they hold.
+class MemoryAccountant {
+public:
+    // held is what the caller already has reserved for the same buffer
+    bool reserve(MemoryCategory category, size_t bytes, int timeout_ms = 0, size_t held = 0);
+    void charge(MemoryCategory category, size_t bytes);
+    void release(MemoryCategory category, size_t bytes);
+
+    // Wait until bytes more would fit in the budget
+    bool wait_headroom(size_t bytes, int timeout_ms);
+
+    string stats();
+
+private:
+    struct CategoryState {
+        size_t used = 0;
+        size_t high_water = 0;
+        uint64_t denied = 0;  // Reservations refused, after any wait
+    };
+
+    void add(CategoryState& state, size_t bytes);
+
+    mutex lock_;
+    condition_variable released_;
+    size_t used_ = 0;
+    size_t high_water_ = 0;
+    uint64_t waits_ = 0;
+    bool holder_waiting_ = false;
+    CategoryState categories_[MEMORY_CATEGORY_COUNT];
+};
+
+MemoryAccountant memory_accountant;
+
+// Caller holds lock_
+void MemoryAccountant::add(CategoryState& state, size_t bytes) {
+    used_ += bytes;
+    high_water_ = max(high_water_, used_);
+    state.used += bytes;
+    state.high_water = max(state.high_water, state.used);
+}
+
+bool MemoryAccountant::reserve(MemoryCategory category, size_t bytes, int timeout_ms, size_t held) {
+    CategoryState& state = categories_[static_cast<size_t>(category)];
+    unique_lock<mutex> lock(lock_);
+    auto fits = [&] { return used_ + bytes <= MEMORY_BUDGET; };
+    if (!fits()) {
+        if (timeout_ms <= 0 || (held > 0 && holder_waiting_)) {
+            state.denied++;
+            return false;
+        }
+        waits_++;
+        if (held > 0) {
+            holder_waiting_ = true;
+        }
+        bool granted = released_.wait_for(lock, chrono::milliseconds(timeout_ms), fits);
+        if (held > 0) {
+            holder_waiting_ = false;
+        }
+        if (!granted) {
+            state.denied++;
+            return false;
+        }
+    }
+    add(state, bytes);
+    return true;
+}
+
+void MemoryAccountant::charge(MemoryCategory category, size_t bytes) {
+    lock_guard<mutex> lock(lock_);
+    add(categories_[static_cast<size_t>(category)], bytes);
+}
+
+void MemoryAccountant::release(MemoryCategory category, size_t bytes) {
+    {
+        lock_guard<mutex> lock(lock_);
+        used_ -= bytes;
+        categories_[static_cast<size_t>(category)].used -= bytes;
+    }
+    released_.notify_all();
+}
+
+bool MemoryAccountant::wait_headroom(size_t bytes, int timeout_ms) {
+    unique_lock<mutex> lock(lock_);
+    auto fits = [&] { return used_ + bytes <= MEMORY_BUDGET; };
+    if (fits()) {
+        return true;
+    }
+    waits_++;
+    return released_.wait_for(lock, chrono::milliseconds(timeout_ms), fits);
+}
+
+string MemoryAccountant::stats() {
+    lock_guard<mutex> lock(lock_);
+    stringstream out;
+    out << "{\"budget\":" << MEMORY_BUDGET << ",\"used\":" << used_ << ",\"high_water\":" << high_water_
+        << ",\"waits\":" << waits_;
+    for (size_t i = 0; i < MEMORY_CATEGORY_COUNT; ++i) {
+        const CategoryState& state = categories_[i];
+        out << ",\"" << memory_category_names[i] << "\":{"
+            << "\"used\":" << state.used
+            << ",\"high_water\":" << state.high_water
+            << ",\"denied\":" << state.denied << "}";
+    }
+    out << "}";
+    return out.str();
+}
+
+// Bytes charged to the accountant on behalf of one buffer, released when the
+// reservation goes away
+class MemoryReservation {
+public:
+    explicit MemoryReservation(MemoryCategory category) : category_(category) {}
+    ~MemoryReservation() { resize(0); }
+
+    MemoryReservation(MemoryReservation&& other) noexcept
+        : category_(other.category_), bytes_(exchange(other.bytes_, 0)), exhausted_(other.exhausted_) {}
+    MemoryReservation& operator=(MemoryReservation&& other) noexcept {
+        if (this != &other) {
+            resize(0);
+            category_ = other.category_;
+            bytes_ = exchange(other.bytes_, 0);
+            exhausted_ = other.exhausted_;
+        }
+        return *this;
+    }
+    MemoryReservation(const MemoryReservation&) = delete;
+    MemoryReservation& operator=(const MemoryReservation&) = delete;
+
+    // Grow by bytes if the budget allows, waiting up to timeout_ms for it to
+    bool grow(size_t bytes, int timeout_ms = 0) {
+        if (!memory_accountant.reserve(category_, bytes, timeout_ms, bytes_)) {
+            exhausted_ = true;
+            return false;
+        }
+        bytes_ += bytes;
+        return true;
+    }
+
+    // Charge exactly bytes, past the budget if need be
+    void resize(size_t bytes) {
+        if (bytes > bytes_) {
+            memory_accountant.charge(category_, bytes - bytes_);
+        } else if (bytes < bytes_) {
+            memory_accountant.release(category_, bytes_ - bytes);
+        }
+        bytes_ = bytes;
+    }
+
+    size_t size() const { return bytes_; }
+
+    // Whether a grow() was refused
+    bool exhausted() const { return exhausted_; }
+
+private:
+    MemoryCategory category_;
+    size_t bytes_ = 0;
+    bool exhausted_ = false;
+};
+
+// Shared buffer whose reservation, trimmed to the content, lasts until the
+// last response or cache entry referencing it lets go
+shared_ptr<const string> charged_buffer(string content, MemoryReservation reservation) {
+    struct Charged {
+        string content;
+        MemoryReservation reservation;
+    };
+    reservation.resize(content.size());
+    auto holder = make_shared<Charged>(Charged{move(content), move(reservation)});
+    return shared_ptr<const string>(holder, &holder->content);
+}
+
+// URL decode function
+string url_decode(const string& encoded) {
+    string decoded;
+    decoded.reserve(encoded.length());
+    
+    for (size_t i = 0; i < encoded.length(); ++i) {
+        if (encoded[i] == '%' && i + 2 < encoded.length()) {
+            try {
+                int value = stoi(encoded.substr(i + 1, 2), nullptr, 16);
+                if (value >= 0 && value <= 255) {
+                    decoded += static_cast<char>(value);
+                    i += 2;
+                } else {
+                    decoded += encoded[i];
+                }
+            } catch (...) {
+                decoded += encoded[i];
+            }
+        } else if (encoded[i] == '+') {
+            decoded += ' ';
+        } else {
+            decoded += encoded[i];
+        }
+    }
+    return decoded;
+}
+
+// Decoded value of a parameter in a query string (the part after '?'), or empty
+string query_param(string_view query, string_view name) {
+    for (size_t start = 0; start <= query.size();) {
+        size_t end = min(query.find('&', start), query.size());
+        string_view pair = query.substr(start, end - start);
+        size_t equals = pair.find('=');
+        if (pair.substr(0, equals) == name) {
+            return equals == string_view::npos ? "" : url_decode(string(pair.substr(equals + 1)));
+        }
+        start = end + 1;
+    }
+    return "";
+}
+
+// Sanitize path to prevent directory traversal
+string sanitize_path(const string& path) {
+    if (path.empty() || path[0] != '/') {
+        return "";
+    }
+    
+    // URL decode first
+    string decoded = url_decode(path);
+    
+    // Reject paths with null bytes or other dangerous characters
+    if (decoded.find('\0') != string::npos || 
+        decoded.find("..") != string::npos ||
+        decoded.find('\\') != string::npos) {
+        return "";
+    }
+    
+    // Convert to filesystem path
+    fs::path requested_path = fs::path(WEB_ROOT) / decoded.substr(1);
+    
+    try {
+        // Get canonical path to resolve any remaining .. or symlinks
+        fs::path canonical = fs::canonical(fs::path(WEB_ROOT));
+        fs::path target;
+        
+        if (fs::exists(requested_path)) {
+            target = fs::canonical(requested_path);
+        } else {
+            target = fs::weakly_canonical(requested_path);
+        }
+        
+        // Ensure the resolved path is within web root
+        string canonical_str = canonical.string();
+        string target_str = target.string();
+        
+        if (target_str.substr(0, canonical_str.length()) != canonical_str) {
+            return "";  // Path traversal attempt
+        }
+        
+        return target.string();
+    } catch (const fs::filesystem_error&) {
+        return "";
+    }
+}
+
+// Check if file is forbidden (hidden/system files)
+bool is_forbidden_file(const string& path) {
+    fs::path p(path);
+    string filename = p.filename().string();
+    
+    // Reject hidden files and dangerous extensions
+    if (filename.empty() || filename[0] == '.' ||
+        filename == "Thumbs.db" || filename == "desktop.ini" ||
+        path.find("/.") != string::npos) {
+        return true;
+    }
+    
+    // Check for system/config file patterns
+    static const unordered_set<string> forbidden_patterns = {
+        ".htaccess", ".htpasswd", ".git", ".svn", ".env", 
+        "web.config", ".DS_Store", "__pycache__"
+    };
+    
+    for (const auto& pattern : forbidden_patterns) {
+        if (filename.find(pattern) != string::npos) {
+            return true;
+        }
+    }
+    
+    return false;
+}
+
+// Get MIME type from file extension
+string get_mime_type(const string& path) {
+    fs::path p(path);
+    string ext = p.extension().string();
+    transform(ext.begin(), ext.end(), ext.begin(), ::tolower);
+    
+    auto it = mime_types.find(ext);
+    return (it != mime_types.end()) ? it->second : "application/octet-stream";
+}
+
+// In-memory copies of small static files. Entries are checked against the
+// file's inode, size and ctime on every lookup, and evicted least recently
+// used first once ASSET_CACHE_MAX_BYTES is reached.
+class AssetCache {
+public:
+    shared_ptr<const string> lookup(const string& path, const struct stat& file_stat);
+    void insert(const string& path, const struct stat& file_stat, shared_ptr<const string> content);
+    string stats();
+
+private:
+    struct Entry {
+        string path;
+        dev_t device;
+        ino_t inode;
+        off_t size;
+        struct timespec ctime;
+        shared_ptr<const string> content;
+
+        bool matches(const struct stat& file_stat) const {
+            return device == file_stat.st_dev && inode == file_stat.st_ino &&
+                   size == file_stat.st_size && ctime.tv_sec == file_stat.st_ctim.tv_sec &&
+                   ctime.tv_nsec == file_stat.st_ctim.tv_nsec;
+        }
+    };
+
+    void erase(list<Entry>::iterator entry);
+
+    mutex lock_;
+    list<Entry> entries_;  // Most recently used first
+    unordered_map<string, list<Entry>::iterator> index_;
+    size_t bytes_ = 0;
+    uint64_t hits_ = 0;
+    uint64_t misses_ = 0;
+};
+
+AssetCache asset_cache;
+
+shared_ptr<const string> AssetCache::lookup(const string& path, const struct stat& file_stat) {
+    lock_guard<mutex> lock(lock_);
+    auto it = index_.find(path);
+    if (it == index_.end() || !it->second->matches(file_stat)) {
+        misses_++;
+        return nullptr;
+    }
+    hits_++;
+    entries_.splice(entries_.begin(), entries_, it->second);
+    return it->second->content;
+}
+
+void AssetCache::insert(const string& path, const struct stat& file_stat, shared_ptr<const string> content) {
+    if (content->size() > ASSET_CACHE_MAX_FILE_SIZE) {
+        return;
+    }
+    lock_guard<mutex> lock(lock_);
+    auto existing = index_.find(path);
+    if (existing != index_.end()) {
+        erase(existing->second);
+    }
+    while (!entries_.empty() && bytes_ + content->size() > ASSET_CACHE_MAX_BYTES) {
+        erase(prev(entries_.end()));
+    }
+    bytes_ += content->size();
+    entries_.push_front({path, file_stat.st_dev, file_stat.st_ino, file_stat.st_size,
+                         file_stat.st_ctim, move(content)});
+    index_[path] = entries_.begin();
+}
+
+void AssetCache::erase(list<Entry>::iterator entry) {
+    bytes_ -= entry->content->size();
+    index_.erase(entry->path);
+    entries_.erase(entry);
+}
+
+string AssetCache::stats() {
+    lock_guard<mutex> lock(lock_);
+    return "{\"entries\":" + to_string(entries_.size()) + ",\"bytes\":" + to_string(bytes_) +
+           ",\"hits\":" + to_string(hits_) + ",\"misses\":" + to_string(misses_) + "}";
+}
+
+// Coalesces concurrent calls with the same key. The first caller (the
+// leader) runs the work; callers arriving while it runs wait for its result,
+// or its exception, and get a copy. Nothing is kept once the flight lands.
+// A follower that waits longer than COALESCE_TIMEOUT_MS stops trusting the
+// leader and runs the work itself.
+template <typename T>
+class SingleFlight {
+public:
+    T run(const string& key, const function<T()>& work);
+    string stats();
+
+private:
+    struct Flight {
+        condition_variable done;
+        bool finished = false;
+        size_t followers = 0;
+        optional<T> result;
+        exception_ptr error;
+    };
+
+    mutex lock_;
+    unordered_map<string, shared_ptr<Flight>> flights_;
+    uint64_t leaders_ = 0;
+    uint64_t followers_ = 0;
+    uint64_t timeouts_ = 0;
+    uint64_t errors_ = 0;
+};
+
+template <typename T>
+T SingleFlight<T>::run(const string& key, const function<T()>& work) {
+    unique_lock<mutex> lock(lock_);
+    auto it = flights_.find(key);
+    if (it != flights_.end()) {
+        shared_ptr<Flight> flight = it->second;
+        flight->followers++;
+        followers_++;
+        TraceSpan span("coalesce_wait");
+        if (flight->done.wait_for(lock, chrono::milliseconds(COALESCE_TIMEOUT_MS), [&] { return flight->finished; })) {
+            if (flight->error) {
+                rethrow_exception(flight->error);
+            }
+            return *flight->result;
+        }
+        timeouts_++;
+        lock.unlock();
+        return work();
+    }
+    
+    auto flight = make_shared<Flight>();
+    flights_.emplace(key, flight);
+    leaders_++;
+    lock.unlock();
+    
+    optional<T> result;
+    exception_ptr error;
+    try {
+        result = work();
+    } catch (...) {
+        error = current_exception();
+    }
+    
+    lock.lock();
+    flights_.erase(key);
+    flight->finished = true;
+    if (error) {
+        errors_++;
+        flight->error = error;
+    } else if (flight->followers > 0) {
+        flight->result = result;
+    }
+    flight->done.notify_all();
+    lock.unlock();
+    
+    if (error) {
+        rethrow_exception(error);
+    }
+    return move(*result);
+}
+
+template <typename T>
+string SingleFlight<T>::stats() {
+    lock_guard<mutex> lock(lock_);
+    return "{\"in_flight\":" + to_string(flights_.size()) + ",\"leaders\":" + to_string(leaders_) +
+           ",\"followers\":" + to_string(followers_) + ",\"timeouts\":" + to_string(timeouts_) +
+           ",\"errors\":" + to_string(errors_) + "}";
+}
+
+// A file opened for a response, shareable between coalesced requests
+struct FileLoad {
+    bool ok = false;
+    BufferChain body;
+};
+
+SingleFlight<FileLoad> file_flights;
+
+// Open a file with size limit. Small files are read into memory and added
+// to the asset cache; larger ones are never copied and go out with sendfile().
+FileLoad load_file(const string& filepath) {
+    FileLoad load;
+    int fd = open(filepath.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+        return load;
+    }
+    auto file = make_shared<FileDescriptor>(fd);
+    
+    struct stat file_stat;
+    if (fstat(fd, &file_stat) == -1 || !S_ISREG(file_stat.st_mode)) {
+        return load;
+    }
+    
+    size_t file_size = file_stat.st_size;
+    if (file_size > MAX_FILE_SIZE) {
+        log_error("File too large: " + filepath);
+        return load;
+    }
+    
+    // Small files are read into memory while the budget allows; anything
+    // else streams from the file
+    MemoryReservation reservation(MemoryCategory::FileContent);
+    if (file_size > ASSET_CACHE_MAX_FILE_SIZE || !reservation.grow(file_size)) {
+        load.body.append_file(move(file), 0, file_size);
+        load.ok = true;
+        return load;
+    }
+    
+    string content(file_size, '\0');
+    size_t total_read = 0;
+    while (total_read < file_size) {
+        ssize_t bytes_read = pread(fd, content.data() + total_read, file_size - total_read, total_read);
+        if (bytes_read <= 0) {
+            if (bytes_read == -1 && errno == EINTR) {
+                continue;
+            }
+            break;
+        }
+        total_read += bytes_read;
+    }
+    if (total_read != file_size) {
+        return load;  // Truncated underneath us
+    }
+    auto shared = charged_buffer(move(content), move(reservation));
+    asset_cache.insert(filepath, file_stat, shared);
+    load.body.append(move(shared));
+    load.ok = true;
+    return load;
+}
+
+// Attach a file to the response body. Cached files are shared as they are;
+// concurrent misses for the same file share one load.
+bool read_file_safe(const string& filepath, HttpResponse& response) {
+    TraceSpan span("read_file_safe");
+    struct stat file_stat;
+    if (stat(filepath.c_str(), &file_stat) == 0 && S_ISREG(file_stat.st_mode) &&
+        static_cast<size_t>(file_stat.st_size) <= ASSET_CACHE_MAX_FILE_SIZE) {
+        if (auto cached = asset_cache.lookup(filepath, file_stat)) {
+            response.body.append(move(cached));
+            return true;
+        }
+    }
+    
+    FileLoad load = file_flights.run(filepath, [&] { return load_file(filepath); });
+    if (!load.ok) {
+        return false;
+    }
+    response.body.append(load.body);
+    return true;
+}
+
+// Pull more bytes from the socket into the body buffer, waiting at most
+// timeout_seconds_ for the peer to send them
+bool BodyReader::fill(int timeout_ms) {
+    if (expect_continue_) {
+        // The client is holding the body back until we ask for it
+        static const char continue_response[] = "HTTP/1.1 100 Continue\r\n\r\n";
+        expect_continue_ = false;
+        if (!conn_.send_all(continue_response, sizeof(continue_response) - 1)) {
+            return false;
+        }
+    }
+    
+    if (pos_ > 0 && pos_ == buffer_.size()) {
+        buffer_.clear();
+        pos_ = 0;
+    }
+    
+    if (!conn_.wait_readable(timeout_ms)) {
+        timed_out_ = true;
+        return false;
+    }
+    
+    char chunk[BODY_BUFFER_SIZE];
+    ssize_t bytes_received = conn_.recv_some(chunk, sizeof(chunk));
+    if (bytes_received <= 0) {
+        closed_ = bytes_received == 0;
+        return false;
+    }
+    
+    buffer_.append(chunk, bytes_received);
+    if (tap_) {
+        size_t room = tap_limit_ - min(tap_limit_, tap_->size());
+        tap_->append(chunk, min(room, static_cast<size_t>(bytes_received)));
+        tap_overflowed_ |= static_cast<size_t>(bytes_received) > room;
+    }
+    return true;
+}
+
+// Parse a chunk-size line: 1 to 16 hex digits, optionally followed by
+// ";" and extensions, which are ignored. No whitespace, sign or "0x"; lenient
+// framing is how request smuggling starts.
+bool parse_chunk_size(string_view line, uint64_t& size) {
+    size_t digits = 0;
+    size = 0;
+    while (digits < line.size() && isxdigit(static_cast<unsigned char>(line[digits]))) {
+        char c = line[digits++];
+        if (digits > 16) {
+            return false;
+        }
+        size = (size << 4) | static_cast<uint64_t>(c <= '9' ? c - '0' : (c | 0x20) - 'a' + 10);
+    }
+    if (digits == 0) {
+        return false;
+    }
+    if (digits == line.size()) {
+        return true;
+    }
+    if (line[digits] != ';') {
+        return false;
+    }
+    return none_of(line.begin() + digits, line.end(), [](char c) {
+        return (static_cast<unsigned char>(c) < 0x20 && c != '\t') || c == 0x7f;
+    });
+}
+
+// Read one line of chunked framing, which must end in CRLF
+bool BodyReader::read_line(string& line, int timeout_ms) {
+    while (true) {
+        size_t eol = buffer_.find('\n', pos_);
+        if (eol != string::npos) {
+            if (eol == pos_ || buffer_[eol - 1] != '\r') {
+                return false;  // Bare LF
+            }
+            line.assign(buffer_, pos_, eol - 1 - pos_);
+            pos_ = eol + 1;
+            return line.find('\r') == string::npos;
+        }
+        if (buffer_.size() - pos_ > MAX_CHUNK_LINE || !fill(timeout_ms)) {
+            return false;
+        }
+    }
+}
+
+ssize_t BodyReader::read(char* out, size_t length) {
+    ssize_t result = read_some(out, length, timeout_seconds_ * 1000);
+    if (result == WOULD_BLOCK) {
+        state_ = State::Error;  // The client stalled past the request timeout
+        return -1;
+    }
+    return result;
+}
+
+// Framing lines are only consumed once complete, so a timeout anywhere
+// leaves the reader where it was for the next call
+ssize_t BodyReader::read_some(char* out, size_t length, int timeout_ms) {
+    timed_out_ = false;
+    while (true) {
+        switch (state_) {
+            case State::Done:
+                return 0;
+            case State::Error:
+                return -1;
+            case State::ChunkSize: {
+                string line;
+                if (!read_line(line, timeout_ms)) {
+                    if (timed_out_) {
+                        return WOULD_BLOCK;
+                    }
+                    state_ = State::Error;
+                    return -1;
+                }
+                uint64_t chunk_size = 0;
+                if (!parse_chunk_size(line, chunk_size)) {
+                    state_ = State::Error;
+                    return -1;
+                }
+                if (chunk_size > max_size_ - total_) {
+                    too_large_ = true;
+                    state_ = State::Error;
+                    return -1;
+                }
+                remaining_ = chunk_size;
+                state_ = chunk_size == 0 ? State::Trailers : State::Data;
+                break;
+            }
+            case State::Data: {
+                if (remaining_ == 0) {
+                    state_ = chunked_ ? State::ChunkDataEnd : State::Done;
+                    break;
+                }
+                if (pos_ == buffer_.size() && !fill(timeout_ms)) {
+                    if (closed_ && remaining_ == UNTIL_CLOSE) {
+                        state_ = State::Done;
+                        return 0;
+                    }
+                    if (timed_out_) {
+                        return WOULD_BLOCK;
+                    }
+                    state_ = State::Error;
+                    return -1;
+                }
+                size_t available = min({length, remaining_, buffer_.size() - pos_});
+                memcpy(out, buffer_.data() + pos_, available);
+                pos_ += available;
+                if (remaining_ != UNTIL_CLOSE) {
+                    remaining_ -= available;
+                }
+                total_ += available;
+                return static_cast<ssize_t>(available);
+            }
+            case State::ChunkDataEnd: {
+                string line;
+                if (!read_line(line, timeout_ms)) {
+                    if (timed_out_) {
+                        return WOULD_BLOCK;
+                    }
+                    state_ = State::Error;
+                    return -1;
+                }
+                if (!line.empty()) {
+                    state_ = State::Error;
+                    return -1;
+                }
+                state_ = State::ChunkSize;
+                break;
+            }
+            case State::Trailers: {
+                // Trailer fields are read and dropped until the empty line
+                string line;
+                if (!read_line(line, timeout_ms)) {
+                    if (timed_out_) {
+                        return WOULD_BLOCK;
+                    }
+                    state_ = State::Error;
+                    return -1;
+                }
+                if (line.empty()) {
+                    state_ = State::Done;
+                }
+                break;
+            }
+        }
+    }
+}
+
+void RequestBody::drain() {
+    char scratch[BODY_BUFFER_SIZE];
+    while (read(scratch, sizeof(scratch)) > 0) {
+        // Discard
+    }
+}
+
+// Parse HTTP request with proper validation
+HttpRequest parse_request(const string& raw_request) {
+    HttpRequest request;
+    istringstream stream(raw_request);
+    string line;
+    
+    // Parse request line
+    if (!getline(stream, line) || line.empty()) {
+        return request;
+    }
+    
+    // Remove carriage return if present
+    if (!line.empty() && line.back() == '\r') {
+        line.pop_back();
+    }
+    
+    istringstream request_line(line);
+    if (!(request_line >> request.method >> request.path >> request.version)) {
+        return request;
+    }
+    
+    // Validate HTTP method
+    if (allowed_methods.find(request.method) == allowed_methods.end()) {
+        return request;
+    }
+    
+    // Validate HTTP version
+    if (request.version != "HTTP/1.0" && request.version != "HTTP/1.1") {
+        return request;
+    }
+    
+    // The body is streamed separately, so only the header block is parsed here
+    if (raw_request.find("\r\n\r\n") == string::npos) {
+        return request;  // Incomplete or oversized header block
+    }
+    
+    // Parse headers
     while (getline(stream, line) && !line.empty() && line != "\r") {
         if (!line.empty() && line.back() == '\r') {
             line.pop_back();
         }
         
-        size_t colon_pos = line.find(':');
-        if (colon_pos != string::npos) {
-            string header_name = line.substr(0, colon_pos);
-            string header_value = line.substr(colon_pos + 1);
+        size_t colon_pos = line.find(':');
+        if (colon_pos != string::npos) {
+            string header_name = line.substr(0, colon_pos);
+            string header_value = line.substr(colon_pos + 1);
+            
+            // Trim whitespace
+            header_name.erase(0, header_name.find_first_not_of(" \t"));
+            header_name.erase(header_name.find_last_not_of(" \t") + 1);
+            header_value.erase(0, header_value.find_first_not_of(" \t"));
+            header_value.erase(header_value.find_last_not_of(" \t") + 1);
+            
+            // Convert header name to lowercase for case-insensitive comparison
+            transform(header_name.begin(), header_name.end(), header_name.begin(), ::tolower);
+            
+            request.headers[header_name] = header_value;
+            
+            if (header_name == "content-length") {
+                try {
+                    request.content_length = stoull(header_value);
+                    if (request.content_length > MAX_BODY_SIZE) {
+                        request.error_status = 413;
+                        return request;  // Body too large
+                    }
+                } catch (...) {
+                    return request;  // Invalid content-length
+                }
+            } else if (header_name == "transfer-encoding") {
+                string coding = header_value;
+                transform(coding.begin(), coding.end(), coding.begin(), ::tolower);
+                if (coding != "chunked") {
+                    return request;  // Only chunked transfer coding is supported
+                }
+                request.chunked = true;
+            }
+        }
+    }
+    
+    // Conflicting framing is a request smuggling vector
+    if (request.chunked && request.headers.count("content-length")) {
+        return request;
+    }
+    
+    request.valid = true;
+    return request;
+}
+
+// Execute PHP script safely
+bool execute_php(const string& script_path, const HttpRequest& request, string& output,
+                 MemoryReservation& output_memory) {
+    // Validate PHP file extension and location
+    if (!script_path.ends_with(".php")) {
+        return false;
+    }
+    
+    // Ensure script is within web root
+    try {
+        fs::path canonical_root = fs::canonical(WEB_ROOT);
+        fs::path canonical_script = fs::canonical(script_path);
+        
+        if (canonical_script.string().substr(0, canonical_root.string().length()) != canonical_root.string()) {
+            return false;
+        }
+    } catch (...) {
+        return false;
+    }
+    
+    // Create pipes for stdout and, when there is a body, stdin
+    int pipe_fd[2];
+    if (pipe(pipe_fd) == -1) {
+        log_error("Failed to create pipe: " + string(strerror(errno)));
+        return false;
+    }
+    
+    int stdin_fd[2] = {-1, -1};
+    if (request.body && pipe(stdin_fd) == -1) {
+        log_error("Failed to create pipe: " + string(strerror(errno)));
+        close(pipe_fd[0]);
+        close(pipe_fd[1]);
+        return false;
+    }
+    
+    TraceSpan exec_span("execute_php");
+    optional<TraceSpan> spawn_span(in_place, "php.fork");
+    pid_t pid = fork();
+    if (pid == -1) {
+        log_error("Failed to fork: " + string(strerror(errno)));
+        close(pipe_fd[0]);
+        close(pipe_fd[1]);
+        if (stdin_fd[0] != -1) {
+            close(stdin_fd[0]);
+            close(stdin_fd[1]);
+        }
+        return false;
+    }
+    
+    if (pid == 0) {
+        // Child process
+        close(pipe_fd[0]);  // Close read end
+        
+        // Redirect stdout to pipe
+        if (dup2(pipe_fd[1], STDOUT_FILENO) == -1) {
+            exit(1);
+        }
+        close(pipe_fd[1]);
+        
+        // Redirect stdin from the body pipe, or from nothing
+        if (stdin_fd[0] != -1) {
+            close(stdin_fd[1]);
+            if (dup2(stdin_fd[0], STDIN_FILENO) == -1) {
+                exit(1);
+            }
+            close(stdin_fd[0]);
+        } else {
+            int null_fd = open("/dev/null", O_RDONLY);
+            if (null_fd != -1) {
+                dup2(null_fd, STDIN_FILENO);
+                close(null_fd);
+            }
+        }
+        
+        // Set environment variables
+        setenv("REQUEST_METHOD", request.method.c_str(), 1);
+        setenv("SCRIPT_FILENAME", script_path.c_str(), 1);
+        setenv("REQUEST_URI", request.path.c_str(), 1);
+        
+        // Body metadata only accompanies a body. Chunked bodies have no
+        // length up front; the script reads stdin to EOF.
+        if (request.body) {
+            if (!request.chunked) {
+                setenv("CONTENT_LENGTH", to_string(request.content_length).c_str(), 1);
+            }
+            auto content_type = request.headers.find("content-type");
+            if (content_type != request.headers.end()) {
+                setenv("CONTENT_TYPE", content_type->second.c_str(), 1);
+            }
+        }
+        
+        // Execute PHP
+        execl("/usr/bin/php", "php", "-f", script_path.c_str(), nullptr);
+        exit(1);  // execl failed
+    } else {
+        // Parent process
+        spawn_span.reset();
+        TraceSpan io_span("php.io");
+        close(pipe_fd[1]);  // Close write end
+        if (stdin_fd[0] != -1) {
+            close(stdin_fd[0]);
+            fcntl(stdin_fd[1], F_SETFL, fcntl(stdin_fd[1], F_GETFL) | O_NONBLOCK);
+        }
+        
+        // Pump the request body into stdin while collecting stdout. The body is
+        // only read from the client once the previous piece has been accepted
+        // by the pipe, so a slow script backs up into the client's TCP window
+        // instead of into our memory. Body reads never wait: a client that
+        // pauses is polled alongside the output pipe, so the script's output
+        // keeps draining and the deadline holds.
+        char pending[BODY_BUFFER_SIZE];
+        size_t pending_len = 0;
+        size_t pending_pos = 0;
+        bool output_done = false;
+        bool body_error = false;
+        bool discard_body = false;  // The script closed stdin; the rest is read only to drop it
+        
+        // One deadline for the whole script, so output or a body that
+        // trickles in can't keep it alive past PHP_TIMEOUT_SECONDS
+        auto deadline = chrono::steady_clock::now() + chrono::seconds(PHP_TIMEOUT_SECONDS);
+        auto remaining_ms = [&] {
+            return static_cast<int>(max<int64_t>(0, chrono::duration_cast<chrono::milliseconds>(
+                deadline - chrono::steady_clock::now()).count()));
+        };
+        
+        while (!output_done) {
+            // Output is only read into memory the budget has granted; while
+            // none is free the script blocks on a full pipe
+            constexpr size_t OUTPUT_READ_SIZE = 4096;
+            if (output.size() + OUTPUT_READ_SIZE > output_memory.size() &&
+                !output_memory.grow(MEMORY_CHARGE_STEP, min(MEMORY_WAIT_MS, remaining_ms()))) {
+                log_error("Memory budget exhausted, stopping PHP: " + script_path);
+                kill(pid, SIGKILL);
+                break;
+            }
+            
+            // Take whatever body the client has already sent
+            bool body_waiting = false;
+            if ((stdin_fd[1] != -1 || discard_body) && pending_pos == pending_len) {
+                ssize_t body_read = request.body->read_some(pending, sizeof(pending), 0);
+                pending_pos = 0;
+                pending_len = body_read > 0 && !discard_body ? body_read : 0;
+                if (body_read == RequestBody::WOULD_BLOCK) {
+                    body_waiting = true;
+                } else if (body_read <= 0) {
+                    body_error = body_read < 0;
+                    discard_body = false;
+                    if (stdin_fd[1] != -1) {
+                        close(stdin_fd[1]);  // Signal EOF to the script
+                        stdin_fd[1] = -1;
+                    }
+                }
+            }
+            
+            struct pollfd fds[2];
+            nfds_t nfds = 0;
+            fds[nfds++] = {pipe_fd[0], POLLIN, 0};
+            bool feeding = stdin_fd[1] != -1 && !body_waiting;
+            if (feeding) {
+                fds[nfds++] = {stdin_fd[1], POLLOUT, 0};
+            } else if (body_waiting) {
+                fds[nfds++] = {request.body->wait_fd(), POLLIN, 0};
+            }
+            
+            int timeout_ms = remaining_ms();
+            if (timeout_ms == 0) {
+                log_error("PHP execution timed out: " + script_path);
+                kill(pid, SIGKILL);
+                break;
+            }
+            if (discard_body && !body_waiting) {
+                timeout_ms = 0;  // More of the body may already be here
+            }
+            int poll_result = poll(fds, nfds, timeout_ms);
+            if (poll_result == -1) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                log_error("PHP poll failed: " + script_path);
+                kill(pid, SIGKILL);
+                break;
+            }
+            
+            if (feeding && (fds[1].revents & (POLLOUT | POLLERR | POLLHUP))) {
+                ssize_t written = write(stdin_fd[1], pending + pending_pos, pending_len - pending_pos);
+                if (written > 0) {
+                    pending_pos += written;
+                } else if (errno != EAGAIN && errno != EINTR) {
+                    // Script stopped reading stdin
+                    close(stdin_fd[1]);
+                    stdin_fd[1] = -1;
+                    pending_len = pending_pos = 0;
+                    discard_body = true;
+                }
+            }
+            
+            if (fds[0].revents & (POLLIN | POLLHUP | POLLERR)) {
+                char buffer[OUTPUT_READ_SIZE];
+                ssize_t bytes_read = read(pipe_fd[0], buffer, sizeof(buffer));
+                if (bytes_read > 0) {
+                    output.append(buffer, bytes_read);
+                    
+                    // Limit output size
+                    if (output.length() > MAX_FILE_SIZE) {
+                        output.resize(MAX_FILE_SIZE);
+                        kill(pid, SIGKILL);
+                        output_done = true;
+                    }
+                } else if (bytes_read == 0 || errno != EINTR) {
+                    output_done = true;
+                }
+            }
+        }
+        
+        close(pipe_fd[0]);
+        if (stdin_fd[1] != -1) {
+            close(stdin_fd[1]);
+        }
+        
+        // Wait for child process
+        int status;
+        if (waitpid(pid, &status, 0) == -1) {
+            return false;
+        }
+        
+        if (body_error || output_memory.exhausted()) {
+            return false;
+        }
+        return WIFEXITED(status) && WEXITSTATUS(status) == 0;
+    }
+}
+
+// Outcome of one PHP execution, shareable between coalesced requests. The
+// admission slot is held until every response using the output is sent.
+struct PhpResult {
+    bool executed = false;
+    bool overloaded = false;  // Shed by admission control or out of memory budget
+    shared_ptr<const string> output;
+    shared_ptr<AdmissionPermit> permit;
+};
+
+SingleFlight<PhpResult> php_flights;
+
+// Run a script under the dynamic admission class
+PhpResult run_php(const string& script_path, const HttpRequest& request) {
+    PhpResult result;
+    auto permit = admission.acquire(RequestClass::Dynamic);
+    if (!permit) {
+        result.overloaded = true;
+        return result;
+    }
+    
+    string php_output;
+    MemoryReservation php_memory(MemoryCategory::PhpOutput);
+    result.executed = execute_php(script_path, request, php_output, php_memory);
+    permit->complete();
+    result.permit = move(permit);
+    if (result.executed) {
+        result.output = charged_buffer(move(php_output), move(php_memory));
+    } else {
+        result.overloaded = php_memory.exhausted();
+    }
+    return result;
+}
+
+// Run a script, sharing one execution between identical concurrent GET and
+// HEAD requests without a body. Without a body the child gets only
+// REQUEST_METHOD, SCRIPT_FILENAME and REQUEST_URI (CONTENT_TYPE and
+// CONTENT_LENGTH are set only alongside a body), so those requests would
+// produce the same output anyway.
+PhpResult run_php_coalesced(const string& script_path, const HttpRequest& request) {
+    if ((request.method != "GET" && request.method != "HEAD") || request.body) {
+        return run_php(script_path, request);
+    }
+    return php_flights.run(request.method + " " + script_path + " " + request.path,
+                           [&] { return run_php(script_path, request); });
+}
+
+// Handle directory requests
+HttpResponse handle_directory(const string& dir_path, const string& url_path) {
+    HttpResponse response;
+    
+    // Check for index files
+    vector<string> index_files = {"index.html", "index.htm", "index.php"};
+    
+    for (const string& index_file : index_files) {
+        string index_path = dir_path + "/" + index_file;
+        if (fs::exists(index_path) && fs::is_regular_file(index_path)) {
+            if (index_file == "index.php") {
+                HttpRequest dummy_request;
+                dummy_request.method = "GET";
+                dummy_request.path = url_path + index_file;
+                
+                PhpResult result = run_php_coalesced(index_path, dummy_request);
+                if (result.overloaded) {
+                    return overloaded_response();
+                }
+                if (result.executed) {
+                    response.body.append(move(result.output));
+                    response.headers["Content-Type"] = "text/html";
+                    response.permit = move(result.permit);
+                    return response;
+                }
+            } else {
+                auto permit = admission.acquire(RequestClass::Static);
+                if (!permit) {
+                    return overloaded_response();
+                }
+                if (read_file_safe(index_path, response)) {
+                    permit->complete();
+                    response.headers["Content-Type"] = get_mime_type(index_path);
+                    response.permit = move(permit);
+                    return response;
+                }
+            }
+        }
+    }
+    
+    // No index file found - return 403 Forbidden
+    response.status_code = 403;
+    response.body.append_static("<html><body><h1>403 Forbidden</h1><p>Directory listing is not allowed.</p></body></html>");
+    response.headers["Content-Type"] = "text/html";
+    return response;
+}
+
+// ---------------------------------------------------------------------------
+// Asset pack
+// ---------------------------------------------------------------------------
+
+// A read-only file mapping, unmapped once the pack and every response body
+// pointing into it are gone
+struct FileMapping {
+    void* data;
+    size_t length;
+    FileMapping(void* data, size_t length) : data(data), length(length) {}
+    ~FileMapping() { munmap(data, length); }
+    FileMapping(const FileMapping&) = delete;
+    FileMapping& operator=(const FileMapping&) = delete;
+};
+
+// ASSET_PACK_FILE mapped into memory. The pack is opened once before any
+// request is accepted and is immutable afterwards, so lookups take no lock.
+// Every offset in it is checked at open, so a lookup only ever touches
+// memory inside the mapping.
+class AssetPack {
+public:
+    struct Asset {
+        string_view mime;
+        string_view etag;
+        string_view data;
+        string_view gzip;  // Empty when the pack has no gzip variant
+        string_view gzip_etag;
+    };
+
+    bool open(const string& path);
+    bool loaded() const { return owner_ != nullptr; }
+    size_t size() const { return header_.entry_count; }
+    optional<Asset> find(string_view path);
+    const shared_ptr<const void>& owner() const { return owner_; }
+
+    void count_not_modified() { not_modified_++; }
+    void count_gzip() { gzip_++; }
+    string stats();
+
+private:
+    string_view range(uint64_t offset, uint64_t length) const { return string_view(base_ + offset, length); }
+    PackEntry entry(uint32_t index) const {
+        return decode_pack_entry(base_ + PACK_HEADER_SIZE + 4ull * header_.bucket_count + PACK_ENTRY_SIZE * index);
+    }
+
+    shared_ptr<const void> owner_;  // The FileMapping
+    const char* base_ = nullptr;
+    PackHeader header_;
+    atomic<uint64_t> hits_{0};
+    atomic<uint64_t> misses_{0};
+    atomic<uint64_t> not_modified_{0};
+    atomic<uint64_t> gzip_{0};
+};
+
+AssetPack asset_pack;
+
+bool AssetPack::open(const string& path) {
+    int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+        log_error("Cannot open asset pack " + path + ": " + strerror(errno));
+        return false;
+    }
+    struct stat file_stat;
+    if (fstat(fd, &file_stat) == -1 || static_cast<size_t>(file_stat.st_size) < PACK_HEADER_SIZE) {
+        close(fd);
+        log_error("Asset pack " + path + " is truncated");
+        return false;
+    }
+    size_t length = file_stat.st_size;
+    void* data = mmap(nullptr, length, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) {
+        log_error("Cannot map asset pack " + path + ": " + strerror(errno));
+        return false;
+    }
+    auto mapping = make_shared<FileMapping>(data, length);
+    const char* base = static_cast<const char*>(data);
+    
+    // Validate the whole index up front
+    auto invalid = [&](const string& reason) {
+        log_error("Asset pack " + path + " is invalid: " + reason);
+        return false;
+    };
+    auto in_bounds = [&](uint64_t offset, uint64_t size) {
+        return offset <= length && size <= length - offset;
+    };
+    PackHeader header;
+    if (!decode_pack_header(base, header)) {
+        return invalid("bad magic");
+    }
+    if (header.file_size != length) {
+        return invalid("size mismatch, the file was modified in place");
+    }
+    uint32_t buckets = header.bucket_count;
+    if (buckets == 0 || (buckets & (buckets - 1)) != 0 || header.entry_count >= buckets) {
+        return invalid("bad bucket count");
+    }
+    uint64_t index_size = 4ull * buckets + uint64_t(PACK_ENTRY_SIZE) * header.entry_count;
+    if (!in_bounds(PACK_HEADER_SIZE, index_size)) {
+        return invalid("index past end of file");
+    }
+    for (uint32_t i = 0; i < buckets; ++i) {
+        if (pack_get(base + PACK_HEADER_SIZE + 4ull * i, 4) > header.entry_count) {
+            return invalid("bucket " + to_string(i) + " out of range");
+        }
+    }
+    for (uint32_t i = 0; i < header.entry_count; ++i) {
+        PackEntry e = decode_pack_entry(base + PACK_HEADER_SIZE + 4ull * buckets + PACK_ENTRY_SIZE * i);
+        if (!in_bounds(e.path_offset, e.path_length) || !in_bounds(e.mime_offset, e.mime_length) ||
+            !in_bounds(e.etag_offset, e.etag_length) || !in_bounds(e.data_offset, e.data_length) ||
+            !in_bounds(e.gzip_offset, e.gzip_length) || !in_bounds(e.gzip_etag_offset, e.gzip_etag_length) ||
+            (e.gzip_length > 0 && e.gzip_etag_length == 0)) {
+            return invalid("entry " + to_string(i) + " out of range");
+        }
+    }
+    
+    // Start paging the content in now rather than on the first requests
+    madvise(data, length, MADV_WILLNEED);
+    
+    header_ = header;
+    base_ = base;
+    owner_ = move(mapping);
+    return true;
+}
+
+optional<AssetPack::Asset> AssetPack::find(string_view path) {
+    if (!loaded()) {
+        return nullopt;
+    }
+    uint64_t hash = pack_hash(path);
+    uint32_t mask = header_.bucket_count - 1;
+    for (uint32_t probe = 0, slot = hash & mask; probe < header_.bucket_count; ++probe, slot = (slot + 1) & mask) {
+        uint32_t index = static_cast<uint32_t>(pack_get(base_ + PACK_HEADER_SIZE + 4ull * slot, 4));
+        if (index == 0) {
+            break;
+        }
+        PackEntry e = entry(index - 1);
+        if (e.path_hash == hash && range(e.path_offset, e.path_length) == path) {
+            hits_++;
+            return Asset{range(e.mime_offset, e.mime_length), range(e.etag_offset, e.etag_length),
+                         range(e.data_offset, e.data_length), range(e.gzip_offset, e.gzip_length),
+                         range(e.gzip_etag_offset, e.gzip_etag_length)};
+        }
+    }
+    misses_++;
+    return nullopt;
+}
+
+string AssetPack::stats() {
+    return "{\"loaded\":" + string(loaded() ? "true" : "false") + ",\"entries\":" + to_string(size()) +
+           ",\"hits\":" + to_string(hits_) + ",\"misses\":" + to_string(misses_) +
+           ",\"not_modified\":" + to_string(not_modified_) + ",\"gzip\":" + to_string(gzip_) + "}";
+}
+
+// Whether an If-None-Match value names etag (weak comparison) or is "*"
+bool etag_matches(const string& if_none_match, string_view etag) {
+    istringstream list(if_none_match);
+    string candidate;
+    while (getline(list, candidate, ',')) {
+        size_t start = candidate.find_first_not_of(" \t");
+        size_t end = candidate.find_last_not_of(" \t");
+        if (start == string::npos) {
+            continue;
+        }
+        string_view value = string_view(candidate).substr(start, end - start + 1);
+        if (value == "*" || (value.starts_with("W/") ? value.substr(2) : value) == etag) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Whether an Accept-Encoding value allows gzip, i.e. lists it without q=0
+bool accepts_gzip(const string& accept_encoding) {
+    istringstream list(accept_encoding);
+    string coding;
+    while (getline(list, coding, ',')) {
+        size_t semicolon = coding.find(';');
+        string name = coding.substr(0, semicolon);
+        name.erase(remove_if(name.begin(), name.end(), ::isspace), name.end());
+        transform(name.begin(), name.end(), name.begin(), ::tolower);
+        if (name != "gzip") {
+            continue;
+        }
+        string params = semicolon == string::npos ? "" : coding.substr(semicolon + 1);
+        params.erase(remove_if(params.begin(), params.end(), ::isspace), params.end());
+        if (!params.starts_with("q=")) {
+            return true;
+        }
+        try {
+            return stod(params.substr(2)) > 0;
+        } catch (...) {
+            return false;
+        }
+    }
+    return false;
+}
+
+// Serve a GET or HEAD from the asset pack. Returns nothing when the path
+// isn't packed, and the request goes on to the filesystem. Paths are matched
+// exactly as decoded, so anything the packer didn't emit (query strings,
+// "..", hidden files) misses and gets the filesystem's answer.
+optional<HttpResponse> serve_from_pack(const HttpRequest& request) {
+    if (!asset_pack.loaded() || (request.method != "GET" && request.method != "HEAD")) {
+        return nullopt;
+    }
+    optional<AssetPack::Asset> asset = asset_pack.find(url_decode(request.path));
+    if (!asset) {
+        return nullopt;
+    }
+    
+    // Static files don't consume a body; drain it so the client reads our response
+    if (request.body) {
+        request.body->drain();
+    }
+    auto permit = admission.acquire(RequestClass::Static);
+    if (!permit) {
+        return overloaded_response();
+    }
+    permit->complete();
+    
+    auto header = [&](const string& name) {
+        auto it = request.headers.find(name);
+        return it == request.headers.end() ? string() : it->second;
+    };
+    
+    // Pick the representation first; each has its own ETag
+    bool gzip = !asset->gzip.empty() && accepts_gzip(header("accept-encoding"));
+    string_view etag = gzip ? asset->gzip_etag : asset->etag;
+    
+    HttpResponse response;
+    response.permit = move(permit);
+    response.headers["ETag"] = string(etag);
+    if (!asset->gzip.empty()) {
+        response.headers["Vary"] = "Accept-Encoding";
+    }
+    if (etag_matches(header("if-none-match"), etag)) {
+        asset_pack.count_not_modified();
+        response.status_code = 304;
+        return response;
+    }
+    
+    response.headers["Content-Type"] = string(asset->mime);
+    if (gzip) {
+        asset_pack.count_gzip();
+        response.headers["Content-Encoding"] = "gzip";
+        response.body.append(asset_pack.owner(), asset->gzip);
+    } else {
+        response.body.append(asset_pack.owner(), asset->data);
+    }
+    return response;
+}
+
+// ---------------------------------------------------------------------------
+// Reverse proxy
+// ---------------------------------------------------------------------------
+
+// One backend of an upstream route. Mutable state is guarded by the owning
+// Upstream's lock.
+struct UpstreamBackend {
+    string name;
+    struct sockaddr_in address = {};
+    vector<pair<int, chrono::steady_clock::time_point>> idle;  // Pooled connections, newest last
+    int active = 0;                // Requests in flight
+    int consecutive_failures = 0;
+    int ejections = 0;             // Back-to-back ejections, for backoff
+    chrono::steady_clock::time_point ejected_until;
+    uint64_t requests = 0;
+    uint64_t failures = 0;
+};
+
+// A proxied path prefix: its backends, their connection pools, the load
+// balancer and passive health checking. A backend that fails
+// UPSTREAM_MAX_FAILURES requests in a row is ejected for a while; if every
+// backend is ejected, ejection is ignored rather than failing everything.
+class Upstream {
+public:
+    explicit Upstream(const UpstreamRoute& route);
+    ~Upstream();
+    Upstream(const Upstream&) = delete;
+    Upstream& operator=(const Upstream&) = delete;
+
+    const string& prefix() const { return prefix_; }
+
+    // Pick the backend for a request; hash_key only matters for ConsistentHash
+    UpstreamBackend& choose(const string& hash_key);
+
+    // A connection to backend, from the pool when pooled and one is idle.
+    // Returns -1 if connecting fails.
+    int checkout(UpstreamBackend& backend, bool& reused, bool pooled = true);
+
+    // Hand a connection back; reusable ones return to the pool
+    void checkin(UpstreamBackend& backend, int fd, bool reusable);
+
+    // Passive health check: outcome of one request to backend
+    void report(UpstreamBackend& backend, bool success);
+
+    string stats();
+
+private:
+    string prefix_;
+    LoadBalancing balancing_;
+    mutex lock_;
+    vector<unique_ptr<UpstreamBackend>> backends_;
+    vector<pair<uint32_t, UpstreamBackend*>> ring_;  // Sorted by point
+    size_t next_ = 0;                                // Round-robin cursor
+};
+
+vector<unique_ptr<Upstream>> upstreams;
+
+// Spread a string over the hash ring: FNV-1a with a final avalanche so
+// similar keys ("backend#1", "backend#2") land far apart
+uint32_t ring_hash(string_view key) {
+    uint32_t hash = 2166136261u;
+    for (unsigned char c : key) {
+        hash = (hash ^ c) * 16777619u;
+    }
+    hash ^= hash >> 16;
+    hash *= 0x85ebca6bu;
+    hash ^= hash >> 13;
+    hash *= 0xc2b2ae35u;
+    hash ^= hash >> 16;
+    return hash;
+}
+
+Upstream::Upstream(const UpstreamRoute& route) : prefix_(route.prefix), balancing_(route.balancing) {
+    for (const string& name : route.backends) {
+        auto backend = make_unique<UpstreamBackend>();
+        backend->name = name;
+        size_t colon = name.rfind(':');
+        int port = 0;
+        try {
+            port = colon == string::npos ? 0 : stoi(name.substr(colon + 1));
+        } catch (...) {
+        }
+        backend->address.sin_family = AF_INET;
+        backend->address.sin_port = htons(port);
+        if (port <= 0 || port > 65535 ||
+            inet_pton(AF_INET, name.substr(0, colon).c_str(), &backend->address.sin_addr) != 1) {
+            throw invalid_argument("bad backend address " + name);
+        }
+        for (int point = 0; point < UPSTREAM_HASH_POINTS; ++point) {
+            ring_.emplace_back(ring_hash(name + "#" + to_string(point)), backend.get());
+        }
+        backends_.push_back(move(backend));
+    }
+    if (backends_.empty()) {
+        throw invalid_argument("no backends for " + prefix_);
+    }
+    sort(ring_.begin(), ring_.end(), [](const auto& a, const auto& b) { return a.first < b.first; });
+}
+
+Upstream::~Upstream() {
+    for (auto& backend : backends_) {
+        for (auto& [fd, idle_since] : backend->idle) {
+            close(fd);
+        }
+    }
+}
+
+UpstreamBackend& Upstream::choose(const string& hash_key) {
+    lock_guard<mutex> lock(lock_);
+    auto now = chrono::steady_clock::now();
+    bool any_healthy = any_of(backends_.begin(), backends_.end(),
+                              [&](const auto& backend) { return now >= backend->ejected_until; });
+    auto usable = [&](const UpstreamBackend& backend) {
+        return !any_healthy || now >= backend.ejected_until;
+    };
+    
+    UpstreamBackend* chosen = nullptr;
+    size_t count = backends_.size();
+    switch (balancing_) {
+        case LoadBalancing::RoundRobin:
+            for (size_t i = 0; i < count && !chosen; ++i) {
+                UpstreamBackend& backend = *backends_[next_++ % count];
+                if (usable(backend)) {
+                    chosen = &backend;
+                }
+            }
+            break;
+        case LoadBalancing::LeastConnections: {
+            // Start from a rotating position so ties are shared out
+            size_t start = next_++;
+            for (size_t i = 0; i < count; ++i) {
+                UpstreamBackend& backend = *backends_[(start + i) % count];
+                if (usable(backend) && (!chosen || backend.active < chosen->active)) {
+                    chosen = &backend;
+                }
+            }
+            break;
+        }
+        case LoadBalancing::ConsistentHash: {
+            // First usable backend clockwise from the key's point
+            auto it = lower_bound(ring_.begin(), ring_.end(), ring_hash(hash_key),
+                                  [](const auto& entry, uint32_t point) { return entry.first < point; });
+            for (size_t i = 0; i < ring_.size() && !chosen; ++i, ++it) {
+                if (it == ring_.end()) {
+                    it = ring_.begin();
+                }
+                if (usable(*it->second)) {
+                    chosen = it->second;
+                }
+            }
+            break;
+        }
+    }
+    
+    chosen->requests++;
+    return *chosen;
+}
+
+int Upstream::checkout(UpstreamBackend& backend, bool& reused, bool pooled) {
+    {
+        lock_guard<mutex> lock(lock_);
+        backend.active++;
+    }
+    
+    // Newest idle connection first; one that is readable while idle has been
+    // closed by the backend
+    while (pooled) {
+        int fd;
+        chrono::steady_clock::time_point idle_since;
+        {
+            lock_guard<mutex> lock(lock_);
+            if (backend.idle.empty()) {
+                break;
+            }
+            tie(fd, idle_since) = backend.idle.back();
+            backend.idle.pop_back();
+        }
+        struct pollfd pfd = {fd, POLLIN, 0};
+        if (chrono::steady_clock::now() - idle_since < chrono::seconds(UPSTREAM_IDLE_TIMEOUT_SECONDS) &&
+            poll(&pfd, 1, 0) == 0) {
+            reused = true;
+            return fd;
+        }
+        close(fd);
+    }
+    
+    reused = false;
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC | SOCK_NONBLOCK, 0);
+    bool connected = false;
+    if (fd != -1) {
+        if (connect(fd, (struct sockaddr*)&backend.address, sizeof(backend.address)) == 0) {
+            connected = true;
+        } else if (errno == EINPROGRESS) {
+            struct pollfd pfd = {fd, POLLOUT, 0};
+            int error = 0;
+            socklen_t error_len = sizeof(error);
+            connected = poll(&pfd, 1, UPSTREAM_CONNECT_TIMEOUT_MS) == 1 &&
+                        getsockopt(fd, SOL_SOCKET, SO_ERROR, &error, &error_len) == 0 && error == 0;
+        }
+    }
+    if (!connected) {
+        log_error("Failed to connect to upstream " + backend.name);
+        if (fd != -1) {
+            close(fd);
+        }
+        lock_guard<mutex> lock(lock_);
+        backend.active--;
+        return -1;
+    }
+    
+    // Blocking from here on, bounded by the socket timeouts
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_NONBLOCK);
+    int nodelay = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+    struct timeval timeout = {UPSTREAM_TIMEOUT_SECONDS, 0};
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+    return fd;
+}
+
+void Upstream::checkin(UpstreamBackend& backend, int fd, bool reusable) {
+    {
+        lock_guard<mutex> lock(lock_);
+        backend.active--;
+        if (reusable && backend.idle.size() < UPSTREAM_POOL_SIZE) {
+            backend.idle.emplace_back(fd, chrono::steady_clock::now());
+            return;
+        }
+    }
+    close(fd);
+}
+
+void Upstream::report(UpstreamBackend& backend, bool success) {
+    lock_guard<mutex> lock(lock_);
+    auto now = chrono::steady_clock::now();
+    if (success) {
+        backend.consecutive_failures = 0;
+        if (now >= backend.ejected_until) {
+            backend.ejections = 0;
+        }
+        return;
+    }
+    
+    backend.failures++;
+    if (++backend.consecutive_failures >= UPSTREAM_MAX_FAILURES) {
+        int seconds = min(UPSTREAM_EJECTION_SECONDS << min(backend.ejections, 16), UPSTREAM_MAX_EJECTION_SECONDS);
+        backend.ejected_until = now + chrono::seconds(seconds);
+        backend.ejections++;
+        backend.consecutive_failures = 0;
+        log_error("Ejected upstream " + backend.name + " for " + to_string(seconds) + "s after repeated failures");
+    }
+}
+
+string Upstream::stats() {
+    lock_guard<mutex> lock(lock_);
+    auto now = chrono::steady_clock::now();
+    stringstream out;
+    out << "{\"prefix\":\"" << json_escape(prefix_) << "\",\"backends\":[";
+    for (size_t i = 0; i < backends_.size(); ++i) {
+        const UpstreamBackend& backend = *backends_[i];
+        out << (i ? "," : "") << "{\"name\":\"" << json_escape(backend.name) << "\""
+            << ",\"active\":" << backend.active
+            << ",\"idle\":" << backend.idle.size()
+            << ",\"requests\":" << backend.requests
+            << ",\"failures\":" << backend.failures
+            << ",\"ejected\":" << (now < backend.ejected_until ? "true" : "false") << "}";
+    }
+    out << "]}";
+    return out.str();
+}
+
+// Route for a request path, by longest matching prefix
+Upstream* find_upstream(const string& path) {
+    Upstream* best = nullptr;
+    for (auto& upstream : upstreams) {
+        if (path.starts_with(upstream->prefix()) &&
+            (!best || upstream->prefix().size() > best->prefix().size())) {
+            best = upstream.get();
+        }
+    }
+    return best;
+}
+
+// Headers that only describe one hop, or that the proxy re-frames itself
+const unordered_set<string> unforwarded_headers = {
+    "connection", "keep-alive", "proxy-connection", "te", "trailer", "transfer-encoding",
+    "upgrade", "http2-settings", "expect", "content-length"
+};
+
+// Whether a header is forwarded, given the message's Connection header,
+// which may name further hop-by-hop headers
+bool forwarded_header(const string& name, const string& connection) {
+    if (unforwarded_headers.count(name)) {
+        return false;
+    }
+    istringstream tokens(connection);
+    string token;
+    while (getline(tokens, token, ',')) {
+        token.erase(0, token.find_first_not_of(" \t"));
+        token.erase(token.find_last_not_of(" \t") + 1);
+        if (strcasecmp(token.c_str(), name.c_str()) == 0) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Body of a proxied response, read straight off the upstream connection.
+// The connection goes back to the pool once the body has been read to the
+// end; a body abandoned part way closes it. declared_length is what the
+// backend advertised, which for HEAD is not what follows on the wire.
+class UpstreamResponseStream : public ResponseStream {
+public:
+    UpstreamResponseStream(Upstream& upstream, UpstreamBackend& backend, int fd, string buffered,
+                           size_t content_length, bool chunked, bool reusable, optional<size_t> declared_length)
+        : upstream_(upstream), backend_(backend),
+          reader_(conn_, move(buffered), content_length, chunked, false, SIZE_MAX, UPSTREAM_TIMEOUT_SECONDS),
+          reusable_(reusable), length_(declared_length) {
+        conn_.fd = fd;
+    }
+
+    ~UpstreamResponseStream() override { release(false); }
+
+    ssize_t read(char* out, size_t length) override {
+        if (conn_.fd == -1) {
+            return reader_.finished() ? 0 : -1;
+        }
+        ssize_t bytes_read = reader_.read(out, length);
+        if (bytes_read == 0) {
+            release(reusable_ && !reader_.has_excess());
+        } else if (bytes_read < 0) {
+            log_error("Upstream " + backend_.name + " failed mid-response");
+            upstream_.report(backend_, false);
+            release(false);
+        }
+        return bytes_read;
+    }
+
+    optional<size_t> length() const override { return length_; }
+
+private:
+    void release(bool reusable) {
+        if (conn_.fd != -1) {
+            upstream_.checkin(backend_, conn_.fd, reusable);
+            conn_.fd = -1;
+        }
+    }
+
+    Upstream& upstream_;
+    UpstreamBackend& backend_;
+    Connection conn_;
+    BodyReader reader_;
+    bool reusable_;
+    optional<size_t> length_;
+};
+
+// Copy the request body upstream, re-chunking it when its length is unknown.
+// Returns false if the client's body was bad, setting upstream_failed when
+// the backend was the one that broke.
+bool send_request_body(Connection& upstream_conn, RequestBody& body, bool chunked, bool& upstream_failed) {
+    char buffer[BODY_BUFFER_SIZE];
+    while (true) {
+        ssize_t bytes_read = body.read(buffer, sizeof(buffer));
+        if (bytes_read < 0) {
+            return false;
+        }
+        if (bytes_read == 0) {
+            break;
+        }
+        char size_line[24];
+        int size_line_length = snprintf(size_line, sizeof(size_line), "%zx\r\n", static_cast<size_t>(bytes_read));
+        struct iovec iov[3] = {
+            {size_line, static_cast<size_t>(size_line_length)},
+            {buffer, static_cast<size_t>(bytes_read)},
+            {const_cast<char*>("\r\n"), 2}
+        };
+        bool sent = chunked ? upstream_conn.send_iov(iov, 3) : upstream_conn.send_all(buffer, bytes_read);
+        if (!sent) {
+            upstream_failed = true;
+            return false;
+        }
+    }
+    if (chunked && !upstream_conn.send_all("0\r\n\r\n", 5)) {
+        upstream_failed = true;
+        return false;
+    }
+    return true;
+}
+
+// Read an upstream response's header block, skipping interim 1xx responses.
+// Body bytes that arrived with it are left in buffer.
+bool read_upstream_head(Connection& upstream_conn, string& buffer, int& status, string& version,
+                        unordered_map<string, string>& headers) {
+    while (true) {
+        size_t head_end;
+        while ((head_end = buffer.find("\r\n\r\n")) == string::npos) {
+            if (buffer.size() > UPSTREAM_MAX_HEADER_SIZE ||
+                !upstream_conn.wait_readable(UPSTREAM_TIMEOUT_SECONDS * 1000)) {
+                return false;
+            }
+            char chunk[4096];
+            ssize_t bytes_received = upstream_conn.recv_some(chunk, sizeof(chunk));
+            if (bytes_received <= 0) {
+                return false;
+            }
+            buffer.append(chunk, bytes_received);
+        }
+        
+        istringstream head(buffer.substr(0, head_end + 2));
+        buffer.erase(0, head_end + 4);
+        
+        string line;
+        getline(head, line);
+        istringstream status_line(line);
+        if (!(status_line >> version >> status) || !version.starts_with("HTTP/1.") || status < 100 || status > 999) {
+            return false;
+        }
+        if (status < 200) {
+            continue;  // 100 Continue and friends; the final response follows
+        }
+        
+        headers.clear();
+        while (getline(head, line) && line != "\r" && !line.empty()) {
+            if (line.back() == '\r') {
+                line.pop_back();
+            }
+            size_t colon = line.find(':');
+            if (colon == string::npos) {
+                continue;
+            }
+            string name = line.substr(0, colon);
+            string value = line.substr(colon + 1);
+            name.erase(name.find_last_not_of(" \t") + 1);
+            value.erase(0, value.find_first_not_of(" \t"));
+            value.erase(value.find_last_not_of(" \t") + 1);
+            transform(name.begin(), name.end(), name.begin(), ::tolower);
+            
+            auto existing = headers.find(name);
+            if (existing != headers.end()) {
+                existing->second += ", " + value;
+            } else {
+                headers[name] = value;
+            }
+        }
+        return true;
+    }
+}
+
+// Forward a request to its upstream and stream the response back. A request
+// that fails on a pooled connection before any response arrives is retried
+// once on a fresh connection when it has no body to replay, since the backend
+// may simply have closed the idle connection; a backend that cannot be
+// reached is retried on another one.
+HttpResponse proxy_request(Upstream& upstream, const HttpRequest& request, const string& client_ip) {
+    HttpResponse response;
+    auto permit = admission.acquire(RequestClass::Upstream);
+    if (!permit) {
+        if (request.body) {
+            request.body->drain();
+        }
+        return overloaded_response();
+    }
+    
+    // Request head, sans hop-by-hop headers and with our own framing
+    auto connection = request.headers.find("connection");
+    string connection_tokens = connection != request.headers.end() ? connection->second : "";
+    string head = request.method + " " + request.path + " HTTP/1.1\r\n";
+    string forwarded_for = client_ip;
+    for (const auto& [name, value] : request.headers) {
+        if (name == "x-forwarded-for") {
+            forwarded_for = value + ", " + client_ip;
+        } else if (forwarded_header(name, connection_tokens)) {
+            head += name + ": " + value + "\r\n";
+        }
+    }
+    head += "x-forwarded-for: " + forwarded_for + "\r\n";
+    if (request.body) {
+        head += request.chunked ? "transfer-encoding: chunked\r\n"
+                                : "content-length: " + to_string(request.content_length) + "\r\n";
+    }
+    head += "\r\n";
+    
+    UpstreamBackend* backend = nullptr;
+    Connection upstream_conn;
+    string buffer;
+    int status = 0;
+    string version;
+    unordered_map<string, string> headers;
+    bool exchanged = false;
+    bool retry_fresh = false;
+    
+    for (int attempt = 0; attempt < 3 && !exchanged; ++attempt) {
+        if (!retry_fresh) {
+            backend = &upstream.choose(request.path);
+        }
+        // A retry skips the pool: the other idle connections may be just as stale
+        bool reused = false;
+        upstream_conn.fd = upstream.checkout(*backend, reused, !retry_fresh);
+        retry_fresh = false;
+        if (upstream_conn.fd == -1) {
+            upstream.report(*backend, false);
+            continue;
+        }
+        
+        bool upstream_failed = !upstream_conn.send_all(head.data(), head.size());
+        bool body_ok = !upstream_failed;
+        if (body_ok && request.body) {
+            body_ok = send_request_body(upstream_conn, *request.body, request.chunked, upstream_failed);
+        }
+        if (body_ok) {
+            buffer.clear();
+            exchanged = read_upstream_head(upstream_conn, buffer, status, version, headers);
+            upstream_failed = !exchanged;
+        }
+        if (exchanged) {
+            break;
+        }
+        
+        upstream.checkin(*backend, upstream_conn.fd, false);
+        upstream_conn.fd = -1;
+        if (!upstream_failed) {
+            // The client's body was bad; the backend did nothing wrong
+            response.status_code = request.body && request.body->too_large() ? 413 : 400;
+            response.body.append_static(response.status_code == 413
+                ? "<html><body><h1>413 Payload Too Large</h1></body></html>"
+                : "<html><body><h1>400 Bad Request</h1></body></html>");
+            response.headers["Content-Type"] = "text/html";
+            return response;
+        }
+        if (reused && !request.body) {
+            retry_fresh = true;  // Probably a stale pooled connection
+            continue;
+        }
+        upstream.report(*backend, false);
+        if (request.body) {
+            break;  // The body is gone; nothing to replay
+        }
+    }
+    
+    if (!exchanged) {
+        log_error("Upstream request failed for " + request.method + " " + request.path);
+        response.status_code = 502;
+        response.body.append_static("<html><body><h1>502 Bad Gateway</h1><p>Upstream server unavailable.</p></body></html>");
+        response.headers["Content-Type"] = "text/html";
+        return response;
+    }
+    
+    permit->complete();
+    response.permit = move(permit);
+    upstream.report(*backend, status != 502 && status != 503 && status != 504);
+    
+    // Body framing, per RFC 9112 section 6.3
+    auto header = [&headers](const char* name) {
+        auto it = headers.find(name);
+        return it != headers.end() ? it->second : string();
+    };
+    string transfer_encoding = header("transfer-encoding");
+    string upstream_connection = header("connection");
+    bool chunked = false;
+    size_t content_length = BodyReader::UNTIL_CLOSE;
+    optional<size_t> declared_length;
+    if (transfer_encoding.empty() && headers.count("content-length")) {
+        try {
+            declared_length = stoull(header("content-length"));
+        } catch (...) {
+            log_error("Invalid Content-Length from upstream " + backend->name);
+        }
+    }
+    if (request.method == "HEAD" || status == 204 || status == 304) {
+        content_length = 0;
+    } else if (!transfer_encoding.empty()) {
+        string lower = transfer_encoding;
+        transform(lower.begin(), lower.end(), lower.begin(), ::tolower);
+        chunked = lower.ends_with("chunked");
+    } else if (declared_length) {
+        content_length = *declared_length;
+    }
+    bool reusable = version == "HTTP/1.1" && (chunked || content_length != BodyReader::UNTIL_CLOSE);
+    string lower_connection = upstream_connection;
+    transform(lower_connection.begin(), lower_connection.end(), lower_connection.begin(), ::tolower);
+    if (lower_connection.find("close") != string::npos) {
+        reusable = false;
+    }
+    
+    response.status_code = status;
+    for (auto& [name, value] : headers) {
+        if (name != "server" && forwarded_header(name, upstream_connection)) {
+            response.headers[name] = move(value);
+        }
+    }
+    response.stream = make_shared<UpstreamResponseStream>(upstream, *backend, upstream_conn.fd, move(buffer),
+                                                          content_length, chunked, reusable, declared_length);
+    return response;
+}
+
+// ---------------------------------------------------------------------------
+// Native handlers
+// ---------------------------------------------------------------------------
+
+// What a native handler sees of its request. Everything is a view into the
+// HttpRequest and is valid only for the duration of the handler call.
+struct RequestView {
+    const HttpRequest& request;
+    const string& client_ip;
+    string_view path;   // Without the query string, still percent-encoded
+    string_view query;  // After '?', empty when absent
+    vector<pair<string_view, string_view>> params;  // Route parameters, still percent-encoded
+
+    RequestView(const HttpRequest& request, const string& client_ip)
+        : request(request), client_ip(client_ip), path(request.path) {
+        size_t query_start = path.find('?');
+        if (query_start != string_view::npos) {
+            query = path.substr(query_start + 1);
+            path = path.substr(0, query_start);
+        }
+    }
+
+    string_view method() const { return request.method; }
+
+    // Route parameter by name, or empty
+    string_view param(string_view name) const {
+        for (const auto& [key, value] : params) {
+            if (key == name) {
+                return value;
+            }
+        }
+        return {};
+    }
+
+    // Header by lowercase name, or empty
+    string_view header(const string& name) const {
+        auto it = request.headers.find(name);
+        return it == request.headers.end() ? string_view() : string_view(it->second);
+    }
+
+    // Decoded query-string parameter, or empty
+    string query_param(string_view name) const { return ::query_param(query, name); }
+
+    // Streaming request body, null when the request has none. Whatever the
+    // handler leaves unread is drained after it returns.
+    RequestBody* body() const { return request.body; }
+};
+
+// Handlers run on the request's worker thread, concurrently with other
+// requests, and must be thread-safe. Throwing yields a 500.
+using NativeHandler = function<HttpResponse(const RequestView&)>;
+
+// Response body a handler produces while it is being sent. The producer
+// fills up to length bytes and returns the count, 0 at the end or -1 to abort.
+class CallbackStream : public ResponseStream {
+public:
+    explicit CallbackStream(function<ssize_t(char*, size_t)> producer, optional<size_t> length = nullopt)
+        : producer_(move(producer)), length_(length) {}
+
+    ssize_t read(char* out, size_t length) override { return producer_(out, length); }
+    optional<size_t> length() const override { return length_; }
+
+private:
+    function<ssize_t(char*, size_t)> producer_;
+    optional<size_t> length_;
+};
+
+// Radix trie of route patterns. Literal runs are stored as compressed
+// edges; {name} matches one non-empty path segment and a final {name...}
+// matches the rest of the path. Lookup prefers literal edges, then
+// parameters, then catch-alls, backtracking when a branch dead-ends.
+class Router {
+public:
+    // Register a handler. Throws invalid_argument on a malformed pattern, a
+    // parameter name clash or a duplicate route.
+    void add(string_view method, string_view pattern, NativeHandler handler);
+
+    struct Match {
+        const NativeHandler* handler = nullptr;
+        bool path_matched = false;  // A route exists, maybe not for this method
+        string allow;               // Methods the matched path accepts
+    };
+
+    // Find the handler for method and path, filling params
+    Match find(string_view method, string_view path, vector<pair<string_view, string_view>>& params) const;
+
+    bool empty() const { return routes_ == 0; }
+
+private:
+    struct Node {
+        string prefix;                       // Literal edge label leading here
+        vector<unique_ptr<Node>> children;   // Literal edges, distinct first bytes
+        unique_ptr<Node> param;              // {name} edge
+        unique_ptr<Node> catch_all;          // {name...} edge
+        string name;                         // Parameter name, on param and catch-all nodes
+        vector<pair<string, NativeHandler>> handlers;  // Routes ending here, by method
+    };
+
+    Node* insert_literal(Node* node, string_view literal);
+    bool match(const Node* node, string_view rest, vector<pair<string_view, string_view>>& params,
+               const Node*& end) const;
+
+    Node root_;
+    size_t routes_ = 0;
+};
+
+// Walk or create literal edges for literal below node, splitting an edge
+// where the literal diverges from it
+Router::Node* Router::insert_literal(Node* node, string_view literal) {
+    while (!literal.empty()) {
+        auto child = find_if(node->children.begin(), node->children.end(),
+                             [&](const unique_ptr<Node>& candidate) { return candidate->prefix[0] == literal[0]; });
+        if (child == node->children.end()) {
+            node->children.push_back(make_unique<Node>());
+            node->children.back()->prefix = string(literal);
+            return node->children.back().get();
+        }
+        
+        size_t common = 0;
+        size_t limit = min((*child)->prefix.size(), literal.size());
+        while (common < limit && (*child)->prefix[common] == literal[common]) {
+            common++;
+        }
+        if (common < (*child)->prefix.size()) {
+            auto split = make_unique<Node>();
+            split->prefix = (*child)->prefix.substr(0, common);
+            (*child)->prefix.erase(0, common);
+            split->children.push_back(move(*child));
+            *child = move(split);
+        }
+        node = child->get();
+        literal.remove_prefix(common);
+    }
+    return node;
+}
+
+void Router::add(string_view method, string_view pattern, NativeHandler handler) {
+    const string route(pattern);
+    if (!pattern.starts_with("/")) {
+        throw invalid_argument(route + ": pattern must start with /");
+    }
+    
+    Node* node = &root_;
+    while (!pattern.empty()) {
+        size_t open = pattern.find('{');
+        node = insert_literal(node, pattern.substr(0, open));
+        if (open == string_view::npos) {
+            break;
+        }
+        
+        // A parameter spans a whole segment
+        size_t close = pattern.find('}', open);
+        if (close == string_view::npos || pattern[open - 1] != '/' ||
+            (close + 1 < pattern.size() && pattern[close + 1] != '/')) {
+            throw invalid_argument(route + ": parameters must span a whole path segment");
+        }
+        string_view name = pattern.substr(open + 1, close - open - 1);
+        bool rest = name.ends_with("...");
+        if (rest) {
+            name.remove_suffix(3);
+            if (close + 1 != pattern.size()) {
+                throw invalid_argument(route + ": {" + string(name) + "...} must come last");
+            }
+        }
+        if (name.empty() || name.find_first_of("{/") != string_view::npos) {
+            throw invalid_argument(route + ": bad parameter name");
+        }
+        
+        unique_ptr<Node>& edge = rest ? node->catch_all : node->param;
+        if (!edge) {
+            edge = make_unique<Node>();
+            edge->name = string(name);
+        } else if (edge->name != name) {
+            throw invalid_argument(route + ": {" + string(name) + "} conflicts with {" + edge->name +
+                                   "} registered at the same position");
+        }
+        node = edge.get();
+        pattern.remove_prefix(close + 1);
+    }
+    
+    for (const auto& existing : node->handlers) {
+        if (existing.first == method) {
+            throw invalid_argument(string(method) + " " + route + " is already registered");
+        }
+    }
+    node->handlers.emplace_back(string(method), move(handler));
+    routes_++;
+}
+
+// Match rest below node, whose own edge has been consumed. On success end is
+// the node holding the route's handlers and params has its parameters.
+bool Router::match(const Node* node, string_view rest, vector<pair<string_view, string_view>>& params,
+                   const Node*& end) const {
+    if (rest.empty() && !node->handlers.empty()) {
+        end = node;
+        return true;
+    }
+    
+    if (!rest.empty()) {
+        for (const auto& child : node->children) {
+            if (child->prefix[0] == rest[0]) {
+                if (rest.starts_with(child->prefix) &&
+                    match(child.get(), rest.substr(child->prefix.size()), params, end)) {
+                    return true;
+                }
+                break;
+            }
+        }
+        
+        size_t segment = min(rest.find('/'), rest.size());
+        if (node->param && segment > 0) {
+            params.emplace_back(node->param->name, rest.substr(0, segment));
+            if (match(node->param.get(), rest.substr(segment), params, end)) {
+                return true;
+            }
+            params.pop_back();
+        }
+    }
+    
+    if (node->catch_all && !node->catch_all->handlers.empty()) {
+        params.emplace_back(node->catch_all->name, rest);
+        end = node->catch_all.get();
+        return true;
+    }
+    return false;
+}
+
+Router::Match Router::find(string_view method, string_view path,
+                           vector<pair<string_view, string_view>>& params) const {
+    Match result;
+    const Node* end = nullptr;
+    if (routes_ == 0 || !match(&root_, path, params, end)) {
+        return result;
+    }
+    
+    result.path_matched = true;
+    const NativeHandler* get_handler = nullptr;
+    for (const auto& [route_method, handler] : end->handlers) {
+        if (route_method == method) {
+            result.handler = &handler;
+        } else if (route_method == "GET") {
+            get_handler = &handler;
+        }
+        result.allow += (result.allow.empty() ? "" : ", ") + route_method;
+    }
+    
+    // HEAD is served by the GET handler unless it has its own
+    if (!result.handler && method == "HEAD") {
+        result.handler = get_handler;
+    }
+    return result;
+}
+
+// Routes are registered at startup, before any request is served, and
+// read-only afterwards
+Router native_router;
+
+// Built-in native endpoints. In-process handlers for the application are
+// registered here as well.
+void register_native_routes() {
+    native_router.add("GET", "/healthz", [](const RequestView&) {
+        HttpResponse response;
+        response.headers["Content-Type"] = "application/json";
+        response.headers["Cache-Control"] = "no-store";
+        response.body.append_static("{\"status\":\"ok\"}");
+        return response;
+    });
+}
+
+// Run the native handler for the request, if a route matches its path
+optional<HttpResponse> route_native(const HttpRequest& request, const string& client_ip) {
+    if (native_router.empty()) {
+        return nullopt;
+    }
+    RequestView view(request, client_ip);
+    Router::Match match = native_router.find(request.method, view.path, view.params);
+    if (!match.path_matched) {
+        return nullopt;
+    }
+    
+    HttpResponse response;
+    if (!match.handler) {
+        if (request.body) {
+            request.body->drain();
+        }
+        response.status_code = 405;
+        response.body.append_static("<html><body><h1>405 Method Not Allowed</h1></body></html>");
+        response.headers["Content-Type"] = "text/html";
+        response.headers["Allow"] = match.allow;
+        return response;
+    }
+    
+    auto permit = admission.acquire(RequestClass::Native);
+    if (!permit) {
+        if (request.body) {
+            request.body->drain();
+        }
+        return overloaded_response();
+    }
+    
+    try {
+        TraceSpan span("native_handler");
+        response = (*match.handler)(view);
+    } catch (const exception& e) {
+        log_error("Native handler for " + string(view.path) + " failed: " + e.what());
+        response = HttpResponse();
+        response.status_code = 500;
+        response.body.append_static("<html><body><h1>500 Internal Server Error</h1></body></html>");
+        response.headers["Content-Type"] = "text/html";
+    }
+    permit->complete();
+    if (!response.permit) {
+        response.permit = move(permit);
+    }
+    
+    if (request.body) {
+        request.body->drain();
+    }
+    return response;
+}
+
+// Admin endpoints for runtime tuning and inspection
+HttpResponse handle_admin(const HttpRequest& request, const string& client_ip) {
+    HttpResponse response;
+    if (client_ip != "127.0.0.1") {
+        response.status_code = 404;
+        response.body.append_static("<html><body><h1>404 Not Found</h1><p>The requested resource was not found.</p></body></html>");
+        response.headers["Content-Type"] = "text/html";
+        return response;
+    }
+    
+    size_t query_start = request.path.find('?');
+    string endpoint = request.path.substr(0, query_start);
+    string_view query = query_start == string::npos ? "" : string_view(request.path).substr(query_start + 1);
+    response.headers["Content-Type"] = "application/json";
+    response.headers["Cache-Control"] = "no-store";
+    
+    if (endpoint == "/__admin/stats") {
+        string upstream_stats;
+        for (auto& upstream : upstreams) {
+            upstream_stats += (upstream_stats.empty() ? "" : ",") + upstream->stats();
+        }
+        response.body.append("{\"admission\":" + admission.stats() + ",\"assets\":" + asset_cache.stats() +
+                             ",\"egress\":" + egress_scheduler.stats() +
+                             ",\"memory\":" + memory_accountant.stats() +
+                             ",\"coalescing\":{\"files\":" + file_flights.stats() +
+                             ",\"php\":" + php_flights.stats() + "}" +
+                             ",\"pack\":" + asset_pack.stats() +
+                             ",\"upstreams\":[" + upstream_stats + "]}");
+    } else if (endpoint == "/__admin/trace") {
+        // ?rate=<0..1>&slow_ms=<ms> updates the settings
+        try {
+            string rate = query_param(query, "rate");
+            if (!rate.empty()) {
+                trace_sample_ppm = static_cast<uint32_t>(clamp(stod(rate), 0.0, 1.0) * 1000000);
+            }
+            string slow_ms = query_param(query, "slow_ms");
+            if (!slow_ms.empty()) {
+                slow_request_ms = static_cast<uint32_t>(stoul(slow_ms));
+            }
+        } catch (...) {
+            response.status_code = 400;
+        }
+        response.body.append("{\"rate\":" + to_string(trace_sample_ppm / 1000000.0) +
+                             ",\"slow_ms\":" + to_string(slow_request_ms) + "}");
+    } else if (endpoint == "/__admin/capture") {
+        // ?enable=1 starts a new capture file, ?enable=0 stops
+        string enable = query_param(query, "enable");
+        if (enable == "1") {
+            if (!traffic_capture.start()) {
+                response.status_code = 500;
+            }
+        } else if (enable == "0") {
+            traffic_capture.stop();
+        } else if (!enable.empty()) {
+            response.status_code = 400;
+        }
+        response.body.append(traffic_capture.stats());
+    } else if (endpoint == "/__admin/trace/dump") {
+        stringstream dump;
+        trace_registry.dump(dump);
+        response.body.append(dump.str());
+    } else {
+        response.status_code = 404;
+        response.body.append_static("{}");
+    }
+    return response;
+}
+
+// Process HTTP request
+HttpResponse process_request(const HttpRequest& request, const string& client_ip) {
+    log_info("Processing request from IP: " + client_ip);
+
+    HttpResponse response;
+    
+    if (!request.valid) {
+        if (request.error_status == 413) {
+            response.status_code = 413;
+            response.body.append_static("<html><body><h1>413 Payload Too Large</h1></body></html>");
+            response.headers["Content-Type"] = "text/html";
+            return response;
+        }
+        response.status_code = 400;
+        response.body.append_static("<html><body><h1>400 Bad Request</h1></body></html>");
+        response.headers["Content-Type"] = "text/html";
+        return response;
+    }
+    
+    // Operational endpoints, loopback only
+    if (request.path.starts_with("/__admin/")) {
+        return handle_admin(request, client_ip);
+    }
+    
+    // Native handlers run in-process, ahead of proxy and filesystem
+    if (auto native = route_native(request, client_ip)) {
+        return move(*native);
+    }
+    
+    // Proxied prefixes never touch the filesystem
+    if (Upstream* upstream = find_upstream(request.path)) {
+        return proxy_request(*upstream, request, client_ip);
+    }
+    
+    // Packed assets are served from memory; misses fall through to the filesystem
+    if (auto packed = serve_from_pack(request)) {
+        return move(*packed);
+    }
+    
+    // Sanitize path
+    string safe_path;
+    {
+        TraceSpan span("sanitize_path");
+        safe_path = sanitize_path(request.path);
+    }
+    if (safe_path.empty()) {
+        response.status_code = 403;
+        response.body.append_static("<html><body><h1>403 Forbidden</h1><p>Invalid path.</p></body></html>");
+        response.headers["Content-Type"] = "text/html";
+        return response;
+    }
+    
+    // Check for forbidden files
+    if (is_forbidden_file(safe_path)) {
+        response.status_code = 403;
+        response.body.append_static("<html><body><h1>403 Forbidden</h1><p>Access denied.</p></body></html>");
+        response.headers["Content-Type"] = "text/html";
+        return response;
+    }
+    
+    // Check if file/directory exists
+    if (!fs::exists(safe_path)) {
+        response.status_code = 404;
+        response.body.append_static("<html><body><h1>404 Not Found</h1><p>The requested resource was not found.</p></body></html>");
+        response.headers["Content-Type"] = "text/html";
+        return response;
+    }
+    
+    // Handle directory
+    if (fs::is_directory(safe_path)) {
+        return handle_directory(safe_path, request.path);
+    }
+    
+    // Handle PHP files
+    if (safe_path.ends_with(".php")) {
+        PhpResult result = run_php_coalesced(safe_path, request);
+        if (result.overloaded) {
+            if (request.body) {
+                request.body->drain();
+            }
+            return overloaded_response();
+        }
+        response.permit = move(result.permit);
+        
+        if (result.executed) {
+            response.body.append(move(result.output));
+            response.headers["Content-Type"] = "text/html";
+        } else if (request.body && request.body->too_large()) {
+            response.status_code = 413;
+            response.body.append_static("<html><body><h1>413 Payload Too Large</h1></body></html>");
+            response.headers["Content-Type"] = "text/html";
+        } else if (request.body && request.body->failed()) {
+            response.status_code = 400;
+            response.body.append_static("<html><body><h1>400 Bad Request</h1></body></html>");
+            response.headers["Content-Type"] = "text/html";
+        } else {
+            response.status_code = 500;
+            response.body.append_static("<html><body><h1>500 Internal Server Error</h1><p>PHP execution failed.</p></body></html>");
+            response.headers["Content-Type"] = "text/html";
+        }
+        return response;
+    }
+    
+    // Static files don't consume a body; drain it so the client reads our response
+    if (request.body) {
+        request.body->drain();
+    }
+    
+    // Handle static files
+    auto permit = admission.acquire(RequestClass::Static);
+    if (!permit) {
+        return overloaded_response();
+    }
+    if (read_file_safe(safe_path, response)) {
+        permit->complete();
+        response.permit = move(permit);
+        response.headers["Content-Type"] = get_mime_type(safe_path);
+    } else {
+        response.status_code = 500;
+        response.body.append_static("<html><body><h1>500 Internal Server Error</h1><p>Failed to read file.</p></body></html>");
+        response.headers["Content-Type"] = "text/html";
+    }
+    
+    return response;
+}
+
+// Send HTTP response
+bool send_response(Connection& conn, const HttpResponse& response) {
+    string status_message = "Unknown";
+    auto it = status_messages.find(response.status_code);
+    if (it != status_messages.end()) {
+        status_message = it->second;
+    }
+    
+    // Build response headers
+    stringstream response_stream;
+    response_stream << "HTTP/1.1 " << response.status_code << " " << status_message << "\r\n";
+    response_stream << "Server: " << SERVER_NAME << "\r\n";
+    response_stream << "Connection: close\r\n";
+    
+    // Add custom headers
+    for (const auto& header : response.headers) {
+        response_stream << header.first << ": " << header.second << "\r\n";
+    }
+    
+    // Content length; a stream of unknown length is delimited by the close,
+    // and 204/304 responses have neither body nor length
+    bool bodiless = response.status_code == 204 || response.status_code == 304;
+    if (!response.stream) {
+        if (!bodiless) {
+            response_stream << "Content-Length: " << response.body.size() << "\r\n";
+        }
+    } else if (auto stream_length = response.stream->length()) {
+        response_stream << "Content-Length: " << response.body.size() + *stream_length << "\r\n";
+    }
+    
+    response_stream << "\r\n";
+    
+    // Headers and body go out together; shared body slices are never copied
+    string headers = response_stream.str();
+    optional<size_t> total = headers.size() + response.body.size();
+    if (response.stream) {
+        auto stream_length = response.stream->length();
+        total = stream_length ? optional<size_t>(*total + *stream_length) : nullopt;
+    }
+    size_t sent = 0;
+    if (!send_scheduled(conn, headers, response.body, sent, total)) {
+        return false;
+    }
+    
+    if (response.stream) {
+        const BufferChain no_chain;
+        char buffer[BODY_BUFFER_SIZE];
+        ssize_t bytes_read;
+        while ((bytes_read = response.stream->read(buffer, sizeof(buffer))) > 0) {
+            if (!send_scheduled(conn, string_view(buffer, bytes_read), no_chain, sent, total)) {
+                return false;
+            }
+        }
+        return bytes_read == 0;
+    }
+    return true;
+}
+
+// Read request headers with timeout. Any body bytes that arrived alongside
+// the headers are left at the end of the returned string.
+string read_request_with_timeout(Connection& conn) {
+    string request;
+    char buffer[1024];
+    
+    while (request.length() < MAX_REQUEST_SIZE) {
+        if (!conn.wait_readable(REQUEST_TIMEOUT_SECONDS * 1000)) {
+            break;  // Timeout or error
+        }
+        
+        ssize_t bytes_received = conn.recv_some(buffer, sizeof(buffer));
+        if (bytes_received <= 0) {
+            break;
+        }
+        
+        request.append(buffer, bytes_received);
+        
+        // Check if we have complete headers
+        if (request.find("\r\n\r\n") != string::npos) {
+            break;
+        }
+    }
+    
+    return request;
+}
+
+#ifdef ENABLE_TLS
+// Build the shared server context: TLS 1.3 only, server-side session cache
+// plus stateless tickets for resumption, and kTLS when the kernel offers it
+SSL_CTX* create_tls_context() {
+    SSL_CTX* ctx = SSL_CTX_new(TLS_server_method());
+    if (!ctx) {
+        return nullptr;
+    }
+    
+    SSL_CTX_set_min_proto_version(ctx, TLS1_3_VERSION);
+    SSL_CTX_set_options(ctx, SSL_OP_ENABLE_KTLS);
+    SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_SERVER);
+    SSL_CTX_sess_set_cache_size(ctx, TLS_SESSION_CACHE_SIZE);
+    SSL_CTX_set_timeout(ctx, TLS_SESSION_TIMEOUT_SECONDS);
+    SSL_CTX_set_num_tickets(ctx, TLS_TICKETS_PER_HANDSHAKE);
+    
+    // ALPN: prefer h2, fall back to HTTP/1.1
+    SSL_CTX_set_alpn_select_cb(ctx, [](SSL*, const unsigned char** out, unsigned char* out_len,
+                                       const unsigned char* in, unsigned int in_len, void*) {
+        static const unsigned char protocols[] = "\x02h2\x08http/1.1";
+        unsigned char* selected;
+        if (SSL_select_next_proto(&selected, out_len, protocols, sizeof(protocols) - 1,
+                                  in, in_len) != OPENSSL_NPN_NEGOTIATED) {
+            return SSL_TLSEXT_ERR_NOACK;
+        }
+        *out = selected;
+        return SSL_TLSEXT_ERR_OK;
+    }, nullptr);
+    
+    static const unsigned char session_id_context[] = "SecureHTTP";
+    SSL_CTX_set_session_id_context(ctx, session_id_context, sizeof(session_id_context) - 1);
+    
+    if (SSL_CTX_use_certificate_chain_file(ctx, TLS_CERT_FILE) != 1 ||
+        SSL_CTX_use_PrivateKey_file(ctx, TLS_KEY_FILE, SSL_FILETYPE_PEM) != 1 ||
+        SSL_CTX_check_private_key(ctx) != 1) {
+        char error_buffer[256];
+        ERR_error_string_n(ERR_get_error(), error_buffer, sizeof(error_buffer));
+        log_error("Failed to load TLS certificate: " + string(error_buffer));
+        SSL_CTX_free(ctx);
+        return nullptr;
+    }
+    
+    return ctx;
+}
+
+// Run the TLS handshake on an accepted socket
+bool accept_tls(Connection& conn, const string& client_ip) {
+    conn.ssl = SSL_new(tls_context);
+    if (!conn.ssl || SSL_set_fd(conn.ssl, conn.fd) != 1) {
+        return false;
+    }
+    
+    if (SSL_accept(conn.ssl) != 1) {
+        log_error("TLS handshake failed with " + client_ip);
+        return false;
+    }
+    
+    // kTLS is only switched on when both the kernel module and the cipher allow it
+    conn.ktls_send = BIO_get_ktls_send(SSL_get_wbio(conn.ssl));
+    return true;
+}
+#endif
+
+// ---------------------------------------------------------------------------
+// HPACK header compression (RFC 7541)
+// ---------------------------------------------------------------------------
+
+struct HuffmanCode {
+    uint32_t code;
+    uint8_t bits;
+};
+
+// Canonical Huffman code from RFC 7541 Appendix B; index 256 is EOS
+const HuffmanCode huffman_codes[257] = {
+    {0x1ff8, 13}, {0x7fffd8, 23}, {0xfffffe2, 28}, {0xfffffe3, 28}, {0xfffffe4, 28}, {0xfffffe5, 28},
+    {0xfffffe6, 28}, {0xfffffe7, 28}, {0xfffffe8, 28}, {0xffffea, 24}, {0x3ffffffc, 30}, {0xfffffe9, 28},
+    {0xfffffea, 28}, {0x3ffffffd, 30}, {0xfffffeb, 28}, {0xfffffec, 28}, {0xfffffed, 28}, {0xfffffee, 28},
+    {0xfffffef, 28}, {0xffffff0, 28}, {0xffffff1, 28}, {0xffffff2, 28}, {0x3ffffffe, 30}, {0xffffff3, 28},
+    {0xffffff4, 28}, {0xffffff5, 28}, {0xffffff6, 28}, {0xffffff7, 28}, {0xffffff8, 28}, {0xffffff9, 28},
+    {0xffffffa, 28}, {0xffffffb, 28}, {0x14, 6}, {0x3f8, 10}, {0x3f9, 10}, {0xffa, 12},
+    {0x1ff9, 13}, {0x15, 6}, {0xf8, 8}, {0x7fa, 11}, {0x3fa, 10}, {0x3fb, 10},
+    {0xf9, 8}, {0x7fb, 11}, {0xfa, 8}, {0x16, 6}, {0x17, 6}, {0x18, 6},
+    {0x0, 5}, {0x1, 5}, {0x2, 5}, {0x19, 6}, {0x1a, 6}, {0x1b, 6},
+    {0x1c, 6}, {0x1d, 6}, {0x1e, 6}, {0x1f, 6}, {0x5c, 7}, {0xfb, 8},
+    {0x7ffc, 15}, {0x20, 6}, {0xffb, 12}, {0x3fc, 10}, {0x1ffa, 13}, {0x21, 6},
+    {0x5d, 7}, {0x5e, 7}, {0x5f, 7}, {0x60, 7}, {0x61, 7}, {0x62, 7},
+    {0x63, 7}, {0x64, 7}, {0x65, 7}, {0x66, 7}, {0x67, 7}, {0x68, 7},
+    {0x69, 7}, {0x6a, 7}, {0x6b, 7}, {0x6c, 7}, {0x6d, 7}, {0x6e, 7},
+    {0x6f, 7}, {0x70, 7}, {0x71, 7}, {0x72, 7}, {0xfc, 8}, {0x73, 7},
+    {0xfd, 8}, {0x1ffb, 13}, {0x7fff0, 19}, {0x1ffc, 13}, {0x3ffc, 14}, {0x22, 6},
+    {0x7ffd, 15}, {0x3, 5}, {0x23, 6}, {0x4, 5}, {0x24, 6}, {0x5, 5},
+    {0x25, 6}, {0x26, 6}, {0x27, 6}, {0x6, 5}, {0x74, 7}, {0x75, 7},
+    {0x28, 6}, {0x29, 6}, {0x2a, 6}, {0x7, 5}, {0x2b, 6}, {0x76, 7},
+    {0x2c, 6}, {0x8, 5}, {0x9, 5}, {0x2d, 6}, {0x77, 7}, {0x78, 7},
+    {0x79, 7}, {0x7a, 7}, {0x7b, 7}, {0x7ffe, 15}, {0x7fc, 11}, {0x3ffd, 14},
+    {0x1ffd, 13}, {0xffffffc, 28}, {0xfffe6, 20}, {0x3fffd2, 22}, {0xfffe7, 20}, {0xfffe8, 20},
+    {0x3fffd3, 22}, {0x3fffd4, 22}, {0x3fffd5, 22}, {0x7fffd9, 23}, {0x3fffd6, 22}, {0x7fffda, 23},
+    {0x7fffdb, 23}, {0x7fffdc, 23}, {0x7fffdd, 23}, {0x7fffde, 23}, {0xffffeb, 24}, {0x7fffdf, 23},
+    {0xffffec, 24}, {0xffffed, 24}, {0x3fffd7, 22}, {0x7fffe0, 23}, {0xffffee, 24}, {0x7fffe1, 23},
+    {0x7fffe2, 23}, {0x7fffe3, 23}, {0x7fffe4, 23}, {0x1fffdc, 21}, {0x3fffd8, 22}, {0x7fffe5, 23},
+    {0x3fffd9, 22}, {0x7fffe6, 23}, {0x7fffe7, 23}, {0xffffef, 24}, {0x3fffda, 22}, {0x1fffdd, 21},
+    {0xfffe9, 20}, {0x3fffdb, 22}, {0x3fffdc, 22}, {0x7fffe8, 23}, {0x7fffe9, 23}, {0x1fffde, 21},
+    {0x7fffea, 23}, {0x3fffdd, 22}, {0x3fffde, 22}, {0xfffff0, 24}, {0x1fffdf, 21}, {0x3fffdf, 22},
+    {0x7fffeb, 23}, {0x7fffec, 23}, {0x1fffe0, 21}, {0x1fffe1, 21}, {0x3fffe0, 22}, {0x1fffe2, 21},
+    {0x7fffed, 23}, {0x3fffe1, 22}, {0x7fffee, 23}, {0x7fffef, 23}, {0xfffea, 20}, {0x3fffe2, 22},
+    {0x3fffe3, 22}, {0x3fffe4, 22}, {0x7ffff0, 23}, {0x3fffe5, 22}, {0x3fffe6, 22}, {0x7ffff1, 23},
+    {0x3ffffe0, 26}, {0x3ffffe1, 26}, {0xfffeb, 20}, {0x7fff1, 19}, {0x3fffe7, 22}, {0x7ffff2, 23},
+    {0x3fffe8, 22}, {0x1ffffec, 25}, {0x3ffffe2, 26}, {0x3ffffe3, 26}, {0x3ffffe4, 26}, {0x7ffffde, 27},
+    {0x7ffffdf, 27}, {0x3ffffe5, 26}, {0xfffff1, 24}, {0x1ffffed, 25}, {0x7fff2, 19}, {0x1fffe3, 21},
+    {0x3ffffe6, 26}, {0x7ffffe0, 27}, {0x7ffffe1, 27}, {0x3ffffe7, 26}, {0x7ffffe2, 27}, {0xfffff2, 24},
+    {0x1fffe4, 21}, {0x1fffe5, 21}, {0x3ffffe8, 26}, {0x3ffffe9, 26}, {0xffffffd, 28}, {0x7ffffe3, 27},
+    {0x7ffffe4, 27}, {0x7ffffe5, 27}, {0xfffec, 20}, {0xfffff3, 24}, {0xfffed, 20}, {0x1fffe6, 21},
+    {0x3fffe9, 22}, {0x1fffe7, 21}, {0x1fffe8, 21}, {0x7ffff3, 23}, {0x3fffea, 22}, {0x3fffeb, 22},
+    {0x1ffffee, 25}, {0x1ffffef, 25}, {0xfffff4, 24}, {0xfffff5, 24}, {0x3ffffea, 26}, {0x7ffff4, 23},
+    {0x3ffffeb, 26}, {0x7ffffe6, 27}, {0x3ffffec, 26}, {0x3ffffed, 26}, {0x7ffffe7, 27}, {0x7ffffe8, 27},
+    {0x7ffffe9, 27}, {0x7ffffea, 27}, {0x7ffffeb, 27}, {0xffffffe, 28}, {0x7ffffec, 27}, {0x7ffffed, 27},
+    {0x7ffffee, 27}, {0x7ffffef, 27}, {0x7fffff0, 27}, {0x3ffffee, 26}, {0x3fffffff, 30},
+};
+
+const pair<const char*, const char*> hpack_static_table[] = {
+    {":authority", ""},
+    {":method", "GET"},
+    {":method", "POST"},
+    {":path", "/"},
+    {":path", "/index.html"},
+    {":scheme", "http"},
+    {":scheme", "https"},
+    {":status", "200"},
+    {":status", "204"},
+    {":status", "206"},
+    {":status", "304"},
+    {":status", "400"},
+    {":status", "404"},
+    {":status", "500"},
+    {"accept-charset", ""},
+    {"accept-encoding", "gzip, deflate"},
+    {"accept-language", ""},
+    {"accept-ranges", ""},
+    {"accept", ""},
+    {"access-control-allow-origin", ""},
+    {"age", ""},
+    {"allow", ""},
+    {"authorization", ""},
+    {"cache-control", ""},
+    {"content-disposition", ""},
+    {"content-encoding", ""},
+    {"content-language", ""},
+    {"content-length", ""},
+    {"content-location", ""},
+    {"content-range", ""},
+    {"content-type", ""},
+    {"cookie", ""},
+    {"date", ""},
+    {"etag", ""},
+    {"expect", ""},
+    {"expires", ""},
+    {"from", ""},
+    {"host", ""},
+    {"if-match", ""},
+    {"if-modified-since", ""},
+    {"if-none-match", ""},
+    {"if-range", ""},
+    {"if-unmodified-since", ""},
+    {"last-modified", ""},
+    {"link", ""},
+    {"location", ""},
+    {"max-forwards", ""},
+    {"proxy-authenticate", ""},
+    {"proxy-authorization", ""},
+    {"range", ""},
+    {"referer", ""},
+    {"refresh", ""},
+    {"retry-after", ""},
+    {"server", ""},
+    {"set-cookie", ""},
+    {"strict-transport-security", ""},
+    {"transfer-encoding", ""},
+    {"user-agent", ""},
+    {"vary", ""},
+    {"via", ""},
+    {"www-authenticate", ""},
+};
+constexpr size_t HPACK_STATIC_TABLE_SIZE = sizeof(hpack_static_table) / sizeof(hpack_static_table[0]);
+
+struct HuffmanNode {
+    int16_t children[2] = {-1, -1};
+    int16_t symbol = -1;
+};
+
+// Decoding tree built once from huffman_codes
+const vector<HuffmanNode>& huffman_tree() {
+    static const vector<HuffmanNode> tree = [] {
+        vector<HuffmanNode> nodes(1);
+        for (int symbol = 0; symbol < 257; ++symbol) {
+            size_t node = 0;
+            for (int bit = huffman_codes[symbol].bits - 1; bit >= 0; --bit) {
+                int direction = (huffman_codes[symbol].code >> bit) & 1;
+                if (nodes[node].children[direction] == -1) {
+                    nodes[node].children[direction] = static_cast<int16_t>(nodes.size());
+                    nodes.emplace_back();
+                }
+                node = nodes[node].children[direction];
+            }
+            nodes[node].symbol = static_cast<int16_t>(symbol);
+        }
+        return nodes;
+    }();
+    return tree;
+}
+
+bool huffman_decode(const uint8_t* data, size_t length, string& out) {
+    const vector<HuffmanNode>& tree = huffman_tree();
+    size_t node = 0;
+    int pending_bits = 0;
+    bool pending_all_ones = true;
+    
+    for (size_t i = 0; i < length; ++i) {
+        for (int bit = 7; bit >= 0; --bit) {
+            int direction = (data[i] >> bit) & 1;
+            int16_t next = tree[node].children[direction];
+            if (next == -1) {
+                return false;
+            }
+            node = next;
+            pending_bits++;
+            pending_all_ones = pending_all_ones && direction == 1;
+            
+            if (tree[node].symbol != -1) {
+                if (tree[node].symbol == 256) {
+                    return false;  // EOS inside a string is a decoding error
+                }
+                out += static_cast<char>(tree[node].symbol);
+                node = 0;
+                pending_bits = 0;
+                pending_all_ones = true;
+            }
+        }
+    }
+    
+    // Padding must be a prefix of EOS no longer than 7 bits
+    return pending_bits <= 7 && pending_all_ones;
+}
+
+bool hpack_decode_integer(const uint8_t*& pos, const uint8_t* end, int prefix_bits, uint64_t& value) {
+    if (pos >= end) {
+        return false;
+    }
+    uint64_t max_prefix = (1u << prefix_bits) - 1;
+    value = *pos++ & max_prefix;
+    if (value < max_prefix) {
+        return true;
+    }
+    
+    for (int shift = 0; pos < end && shift <= 28; shift += 7) {
+        uint8_t byte = *pos++;
+        value += static_cast<uint64_t>(byte & 0x7f) << shift;
+        if (!(byte & 0x80)) {
+            return true;
+        }
+    }
+    return false;  // Truncated or larger than 32 bits
+}
+
+void hpack_encode_integer(string& out, uint8_t flags, int prefix_bits, uint64_t value) {
+    uint64_t max_prefix = (1u << prefix_bits) - 1;
+    if (value < max_prefix) {
+        out += static_cast<char>(flags | value);
+        return;
+    }
+    out += static_cast<char>(flags | max_prefix);
+    value -= max_prefix;
+    while (value >= 0x80) {
+        out += static_cast<char>((value & 0x7f) | 0x80);
+        value >>= 7;
+    }
+    out += static_cast<char>(value);
+}
+
+bool hpack_decode_string(const uint8_t*& pos, const uint8_t* end, string& out) {
+    if (pos >= end) {
+        return false;
+    }
+    bool huffman = *pos & 0x80;
+    uint64_t length;
+    if (!hpack_decode_integer(pos, end, 7, length) || length > static_cast<uint64_t>(end - pos)) {
+        return false;
+    }
+    
+    out.clear();
+    if (huffman) {
+        if (!huffman_decode(pos, length, out)) {
+            return false;
+        }
+    } else {
+        out.assign(reinterpret_cast<const char*>(pos), length);
+    }
+    pos += length;
+    return true;
+}
+
+// Literals are sent without Huffman coding: it keeps the encoder trivial and
+// our response headers are short
+void hpack_encode_string(string& out, const string& value) {
+    hpack_encode_integer(out, 0x00, 7, value.length());
+    out += value;
+}
+
+// HPACK dynamic table. Entries are addressed after the static table, newest
+// first, and evicted oldest first once the size budget is exceeded.
+class HpackTable {
+public:
+    bool lookup(uint64_t index, pair<string, string>& header) const {
+        if (index == 0) {
+            return false;
+        }
+        if (index <= HPACK_STATIC_TABLE_SIZE) {
+            header = {hpack_static_table[index - 1].first, hpack_static_table[index - 1].second};
+            return true;
+        }
+        index -= HPACK_STATIC_TABLE_SIZE + 1;
+        if (index >= entries_.size()) {
+            return false;
+        }
+        header = entries_[index];
+        return true;
+    }
+
+    // Index of an exact match, or of a name-only match with exact set to false; 0 if neither
+    uint64_t find(const string& name, const string& value, bool& exact) const {
+        uint64_t name_match = 0;
+        for (size_t i = 0; i < HPACK_STATIC_TABLE_SIZE; ++i) {
+            if (name == hpack_static_table[i].first) {
+                if (value == hpack_static_table[i].second) {
+                    exact = true;
+                    return i + 1;
+                }
+                if (name_match == 0) {
+                    name_match = i + 1;
+                }
+            }
+        }
+        for (size_t i = 0; i < entries_.size(); ++i) {
+            if (entries_[i].first == name) {
+                if (entries_[i].second == value) {
+                    exact = true;
+                    return HPACK_STATIC_TABLE_SIZE + i + 1;
+                }
+                if (name_match == 0) {
+                    name_match = HPACK_STATIC_TABLE_SIZE + i + 1;
+                }
+            }
+        }
+        exact = false;
+        return name_match;
+    }
+
+    void insert(const string& name, const string& value) {
+        size_t entry_size = name.length() + value.length() + 32;
+        if (entry_size > max_size_) {
+            entries_.clear();  // An oversized entry empties the table
+            size_ = 0;
+            return;
+        }
+        entries_.emplace_front(name, value);
+        size_ += entry_size;
+        evict();
+    }
+
+    void set_max_size(size_t max_size) {
+        max_size_ = max_size;
+        evict();
+    }
+
+    size_t max_size() const { return max_size_; }
+
+private:
+    void evict() {
+        while (size_ > max_size_ && !entries_.empty()) {
+            size_ -= entries_.back().first.length() + entries_.back().second.length() + 32;
+            entries_.pop_back();
+        }
+    }
+
+    deque<pair<string, string>> entries_;
+    size_t size_ = 0;
+    size_t max_size_ = 4096;
+};
+
+// Decode one complete header block. size_limit is the table size we
+// advertised; max_list_size caps the decoded header list.
+bool hpack_decode(HpackTable& table, size_t size_limit, const string& block,
+                  vector<pair<string, string>>& headers, size_t max_list_size) {
+    const uint8_t* pos = reinterpret_cast<const uint8_t*>(block.data());
+    const uint8_t* end = pos + block.length();
+    size_t list_size = 0;
+    bool headers_seen = false;
+    
+    while (pos < end) {
+        uint8_t first = *pos;
+        pair<string, string> header;
+        
+        if (first & 0x80) {
+            // Indexed header field
+            uint64_t index;
+            if (!hpack_decode_integer(pos, end, 7, index) || !table.lookup(index, header)) {
+                return false;
+            }
+        } else if ((first & 0xe0) == 0x20) {
+            // Table size updates are only allowed before the first header
+            uint64_t new_size;
+            if (headers_seen || !hpack_decode_integer(pos, end, 5, new_size) || new_size > size_limit) {
+                return false;
+            }
+            table.set_max_size(new_size);
+            continue;
+        } else {
+            // Literal: with incremental indexing (01), without (0000) or never indexed (0001)
+            bool incremental = (first & 0xc0) == 0x40;
+            uint64_t name_index;
+            if (!hpack_decode_integer(pos, end, incremental ? 6 : 4, name_index)) {
+                return false;
+            }
+            if (name_index != 0) {
+                if (!table.lookup(name_index, header)) {
+                    return false;
+                }
+            } else if (!hpack_decode_string(pos, end, header.first)) {
+                return false;
+            }
+            if (!hpack_decode_string(pos, end, header.second)) {
+                return false;
+            }
+            if (incremental) {
+                table.insert(header.first, header.second);
+            }
+        }
+        
+        headers_seen = true;
+        list_size += header.first.length() + header.second.length() + 32;
+        if (list_size > max_list_size) {
+            return false;
+        }
+        headers.push_back(move(header));
+    }
+    return true;
+}
+
+// Encode a header block, indexing the fields likely to repeat across responses
+string hpack_encode(HpackTable& table, const vector<pair<string, string>>& headers) {
+    static const unordered_set<string> unindexed = {
+        "content-length", "etag", "last-modified", "date", "location", "set-cookie"
+    };
+    
+    string block;
+    for (const auto& [name, value] : headers) {
+        bool exact = false;
+        uint64_t index = table.find(name, value, exact);
+        if (exact) {
+            hpack_encode_integer(block, 0x80, 7, index);
+        } else if (unindexed.count(name)) {
+            hpack_encode_integer(block, 0x00, 4, index);
+            if (index == 0) {
+                hpack_encode_string(block, name);
+            }
+            hpack_encode_string(block, value);
+        } else {
+            hpack_encode_integer(block, 0x40, 6, index);
+            if (index == 0) {
+                hpack_encode_string(block, name);
+            }
+            hpack_encode_string(block, value);
+            table.insert(name, value);
+        }
+    }
+    return block;
+}
+
+// ---------------------------------------------------------------------------
+// HTTP/2 (RFC 9113)
+// ---------------------------------------------------------------------------
+
+const string H2_PREFACE = "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n";
+
+enum Http2FrameType : uint8_t {
+    H2_DATA = 0x0,
+    H2_HEADERS = 0x1,
+    H2_PRIORITY = 0x2,
+    H2_RST_STREAM = 0x3,
+    H2_SETTINGS = 0x4,
+    H2_PUSH_PROMISE = 0x5,
+    H2_PING = 0x6,
+    H2_GOAWAY = 0x7,
+    H2_WINDOW_UPDATE = 0x8,
+    H2_CONTINUATION = 0x9
+};
+
+enum Http2Flag : uint8_t {
+    H2_FLAG_END_STREAM = 0x1,
+    H2_FLAG_ACK = 0x1,
+    H2_FLAG_END_HEADERS = 0x4,
+    H2_FLAG_PADDED = 0x8,
+    H2_FLAG_PRIORITY = 0x20
+};
+
+enum Http2Setting : uint16_t {
+    H2_SETTINGS_HEADER_TABLE_SIZE = 0x1,
+    H2_SETTINGS_ENABLE_PUSH = 0x2,
+    H2_SETTINGS_MAX_CONCURRENT_STREAMS = 0x3,
+    H2_SETTINGS_INITIAL_WINDOW_SIZE = 0x4,
+    H2_SETTINGS_MAX_FRAME_SIZE = 0x5,
+    H2_SETTINGS_MAX_HEADER_LIST_SIZE = 0x6
+};
+
+enum Http2Error : uint32_t {
+    H2_NO_ERROR = 0x0,
+    H2_PROTOCOL_ERROR = 0x1,
+    H2_INTERNAL_ERROR = 0x2,
+    H2_FLOW_CONTROL_ERROR = 0x3,
+    H2_STREAM_CLOSED = 0x5,
+    H2_FRAME_SIZE_ERROR = 0x6,
+    H2_REFUSED_STREAM = 0x7,
+    H2_CANCEL = 0x8,
+    H2_COMPRESSION_ERROR = 0x9,
+    H2_ENHANCE_YOUR_CALM = 0xb
+};
+
+constexpr int64_t H2_MAX_WINDOW = 0x7fffffff;
+constexpr uint32_t H2_DEFAULT_WINDOW = 65535;
+constexpr uint32_t H2_DEFAULT_FRAME_SIZE = 16384;
+constexpr int H2_DEFAULT_WEIGHT = 16;
+
+// Per-stream state. The request body half is shared with the worker thread
+// running process_request(); the response half belongs to the I/O thread.
+struct Http2Stream {
+    uint32_t id = 0;
+    string method;
+
+    // Request body and streamed-response backpressure, guarded by body_mutex
+    mutex body_mutex;
+    condition_variable body_ready;
+    condition_variable send_ready;
+    string body_buffer;
+    size_t body_received = 0;
+    bool body_ended = false;
+    bool reset = false;
+    bool too_large = false;
+    size_t send_buffered = 0;  // Streamed response bytes posted but not yet sent
+    MemoryReservation body_memory{MemoryCategory::RequestBody};  // Charge for body_buffer
+    int body_event = -1;  // eventfd signalled along with body_ready, created on demand
+
+    // Wake the body reader; called with body_mutex held
+    void notify_body() {
+        body_ready.notify_all();
+        if (body_event != -1) {
+            uint64_t one = 1;
+            (void)!write(body_event, &one, sizeof(one));
+        }
+    }
+
+    Http2Stream() = default;
+    ~Http2Stream() {
+        if (body_event != -1) {
+            close(body_event);
+        }
+    }
+    Http2Stream(const Http2Stream&) = delete;
+    Http2Stream& operator=(const Http2Stream&) = delete;
+
+    // Protocol state (I/O thread only)
+    bool remote_closed = false;
+    int64_t send_window = H2_DEFAULT_WINDOW;
+    int64_t recv_window = H2_DEFAULT_WINDOW;
+
+    // Response, once the worker has produced it
+    bool response_ready = false;
+    HttpResponse response;
+    size_t body_offset = 0;
+    size_t body_length = 0;    // Bytes known so far; grows while streaming
+    bool body_complete = true;  // False until a streamed body has ended
+    size_t stream_offset = 0;   // Where the streamed part of the body starts
+
+    // Priority: dependency, weight and weighted-fair-queueing virtual time
+    uint32_t depends_on = 0;
+    int weight = H2_DEFAULT_WEIGHT;
+    uint64_t virtual_time = 0;
+};
+
+// Work handed back from stream workers to the connection's I/O thread
+struct Http2Outbox {
+    mutex lock;
+    vector<pair<uint32_t, HttpResponse>> responses;
+    vector<pair<uint32_t, size_t>> consumed;  // Body bytes read, to be credited back
+    vector<pair<uint32_t, string>> data;      // Streamed response body bytes
+    vector<pair<uint32_t, bool>> ended;       // Streamed bodies finished, and whether cleanly
+    vector<pair<uint32_t, size_t>> exhausted; // Streams out of memory budget, with body bytes read
+    int wake_pipe[2] = {-1, -1};
+    atomic<int> workers{0};  // Stream worker threads still running, reset streams included
+
+    Http2Outbox() {
+        if (pipe2(wake_pipe, O_NONBLOCK | O_CLOEXEC) == -1) {
+            wake_pipe[0] = wake_pipe[1] = -1;
+        }
+    }
+
+    ~Http2Outbox() {
+        if (wake_pipe[0] != -1) {
+            close(wake_pipe[0]);
+            close(wake_pipe[1]);
+        }
+    }
+
+    void wake() {
+        char byte = 1;
+        if (write(wake_pipe[1], &byte, 1) == -1) {
+            // Pipe already full means a wakeup is pending anyway
+        }
+    }
+
+    void post_response(uint32_t stream_id, HttpResponse response) {
+        {
+            lock_guard<mutex> guard(lock);
+            responses.emplace_back(stream_id, move(response));
+        }
+        wake();
+    }
+
+    void post_consumed(uint32_t stream_id, size_t bytes) {
+        {
+            lock_guard<mutex> guard(lock);
+            consumed.emplace_back(stream_id, bytes);
+        }
+        wake();
+    }
+
+    void post_exhausted(uint32_t stream_id, size_t bytes) {
+        {
+            lock_guard<mutex> guard(lock);
+            exhausted.emplace_back(stream_id, bytes);
+        }
+        wake();
+    }
+
+    void post_data(uint32_t stream_id, string bytes) {
+        {
+            lock_guard<mutex> guard(lock);
+            data.emplace_back(stream_id, move(bytes));
+        }
+        wake();
+    }
+
+    void post_end(uint32_t stream_id, bool clean) {
+        {
+            lock_guard<mutex> guard(lock);
+            ended.emplace_back(stream_id, clean);
+        }
+        wake();
+    }
+};
+
+// Forward a streamed response body from a stream worker to the I/O thread,
+// holding at most H2_STREAM_SEND_BUFFER unsent bytes so a slow client
+// throttles the producer
+void pump_response_stream(Http2Stream& stream, Http2Outbox& outbox, ResponseStream& source) {
+    char buffer[BODY_BUFFER_SIZE];
+    while (true) {
+        ssize_t bytes_read = source.read(buffer, sizeof(buffer));
+        if (bytes_read <= 0) {
+            outbox.post_end(stream.id, bytes_read == 0);
+            return;
+        }
+        {
+            unique_lock<mutex> lock(stream.body_mutex);
+            stream.send_ready.wait(lock, [&] {
+                return stream.send_buffered < H2_STREAM_SEND_BUFFER || stream.reset;
+            });
+            if (stream.reset) {
+                return;  // Client went away; dropping the source closes the producer
+            }
+            stream.send_buffered += bytes_read;
+        }
+        outbox.post_data(stream.id, string(buffer, bytes_read));
+    }
+}
+
+// Request body fed by DATA frames. Every byte the handler consumes is
+// credited back to the peer with WINDOW_UPDATE, so buffering per stream
+// never exceeds the window we advertised.
+class Http2BodyReader : public RequestBody {
+public:
+    Http2BodyReader(shared_ptr<Http2Stream> stream, shared_ptr<Http2Outbox> outbox)
+        : stream_(move(stream)), outbox_(move(outbox)) {}
+
+    ssize_t read(char* out, size_t length) override {
+        ssize_t result = read_some(out, length, REQUEST_TIMEOUT_SECONDS * 1000);
+        if (result == WOULD_BLOCK) {
+            failed_ = true;
+            return -1;
+        }
+        return result;
+    }
+
+    ssize_t read_some(char* out, size_t length, int timeout_ms) override {
+        if (failed_) {
+            return -1;
+        }
+        unique_lock<mutex> lock(stream_->body_mutex);
+        if (stream_->body_event != -1) {
+            uint64_t count;
+            (void)!::read(stream_->body_event, &count, sizeof(count));  // Rearm before checking
+        }
+        bool ready = stream_->body_ready.wait_for(lock, chrono::milliseconds(timeout_ms), [&] {
+            return !stream_->body_buffer.empty() || stream_->body_ended || stream_->reset;
+        });
+        if (!ready) {
+            return WOULD_BLOCK;
+        }
+        if (stream_->reset) {
+            too_large_ = stream_->too_large;
+            failed_ = true;
+            return -1;
+        }
+        if (stream_->body_buffer.empty()) {
+            finished_ = true;
+            return 0;
+        }
+        
+        size_t available = min(length, stream_->body_buffer.size());
+        memcpy(out, stream_->body_buffer.data(), available);
+        stream_->body_buffer.erase(0, available);
+        stream_->body_memory.resize(stream_->body_buffer.size());
+        lock.unlock();
+        
+        // Flow-control credit is held back while the budget is exhausted, so
+        // the client pauses instead of us buffering more. If no budget frees
+        // up in time the stream is reset rather than credited.
+        if (!memory_accountant.wait_headroom(available, MEMORY_WAIT_MS)) {
+            failed_ = true;
+            outbox_->post_exhausted(stream_->id, available);
+            return -1;
+        }
+        total_ += available;
+        outbox_->post_consumed(stream_->id, available);
+        return static_cast<ssize_t>(available);
+    }
+
+    int wait_fd() override {
+        lock_guard<mutex> lock(stream_->body_mutex);
+        if (stream_->body_event == -1) {
+            stream_->body_event = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        }
+        return stream_->body_event;
+    }
+
+    bool finished() const override { return finished_; }
+    bool failed() const override { return failed_; }
+    bool too_large() const override { return too_large_; }
+    size_t total() const override { return total_; }
+
+private:
+    shared_ptr<Http2Stream> stream_;
+    shared_ptr<Http2Outbox> outbox_;
+    size_t total_ = 0;
+    bool finished_ = false;
+    bool failed_ = false;
+    bool too_large_ = false;
+};
+
+// Decode base64url without padding, as used by the HTTP2-Settings header
+bool base64url_decode(const string& input, string& output) {
+    int buffer = 0;
+    int bits = 0;
+    for (char c : input) {
+        int value;
+        if (c >= 'A' && c <= 'Z') value = c - 'A';
+        else if (c >= 'a' && c <= 'z') value = c - 'a' + 26;
+        else if (c >= '0' && c <= '9') value = c - '0' + 52;
+        else if (c == '-' || c == '+') value = 62;
+        else if (c == '_' || c == '/') value = 63;
+        else if (c == '=') break;
+        else return false;
+        
+        buffer = (buffer << 6) | value;
+        bits += 6;
+        if (bits >= 8) {
+            bits -= 8;
+            output += static_cast<char>((buffer >> bits) & 0xff);
+        }
+    }
+    return true;
+}
+
+// One HTTP/2 connection. A single I/O thread owns the socket and all protocol
+// state; each stream's request runs through process_request() on its own
+// worker thread and the response is handed back through the outbox, so a slow
+// PHP script on one stream never blocks the CSS and JS on the others.
+class Http2Session {
+public:
+    Http2Session(Connection& conn, const string& client_ip, string initial_input)
+        : conn_(conn), client_ip_(client_ip), input_(move(initial_input)),
+          outbox_(make_shared<Http2Outbox>()) {}
+
+    // Serve the connection until it closes. upgrade_request is the HTTP/1.1
+    // request that asked for h2c; it becomes stream 1.
+    void run(const HttpRequest* upgrade_request);
+
+private:
+    bool process_input();
+    bool handle_frame(uint8_t type, uint8_t flags, uint32_t stream_id, const string& payload);
+    bool handle_headers(uint8_t flags, uint32_t stream_id, const string& payload);
+    bool handle_data(uint8_t flags, uint32_t stream_id, const string& payload);
+    bool handle_settings(uint8_t flags, const string& payload, bool from_upgrade = false);
+    bool handle_window_update(uint32_t stream_id, const string& payload);
+    bool finish_header_block();
+    void set_priority(Http2Stream& stream, uint32_t depends_on, int weight, bool exclusive);
+    void start_stream(shared_ptr<Http2Stream> stream, const vector<pair<string, string>>& headers);
+    void process_outbox();
+    bool send_pending();
+    bool send_response_headers(Http2Stream& stream);
+    Http2Stream* next_stream_to_send();
+    void close_stream(uint32_t stream_id);
+
+    void queue_frame(uint8_t type, uint8_t flags, uint32_t stream_id, string_view payload);
+    void queue_rst_stream(uint32_t stream_id, Http2Error error);
+    void queue_window_update(uint32_t stream_id, uint32_t increment);
+    bool connection_error(Http2Error error);
+    bool flush() {
+        bool ok = conn_.send_all(output_.data(), output_.size());
+        output_.clear();
+        return ok;
+    }
+
+    Connection& conn_;
+    string client_ip_;
+    string input_;
+    string output_;
+    shared_ptr<Http2Outbox> outbox_;
+    unordered_map<uint32_t, shared_ptr<Http2Stream>> streams_;
+
+    HpackTable decoder_table_;
+    HpackTable encoder_table_;
+    size_t pending_table_size_update_ = SIZE_MAX;
+
+    bool preface_received_ = false;
+    bool settings_received_ = false;
+    bool goaway_ = false;
+    uint32_t last_stream_id_ = 0;
+
+    // Header block being reassembled from HEADERS + CONTINUATION
+    uint32_t continuation_stream_ = 0;
+    uint8_t continuation_flags_ = 0;
+    bool continuation_is_trailer_ = false;
+    string header_block_;
+
+    // Peer settings
+    uint32_t peer_max_frame_size_ = H2_DEFAULT_FRAME_SIZE;
+    int64_t peer_initial_window_ = H2_DEFAULT_WINDOW;
+
+    // Connection-level flow control
+    int64_t send_window_ = H2_DEFAULT_WINDOW;
+    int64_t recv_window_ = H2_DEFAULT_WINDOW;
+
+    uint64_t scheduler_clock_ = 0;
+};
+
+void Http2Session::queue_frame(uint8_t type, uint8_t flags, uint32_t stream_id, string_view payload) {
+    char header[9];
+    header[0] = static_cast<char>((payload.length() >> 16) & 0xff);
+    header[1] = static_cast<char>((payload.length() >> 8) & 0xff);
+    header[2] = static_cast<char>(payload.length() & 0xff);
+    header[3] = static_cast<char>(type);
+    header[4] = static_cast<char>(flags);
+    header[5] = static_cast<char>((stream_id >> 24) & 0x7f);
+    header[6] = static_cast<char>((stream_id >> 16) & 0xff);
+    header[7] = static_cast<char>((stream_id >> 8) & 0xff);
+    header[8] = static_cast<char>(stream_id & 0xff);
+    output_.append(header, sizeof(header));
+    output_.append(payload);
+}
+
+static void put_uint32(string& out, uint32_t value) {
+    out += static_cast<char>((value >> 24) & 0xff);
+    out += static_cast<char>((value >> 16) & 0xff);
+    out += static_cast<char>((value >> 8) & 0xff);
+    out += static_cast<char>(value & 0xff);
+}
+
+static uint32_t get_uint32(const string& data, size_t offset) {
+    return (static_cast<uint32_t>(static_cast<uint8_t>(data[offset])) << 24) |
+           (static_cast<uint32_t>(static_cast<uint8_t>(data[offset + 1])) << 16) |
+           (static_cast<uint32_t>(static_cast<uint8_t>(data[offset + 2])) << 8) |
+           static_cast<uint32_t>(static_cast<uint8_t>(data[offset + 3]));
+}
+
+void Http2Session::queue_rst_stream(uint32_t stream_id, Http2Error error) {
+    string payload;
+    put_uint32(payload, error);
+    queue_frame(H2_RST_STREAM, 0, stream_id, payload);
+}
+
+void Http2Session::queue_window_update(uint32_t stream_id, uint32_t increment) {
+    string payload;
+    put_uint32(payload, increment & 0x7fffffff);
+    queue_frame(H2_WINDOW_UPDATE, 0, stream_id, payload);
+}
+
+bool Http2Session::connection_error(Http2Error error) {
+    string payload;
+    put_uint32(payload, last_stream_id_);
+    put_uint32(payload, error);
+    queue_frame(H2_GOAWAY, 0, 0, payload);
+    flush();
+    log_error("HTTP/2 connection error " + to_string(error) + " from " + client_ip_);
+    return false;
+}
+
+void Http2Session::run(const HttpRequest* upgrade_request) {
+    // Our SETTINGS must be the first frame we send
+    string settings;
+    auto add_setting = [&settings](uint16_t id, uint32_t value) {
+        settings += static_cast<char>(id >> 8);
+        settings += static_cast<char>(id & 0xff);
+        put_uint32(settings, value);
+    };
+    add_setting(H2_SETTINGS_MAX_CONCURRENT_STREAMS, MAX_H2_CONCURRENT_STREAMS);
+    add_setting(H2_SETTINGS_INITIAL_WINDOW_SIZE, H2_DEFAULT_WINDOW);
+    add_setting(H2_SETTINGS_MAX_HEADER_LIST_SIZE, MAX_REQUEST_SIZE);
+    queue_frame(H2_SETTINGS, 0, 0, settings);
+    
+    if (upgrade_request) {
+        // HTTP2-Settings carries the client's SETTINGS payload
+        string client_settings;
+        auto settings_header = upgrade_request->headers.find("http2-settings");
+        if (settings_header == upgrade_request->headers.end() ||
+            !base64url_decode(settings_header->second, client_settings) ||
+            !handle_settings(0, client_settings, true)) {
+            connection_error(H2_PROTOCOL_ERROR);
+            return;
+        }
+        
+        vector<pair<string, string>> headers = {
+            {":method", upgrade_request->method},
+            {":path", upgrade_request->path},
+            {":scheme", "http"}
+        };
+        static const unordered_set<string> hop_by_hop = {
+            "connection", "upgrade", "http2-settings", "keep-alive", "transfer-encoding"
+        };
+        for (const auto& header : upgrade_request->headers) {
+            if (!hop_by_hop.count(header.first)) {
+                headers.push_back(header);
+            }
+        }
+        
+        auto stream = make_shared<Http2Stream>();
+        stream->id = 1;
+        stream->remote_closed = true;
+        stream->body_ended = true;
+        stream->send_window = peer_initial_window_;
+        last_stream_id_ = 1;
+        streams_[1] = stream;
+        start_stream(stream, headers);
+    }
+    
+    if (!flush()) {
+        return;
+    }
+    
+    auto last_activity = chrono::steady_clock::now();
+    while (true) {
+        if (!send_pending()) {
+            break;
+        }
+        if (goaway_ && streams_.empty()) {
+            break;
+        }
+        
+        bool readable = false;
+#ifdef ENABLE_TLS
+        readable = conn_.ssl && SSL_pending(conn_.ssl) > 0;
+#endif
+        if (!readable) {
+            struct pollfd fds[2] = {{conn_.fd, POLLIN, 0}, {outbox_->wake_pipe[0], POLLIN, 0}};
+            int poll_result = poll(fds, 2, 1000);
+            if (poll_result == -1 && errno != EINTR) {
+                break;
+            }
+            if (fds[1].revents & POLLIN) {
+                char drain[64];
+                while (::read(outbox_->wake_pipe[0], drain, sizeof(drain)) > 0) {
+                    // Wakeups carry no data
+                }
+            }
+            readable = fds[0].revents & (POLLIN | POLLHUP | POLLERR);
+        }
+        
+        process_outbox();
+        
+        if (readable) {
+            char buffer[BODY_BUFFER_SIZE];
+            ssize_t bytes_received = conn_.recv_some(buffer, sizeof(buffer));
+            if (bytes_received <= 0) {
+                break;  // Peer closed the connection
+            }
+            input_.append(buffer, bytes_received);
+            last_activity = chrono::steady_clock::now();
+            if (!process_input()) {
+                break;
+            }
+        } else if (streams_.empty() &&
+                   chrono::steady_clock::now() - last_activity > chrono::seconds(H2_IDLE_TIMEOUT_SECONDS)) {
+            string payload;
+            put_uint32(payload, last_stream_id_);
+            put_uint32(payload, H2_NO_ERROR);
+            queue_frame(H2_GOAWAY, 0, 0, payload);
+            flush();
+            break;
+        }
+    }
+    
+    // Unblock any worker still waiting for body data
+    for (auto& [id, stream] : streams_) {
+        lock_guard<mutex> lock(stream->body_mutex);
+        stream->reset = true;
+        stream->notify_body();
+        stream->send_ready.notify_all();
+    }
+}
+
+bool Http2Session::process_input() {
+    size_t pos = 0;
+    
+    if (!preface_received_) {
+        if (input_.size() < H2_PREFACE.size()) {
+            return H2_PREFACE.compare(0, input_.size(), input_) == 0;
+        }
+        if (input_.compare(0, H2_PREFACE.size(), H2_PREFACE) != 0) {
+            return connection_error(H2_PROTOCOL_ERROR);
+        }
+        preface_received_ = true;
+        pos = H2_PREFACE.size();
+    }
+    
+    while (input_.size() - pos >= 9) {
+        const uint8_t* header = reinterpret_cast<const uint8_t*>(input_.data() + pos);
+        uint32_t length = (header[0] << 16) | (header[1] << 8) | header[2];
+        uint8_t type = header[3];
+        uint8_t flags = header[4];
+        uint32_t stream_id = get_uint32(input_, pos + 5) & 0x7fffffff;
+        
+        if (length > H2_DEFAULT_FRAME_SIZE) {
+            return connection_error(H2_FRAME_SIZE_ERROR);
+        }
+        if (input_.size() - pos - 9 < length) {
+            break;  // Wait for the rest of the frame
+        }
+        
+        string payload = input_.substr(pos + 9, length);
+        pos += 9 + length;
+        
+        // The client preface ends with a SETTINGS frame
+        if (!settings_received_ && type != H2_SETTINGS) {
+            return connection_error(H2_PROTOCOL_ERROR);
+        }
+        if (!handle_frame(type, flags, stream_id, payload)) {
+            return false;
+        }
+    }
+    
+    input_.erase(0, pos);
+    return true;
+}
+
+bool Http2Session::handle_frame(uint8_t type, uint8_t flags, uint32_t stream_id, const string& payload) {
+    // Nothing may interleave with a header block
+    if (continuation_stream_ != 0 && (type != H2_CONTINUATION || stream_id != continuation_stream_)) {
+        return connection_error(H2_PROTOCOL_ERROR);
+    }
+    
+    switch (type) {
+        case H2_DATA:
+            return handle_data(flags, stream_id, payload);
             
-            // Trim whitespace
-            header_name.erase(0, header_name.find_first_not_of(" \t"));
-            header_name.erase(header_name.find_last_not_of(" \t") + 1);
-            header_value.erase(0, header_value.find_first_not_of(" \t"));
-            header_value.erase(header_value.find_last_not_of(" \t") + 1);
+        case H2_HEADERS:
+            return handle_headers(flags, stream_id, payload);
             
-            // Convert header name to lowercase for case-insensitive comparison
-            transform(header_name.begin(), header_name.end(), header_name.begin(), ::tolower);
+        case H2_CONTINUATION:
+            if (continuation_stream_ == 0) {
+                return connection_error(H2_PROTOCOL_ERROR);
+            }
+            header_block_ += payload;
+            if (header_block_.size() > MAX_REQUEST_SIZE) {
+                return connection_error(H2_ENHANCE_YOUR_CALM);
+            }
+            if (flags & H2_FLAG_END_HEADERS) {
+                return finish_header_block();
+            }
+            return true;
             
-            request.headers[header_name] = header_value;
+        case H2_PRIORITY: {
+            if (stream_id == 0) {
+                return connection_error(H2_PROTOCOL_ERROR);
+            }
+            if (payload.size() != 5) {
+                queue_rst_stream(stream_id, H2_FRAME_SIZE_ERROR);
+                return true;
+            }
+            uint32_t dependency = get_uint32(payload, 0);
+            auto it = streams_.find(stream_id);
+            if (it != streams_.end()) {
+                set_priority(*it->second, dependency & 0x7fffffff,
+                             static_cast<uint8_t>(payload[4]) + 1, dependency & 0x80000000);
+            }
+            return true;
+        }
+        
+        case H2_RST_STREAM: {
+            if (stream_id == 0 || payload.size() != 4) {
+                return connection_error(stream_id == 0 ? H2_PROTOCOL_ERROR : H2_FRAME_SIZE_ERROR);
+            }
+            if (stream_id > last_stream_id_) {
+                return connection_error(H2_PROTOCOL_ERROR);  // Idle stream
+            }
+            close_stream(stream_id);
+            return true;
+        }
+        
+        case H2_SETTINGS:
+            if (stream_id != 0) {
+                return connection_error(H2_PROTOCOL_ERROR);
+            }
+            return handle_settings(flags, payload);
             
-            if (header_name == "content-length") {
-                try {
-                    content_length = stoull(header_value);
-                    if (content_length > MAX_BODY_SIZE) {
-                        return request;  // Body too large
+        case H2_PING:
+            if (stream_id != 0) {
+                return connection_error(H2_PROTOCOL_ERROR);
+            }
+            if (payload.size() != 8) {
+                return connection_error(H2_FRAME_SIZE_ERROR);
+            }
+            if (!(flags & H2_FLAG_ACK)) {
+                queue_frame(H2_PING, H2_FLAG_ACK, 0, payload);
+            }
+            return true;
+            
+        case H2_GOAWAY:
+            // Finish what is in flight, accept nothing new
+            goaway_ = true;
+            return true;
+            
+        case H2_WINDOW_UPDATE:
+            return handle_window_update(stream_id, payload);
+            
+        case H2_PUSH_PROMISE:
+            return connection_error(H2_PROTOCOL_ERROR);  // Clients can't push
+            
+        default:
+            return true;  // Unknown frame types are ignored
+    }
+}
+
+bool Http2Session::handle_settings(uint8_t flags, const string& payload, bool from_upgrade) {
+    if (flags & H2_FLAG_ACK) {
+        return payload.empty() ? true : connection_error(H2_FRAME_SIZE_ERROR);
+    }
+    if (payload.size() % 6 != 0) {
+        return connection_error(H2_FRAME_SIZE_ERROR);
+    }
+    
+    for (size_t offset = 0; offset < payload.size(); offset += 6) {
+        uint16_t id = (static_cast<uint8_t>(payload[offset]) << 8) | static_cast<uint8_t>(payload[offset + 1]);
+        uint32_t value = get_uint32(payload, offset + 2);
+        
+        switch (id) {
+            case H2_SETTINGS_HEADER_TABLE_SIZE:
+                // Our encoder never grows past the default; shrinking needs an update at the next block
+                if (min<size_t>(value, 4096) != encoder_table_.max_size()) {
+                    encoder_table_.set_max_size(min<size_t>(value, 4096));
+                    pending_table_size_update_ = encoder_table_.max_size();
+                }
+                break;
+            case H2_SETTINGS_ENABLE_PUSH:
+                if (value > 1) {
+                    return connection_error(H2_PROTOCOL_ERROR);
+                }
+                break;
+            case H2_SETTINGS_INITIAL_WINDOW_SIZE: {
+                if (value > H2_MAX_WINDOW) {
+                    return connection_error(H2_FLOW_CONTROL_ERROR);
+                }
+                // The change applies retroactively to every open stream
+                int64_t delta = static_cast<int64_t>(value) - peer_initial_window_;
+                peer_initial_window_ = value;
+                for (auto& [id, stream] : streams_) {
+                    stream->send_window += delta;
+                    if (stream->send_window > H2_MAX_WINDOW) {
+                        return connection_error(H2_FLOW_CONTROL_ERROR);
                     }
-                } catch (...) {
-                    return request;  // Invalid content-length
                 }
+                break;
             }
+            case H2_SETTINGS_MAX_FRAME_SIZE:
+                if (value < H2_DEFAULT_FRAME_SIZE || value > 0xffffff) {
+                    return connection_error(H2_PROTOCOL_ERROR);
+                }
+                peer_max_frame_size_ = value;
+                break;
+            default:
+                break;  // Unknown or advisory settings
         }
     }
     
-    // Read body if present
-    if (content_length > 0) {
-        request.body.resize(content_length);
-        stream.read(&request.body[0], content_length);
-        if (stream.gcount() != static_cast<streamsize>(content_length)) {
-            return request;  // Incomplete body
+    // Settings from an h2c upgrade are acknowledged by the 101 response itself
+    if (!from_upgrade) {
+        settings_received_ = true;
+        queue_frame(H2_SETTINGS, H2_FLAG_ACK, 0, "");
+    }
+    return true;
+}
+
+bool Http2Session::handle_window_update(uint32_t stream_id, const string& payload) {
+    if (payload.size() != 4) {
+        return connection_error(H2_FRAME_SIZE_ERROR);
+    }
+    uint32_t increment = get_uint32(payload, 0) & 0x7fffffff;
+    
+    if (stream_id == 0) {
+        if (increment == 0) {
+            return connection_error(H2_PROTOCOL_ERROR);
+        }
+        send_window_ += increment;
+        if (send_window_ > H2_MAX_WINDOW) {
+            return connection_error(H2_FLOW_CONTROL_ERROR);
         }
+        return true;
     }
     
-    request.valid = true;
-    return request;
+    auto it = streams_.find(stream_id);
+    if (it == streams_.end()) {
+        return stream_id <= last_stream_id_ ? true : connection_error(H2_PROTOCOL_ERROR);
+    }
+    if (increment == 0) {
+        queue_rst_stream(stream_id, H2_PROTOCOL_ERROR);
+        close_stream(stream_id);
+        return true;
+    }
+    it->second->send_window += increment;
+    if (it->second->send_window > H2_MAX_WINDOW) {
+        queue_rst_stream(stream_id, H2_FLOW_CONTROL_ERROR);
+        close_stream(stream_id);
+    }
+    return true;
 }
 
-// Execute PHP script safely
-bool execute_php(const string& script_path, const HttpRequest& request, string& output) {
-    // Validate PHP file extension and location
-    if (!script_path.ends_with(".php")) {
+// Strip padding from a DATA or HEADERS payload
+static bool strip_padding(uint8_t flags, string& payload) {
+    if (!(flags & H2_FLAG_PADDED)) {
+        return true;
+    }
+    if (payload.empty()) {
+        return false;
+    }
+    size_t padding = static_cast<uint8_t>(payload[0]);
+    if (padding >= payload.size()) {
         return false;
     }
+    payload = payload.substr(1, payload.size() - 1 - padding);
+    return true;
+}
+
+bool Http2Session::handle_data(uint8_t flags, uint32_t stream_id, const string& frame_payload) {
+    if (stream_id == 0) {
+        return connection_error(H2_PROTOCOL_ERROR);
+    }
     
-    // Ensure script is within web root
-    try {
-        fs::path canonical_root = fs::canonical(WEB_ROOT);
-        fs::path canonical_script = fs::canonical(script_path);
-        
-        if (canonical_script.string().substr(0, canonical_root.string().length()) != canonical_root.string()) {
-            return false;
+    // The whole frame counts against flow control, padding included
+    size_t frame_length = frame_payload.size();
+    recv_window_ -= frame_length;
+    if (recv_window_ < 0) {
+        return connection_error(H2_FLOW_CONTROL_ERROR);
+    }
+    
+    auto it = streams_.find(stream_id);
+    if (it == streams_.end() || it->second->remote_closed) {
+        if (stream_id > last_stream_id_) {
+            return connection_error(H2_PROTOCOL_ERROR);
         }
-    } catch (...) {
-        return false;
+        // Data for a stream we've finished with still uses connection window
+        if (frame_length > 0) {
+            queue_window_update(0, frame_length);
+            recv_window_ += frame_length;
+        }
+        queue_rst_stream(stream_id, H2_STREAM_CLOSED);
+        return true;
     }
     
-    // Create pipes for communication
-    int pipe_fd[2];
-    if (pipe(pipe_fd) == -1) {
-        log_error("Failed to create pipe: " + string(strerror(errno)));
-        return false;
+    Http2Stream& stream = *it->second;
+    stream.recv_window -= frame_length;
+    if (stream.recv_window < 0) {
+        queue_rst_stream(stream_id, H2_FLOW_CONTROL_ERROR);
+        close_stream(stream_id);
+        return true;
     }
     
-    pid_t pid = fork();
-    if (pid == -1) {
-        log_error("Failed to fork: " + string(strerror(errno)));
-        close(pipe_fd[0]);
-        close(pipe_fd[1]);
-        return false;
+    string payload = frame_payload;
+    if (!strip_padding(flags, payload)) {
+        return connection_error(H2_PROTOCOL_ERROR);
     }
     
-    if (pid == 0) {
-        // Child process
-        close(pipe_fd[0]);  // Close read end
-        
-        // Redirect stdout to pipe
-        if (dup2(pipe_fd[1], STDOUT_FILENO) == -1) {
-            exit(1);
+    // Padding and data nobody will read are credited back right away
+    size_t credited = frame_length - payload.size();
+    {
+        lock_guard<mutex> lock(stream.body_mutex);
+        if (stream.reset) {
+            credited = frame_length;
+        } else {
+            stream.body_received += payload.size();
+            if (stream.body_received > MAX_BODY_SIZE) {
+                stream.too_large = true;
+                stream.reset = true;
+                stream.body_buffer.clear();
+                credited = frame_length;
+            } else {
+                stream.body_buffer += payload;
+            }
+            stream.body_memory.resize(stream.body_buffer.size());
         }
-        close(pipe_fd[1]);
-        
-        // Set environment variables
-        setenv("REQUEST_METHOD", request.method.c_str(), 1);
-        setenv("SCRIPT_FILENAME", script_path.c_str(), 1);
-        setenv("REQUEST_URI", request.path.c_str(), 1);
-        
-        if (!request.body.empty()) {
-            setenv("CONTENT_LENGTH", to_string(request.body.length()).c_str(), 1);
+        if (flags & H2_FLAG_END_STREAM) {
+            stream.body_ended = true;
+        }
+        stream.notify_body();
+    }
+    
+    if (credited > 0) {
+        queue_window_update(0, credited);
+        recv_window_ += credited;
+        if (!(flags & H2_FLAG_END_STREAM)) {
+            queue_window_update(stream_id, credited);
+            stream.recv_window += credited;
+        }
+    }
+    
+    if (flags & H2_FLAG_END_STREAM) {
+        stream.remote_closed = true;
+        if (stream.response_ready && stream.body_offset >= stream.body_length) {
+            close_stream(stream_id);
+        }
+    }
+    return true;
+}
+
+bool Http2Session::handle_headers(uint8_t flags, uint32_t stream_id, const string& frame_payload) {
+    if (stream_id == 0) {
+        return connection_error(H2_PROTOCOL_ERROR);
+    }
+    
+    string payload = frame_payload;
+    if (!strip_padding(flags, payload)) {
+        return connection_error(H2_PROTOCOL_ERROR);
+    }
+    
+    uint32_t depends_on = 0;
+    int weight = H2_DEFAULT_WEIGHT;
+    bool exclusive = false;
+    if (flags & H2_FLAG_PRIORITY) {
+        if (payload.size() < 5) {
+            return connection_error(H2_FRAME_SIZE_ERROR);
+        }
+        uint32_t dependency = get_uint32(payload, 0);
+        depends_on = dependency & 0x7fffffff;
+        exclusive = dependency & 0x80000000;
+        weight = static_cast<uint8_t>(payload[4]) + 1;
+        payload.erase(0, 5);
+        if (depends_on == stream_id) {
+            return connection_error(H2_PROTOCOL_ERROR);
+        }
+    }
+    
+    auto it = streams_.find(stream_id);
+    continuation_is_trailer_ = it != streams_.end();
+    if (continuation_is_trailer_) {
+        // Trailers: must end the stream
+        if (it->second->remote_closed || !(flags & H2_FLAG_END_STREAM)) {
+            return connection_error(H2_PROTOCOL_ERROR);
         }
-        
-        // Execute PHP
-        execl("/usr/bin/php", "php", "-f", script_path.c_str(), nullptr);
-        exit(1);  // execl failed
     } else {
-        // Parent process
-        close(pipe_fd[1]);  // Close write end
-        
-        // Read output with timeout
-        fd_set read_fds;
-        struct timeval timeout;
-        timeout.tv_sec = 5;  // 5 second timeout
-        timeout.tv_usec = 0;
-        
-        FD_ZERO(&read_fds);
-        FD_SET(pipe_fd[0], &read_fds);
-        
-        int select_result = select(pipe_fd[0] + 1, &read_fds, nullptr, nullptr, &timeout);
+        if (stream_id % 2 == 0 || stream_id <= last_stream_id_) {
+            return connection_error(stream_id % 2 == 0 ? H2_PROTOCOL_ERROR : H2_STREAM_CLOSED);
+        }
+        last_stream_id_ = stream_id;
         
-        if (select_result > 0 && FD_ISSET(pipe_fd[0], &read_fds)) {
-            char buffer[4096];
-            ssize_t bytes_read;
-            
-            while ((bytes_read = read(pipe_fd[0], buffer, sizeof(buffer) - 1)) > 0) {
-                buffer[bytes_read] = '\0';
-                output += buffer;
-                
-                // Limit output size
-                if (output.length() > MAX_FILE_SIZE) {
-                    output.resize(MAX_FILE_SIZE);
-                    break;
-                }
+        auto stream = make_shared<Http2Stream>();
+        stream->id = stream_id;
+        stream->send_window = peer_initial_window_;
+        stream->virtual_time = scheduler_clock_;
+        streams_[stream_id] = stream;
+        if (flags & H2_FLAG_PRIORITY) {
+            set_priority(*stream, depends_on, weight, exclusive);
+        }
+    }
+    
+    continuation_stream_ = stream_id;
+    continuation_flags_ = flags;
+    header_block_ = payload;
+    if (header_block_.size() > MAX_REQUEST_SIZE) {
+        return connection_error(H2_ENHANCE_YOUR_CALM);
+    }
+    if (flags & H2_FLAG_END_HEADERS) {
+        return finish_header_block();
+    }
+    return true;
+}
+
+bool Http2Session::finish_header_block() {
+    uint32_t stream_id = continuation_stream_;
+    uint8_t flags = continuation_flags_;
+    continuation_stream_ = 0;
+    
+    // Always decode, even for refused streams, to keep the table in sync
+    vector<pair<string, string>> headers;
+    if (!hpack_decode(decoder_table_, 4096, header_block_, headers, MAX_REQUEST_SIZE)) {
+        return connection_error(H2_COMPRESSION_ERROR);
+    }
+    header_block_.clear();
+    
+    auto it = streams_.find(stream_id);
+    if (it == streams_.end()) {
+        return true;  // Reset while the block was arriving
+    }
+    shared_ptr<Http2Stream> stream = it->second;
+    
+    if (!continuation_is_trailer_) {
+        // Initial header block of a new stream. Workers of reset streams
+        // may still be running, so they are counted apart from open streams;
+        // the server-wide thread ceiling is left to new connections.
+        if (goaway_ || streams_.size() > static_cast<size_t>(MAX_H2_CONCURRENT_STREAMS) ||
+            outbox_->workers >= MAX_H2_CONCURRENT_STREAMS || active_threads >= MAX_CONCURRENT_THREADS) {
+            queue_rst_stream(stream_id, H2_REFUSED_STREAM);
+            close_stream(stream_id);
+            return true;
+        }
+        if (flags & H2_FLAG_END_STREAM) {
+            stream->remote_closed = true;
+            stream->body_ended = true;
+        }
+        start_stream(stream, headers);
+        return true;
+    }
+    
+    // Trailers end the body; their fields are dropped
+    lock_guard<mutex> lock(stream->body_mutex);
+    stream->body_ended = true;
+    stream->remote_closed = true;
+    stream->notify_body();
+    return true;
+}
+
+// Map decoded header fields onto an HttpRequest and hand it to a worker
+void Http2Session::start_stream(shared_ptr<Http2Stream> stream, const vector<pair<string, string>>& headers) {
+    HttpRequest request;
+    request.version = "HTTP/2";
+    string scheme;
+    bool pseudo_done = false;
+    bool malformed = false;
+    
+    for (const auto& [name, value] : headers) {
+        if (name.starts_with(":")) {
+            if (pseudo_done) {
+                malformed = true;
+            } else if (name == ":method") {
+                request.method = value;
+            } else if (name == ":path") {
+                request.path = value;
+            } else if (name == ":scheme") {
+                scheme = value;
+            } else if (name == ":authority") {
+                request.headers["host"] = value;
+            } else {
+                malformed = true;
             }
+            continue;
         }
+        pseudo_done = true;
         
-        close(pipe_fd[0]);
-        
-        // Wait for child process
-        int status;
-        waitpid(pid, &status, 0);
-        
-        return WIFEXITED(status) && WEXITSTATUS(status) == 0;
+        // Field names must be lowercase and connection-specific fields are forbidden
+        if (any_of(name.begin(), name.end(), [](char c) { return c >= 'A' && c <= 'Z'; }) ||
+            name == "connection" || name == "transfer-encoding" || name == "keep-alive" ||
+            name == "upgrade" || name == "proxy-connection") {
+            malformed = true;
+        }
+        if (name == "cookie" && request.headers.count("cookie")) {
+            request.headers["cookie"] += "; " + value;  // Crumbs are split across fields
+        } else {
+            request.headers[name] = value;
+        }
     }
-}
-
-// Handle directory requests
-HttpResponse handle_directory(const string& dir_path, const string& url_path) {
-    HttpResponse response;
     
-    // Check for index files
-    vector<string> index_files = {"index.html", "index.htm", "index.php"};
+    stream->method = request.method;
+    if (malformed || request.method.empty() || request.path.empty() || scheme.empty()) {
+        queue_rst_stream(stream->id, H2_PROTOCOL_ERROR);
+        close_stream(stream->id);
+        return;
+    }
     
-    for (const string& index_file : index_files) {
-        string index_path = dir_path + "/" + index_file;
-        if (fs::exists(index_path) && fs::is_regular_file(index_path)) {
-            if (index_file == "index.php") {
-                HttpRequest dummy_request;
-                dummy_request.method = "GET";
-                dummy_request.path = url_path + index_file;
-                
-                string php_output;
-                if (execute_php(index_path, dummy_request, php_output)) {
-                    response.body = php_output;
-                    response.headers["Content-Type"] = "text/html";
-                    return response;
-                }
-            } else {
-                vector<uint8_t> content;
-                if (read_file_safe(index_path, content)) {
-                    response.binary_data = move(content);
-                    response.is_binary = true;
-                    response.headers["Content-Type"] = get_mime_type(index_path);
-                    return response;
-                }
+    request.valid = allowed_methods.count(request.method) > 0;
+    auto content_length = request.headers.find("content-length");
+    if (content_length != request.headers.end()) {
+        try {
+            request.content_length = stoull(content_length->second);
+            if (request.content_length > MAX_BODY_SIZE) {
+                request.valid = false;
+                request.error_status = 413;
             }
+        } catch (...) {
+            request.valid = false;
         }
+    } else if (!stream->remote_closed) {
+        request.chunked = true;  // DATA frames without a declared length
     }
     
-    // No index file found - return 403 Forbidden
-    response.status_code = 403;
-    response.body = "<html><body><h1>403 Forbidden</h1><p>Directory listing is not allowed.</p></body></html>";
-    response.headers["Content-Type"] = "text/html";
-    return response;
+    active_threads++;
+    outbox_->workers++;
+    thread([stream, outbox = outbox_, request = move(request), client_ip = client_ip_]() mutable {
+        RequestTraceScope trace;
+        trace.set_label(request.method, request.path);
+        try {
+            unique_ptr<Http2BodyReader> body;
+            if (request.valid && request.has_body()) {
+                body = make_unique<Http2BodyReader>(stream, outbox);
+                request.body = body.get();
+            }
+            
+            HttpResponse response = process_request(request, client_ip);
+            log_info("Served " + request.method + " " + request.path + " to " + client_ip +
+                     " over HTTP/2 (Status: " + to_string(response.status_code) + ")");
+            shared_ptr<ResponseStream> source = response.stream;
+            outbox->post_response(stream->id, move(response));
+            if (source) {
+                pump_response_stream(*stream, *outbox, *source);
+            }
+        } catch (const exception& e) {
+            log_error("Exception handling HTTP/2 stream from " + client_ip + ": " + e.what());
+            HttpResponse response;
+            response.status_code = 500;
+            outbox->post_response(stream->id, move(response));
+        }
+        outbox->workers--;
+        active_threads--;
+    }).detach();
 }
 
-// Process HTTP request
-HttpResponse process_request(const HttpRequest& request, const string& client_ip) {
-    log_info("Processing request from IP: " + client_ip);
-
-    HttpResponse response;
+void Http2Session::set_priority(Http2Stream& stream, uint32_t depends_on, int weight, bool exclusive) {
+    if (depends_on == stream.id) {
+        queue_rst_stream(stream.id, H2_PROTOCOL_ERROR);
+        return;
+    }
+    if (depends_on != 0 && !streams_.count(depends_on)) {
+        depends_on = 0;  // Dependencies on closed or idle streams fall back to the root
+    }
     
-    if (!request.valid) {
-        response.status_code = 400;
-        response.body = "<html><body><h1>400 Bad Request</h1></body></html>";
-        response.headers["Content-Type"] = "text/html";
-        return response;
+    // Moving a stream under its own descendant first lifts that descendant up
+    for (uint32_t ancestor = depends_on, depth = 0; ancestor != 0 && depth < streams_.size(); ++depth) {
+        auto it = streams_.find(ancestor);
+        if (it == streams_.end()) {
+            break;
+        }
+        if (it->second->depends_on == stream.id) {
+            it->second->depends_on = stream.depends_on;
+            break;
+        }
+        ancestor = it->second->depends_on;
     }
     
-    // Sanitize path
-    string safe_path = sanitize_path(request.path);
-    if (safe_path.empty()) {
-        response.status_code = 403;
-        response.body = "<html><body><h1>403 Forbidden</h1><p>Invalid path.</p></body></html>";
-        response.headers["Content-Type"] = "text/html";
-        return response;
+    if (exclusive) {
+        for (auto& [id, other] : streams_) {
+            if (other->depends_on == depends_on && id != stream.id) {
+                other->depends_on = stream.id;
+            }
+        }
+    }
+    stream.depends_on = depends_on;
+    stream.weight = weight;
+}
+
+void Http2Session::close_stream(uint32_t stream_id) {
+    auto it = streams_.find(stream_id);
+    if (it == streams_.end()) {
+        return;
     }
+    shared_ptr<Http2Stream> stream = it->second;
+    streams_.erase(it);
     
-    // Check for forbidden files
-    if (is_forbidden_file(safe_path)) {
-        response.status_code = 403;
-        response.body = "<html><body><h1>403 Forbidden</h1><p>Access denied.</p></body></html>";
-        response.headers["Content-Type"] = "text/html";
-        return response;
+    {
+        lock_guard<mutex> lock(stream->body_mutex);
+        stream->reset = true;
+        stream->body_buffer.clear();
+        stream->body_memory.resize(0);
+        stream->notify_body();
+        stream->send_ready.notify_all();
     }
     
-    // Check if file/directory exists
-    if (!fs::exists(safe_path)) {
-        response.status_code = 404;
-        response.body = "<html><body><h1>404 Not Found</h1><p>The requested resource was not found.</p></body></html>";
-        response.headers["Content-Type"] = "text/html";
-        return response;
+    // Children inherit the closed stream's place in the tree
+    for (auto& [id, other] : streams_) {
+        if (other->depends_on == stream_id) {
+            other->depends_on = stream->depends_on;
+        }
+    }
+}
+
+void Http2Session::process_outbox() {
+    vector<pair<uint32_t, HttpResponse>> responses;
+    vector<pair<uint32_t, size_t>> consumed;
+    vector<pair<uint32_t, string>> data;
+    vector<pair<uint32_t, bool>> ended;
+    vector<pair<uint32_t, size_t>> exhausted;
+    {
+        lock_guard<mutex> lock(outbox_->lock);
+        responses.swap(outbox_->responses);
+        consumed.swap(outbox_->consumed);
+        data.swap(outbox_->data);
+        ended.swap(outbox_->ended);
+        exhausted.swap(outbox_->exhausted);
     }
     
-    // Handle directory
-    if (fs::is_directory(safe_path)) {
-        return handle_directory(safe_path, request.path);
+    // Bodies refused for lack of memory budget: the stream gets no more
+    // window, only the connection is credited so other streams can go on
+    for (auto& [stream_id, bytes] : exhausted) {
+        queue_window_update(0, bytes);
+        recv_window_ += bytes;
+        if (streams_.count(stream_id)) {
+            queue_rst_stream(stream_id, H2_ENHANCE_YOUR_CALM);
+            close_stream(stream_id);
+        }
     }
     
-    // Handle PHP files
-    if (safe_path.ends_with(".php")) {
-        string php_output;
-        if (execute_php(safe_path, request, php_output)) {
-            response.body = php_output;
-            response.headers["Content-Type"] = "text/html";
-        } else {
-            response.status_code = 500;
-            response.body = "<html><body><h1>500 Internal Server Error</h1><p>PHP execution failed.</p></body></html>";
-            response.headers["Content-Type"] = "text/html";
+    for (auto& [stream_id, bytes] : consumed) {
+        queue_window_update(0, bytes);
+        recv_window_ += bytes;
+        auto it = streams_.find(stream_id);
+        if (it != streams_.end() && !it->second->remote_closed) {
+            queue_window_update(stream_id, bytes);
+            it->second->recv_window += bytes;
         }
-        return response;
     }
     
-    // Handle static files
-    vector<uint8_t> content;
-    if (read_file_safe(safe_path, content)) {
-        response.binary_data = move(content);
-        response.is_binary = true;
-        response.headers["Content-Type"] = get_mime_type(safe_path);
-    } else {
-        response.status_code = 500;
-        response.body = "<html><body><h1>500 Internal Server Error</h1><p>Failed to read file.</p></body></html>";
-        response.headers["Content-Type"] = "text/html";
+    for (auto& [stream_id, response] : responses) {
+        auto it = streams_.find(stream_id);
+        if (it == streams_.end()) {
+            continue;  // Client reset the stream while we worked on it
+        }
+        Http2Stream& stream = *it->second;
+        stream.response = move(response);
+        stream.response_ready = true;
+        stream.body_offset = 0;
+        stream.body_length = stream.method == "HEAD" ? 0 : stream.response.body.size();
+        stream.body_complete = !stream.response.stream || stream.method == "HEAD";
+        stream.stream_offset = stream.body_length;
+        send_response_headers(stream);
     }
     
-    return response;
+    // Streamed bodies: data is always posted after its response and before its end
+    for (auto& [stream_id, bytes] : data) {
+        auto it = streams_.find(stream_id);
+        if (it == streams_.end() || it->second->body_complete) {
+            continue;
+        }
+        Http2Stream& stream = *it->second;
+        stream.body_length += bytes.size();
+        stream.response.body.append(move(bytes));
+    }
+    
+    for (auto& [stream_id, clean] : ended) {
+        auto it = streams_.find(stream_id);
+        if (it == streams_.end() || it->second->body_complete) {
+            continue;
+        }
+        Http2Stream& stream = *it->second;
+        stream.body_complete = true;
+        if (!clean) {
+            queue_rst_stream(stream_id, H2_INTERNAL_ERROR);
+            close_stream(stream_id);
+        } else if (stream.body_offset == stream.body_length) {
+            // Everything already went out; end the stream with an empty frame
+            queue_frame(H2_DATA, H2_FLAG_END_STREAM, stream_id, "");
+            if (!stream.remote_closed) {
+                queue_rst_stream(stream_id, H2_NO_ERROR);
+            }
+            close_stream(stream_id);
+        }
+    }
 }
 
-// Send HTTP response
-bool send_response(int client_socket, const HttpResponse& response) {
-    string status_message = "Unknown";
-    auto it = status_messages.find(response.status_code);
-    if (it != status_messages.end()) {
-        status_message = it->second;
+bool Http2Session::send_response_headers(Http2Stream& stream) {
+    const HttpResponse& response = stream.response;
+    vector<pair<string, string>> headers = {
+        {":status", to_string(response.status_code)},
+        {"server", SERVER_NAME}
+    };
+    for (const auto& [name, value] : response.headers) {
+        string lower_name = name;
+        transform(lower_name.begin(), lower_name.end(), lower_name.begin(), ::tolower);
+        if (lower_name != "connection" && lower_name != "transfer-encoding" && lower_name != "content-length") {
+            headers.emplace_back(lower_name, value);
+        }
     }
-    
-    // Build response headers
-    stringstream response_stream;
-    response_stream << "HTTP/1.1 " << response.status_code << " " << status_message << "\r\n";
-    response_stream << "Server: " << SERVER_NAME << "\r\n";
-    response_stream << "Connection: close\r\n";
-    
-    // Add custom headers
-    for (const auto& header : response.headers) {
-        response_stream << header.first << ": " << header.second << "\r\n";
+    bool bodiless = response.status_code == 204 || response.status_code == 304;
+    if (!response.stream) {
+        if (!bodiless) {
+            headers.emplace_back("content-length", to_string(response.body.size()));
+        }
+    } else if (auto stream_length = response.stream->length()) {
+        headers.emplace_back("content-length", to_string(response.body.size() + *stream_length));
     }
     
-    // Content length
-    size_t content_length = response.is_binary ? response.binary_data.size() : response.body.length();
-    response_stream << "Content-Length: " << content_length << "\r\n";
+    string block;
+    if (pending_table_size_update_ != SIZE_MAX) {
+        hpack_encode_integer(block, 0x20, 5, pending_table_size_update_);
+        pending_table_size_update_ = SIZE_MAX;
+    }
+    block += hpack_encode(encoder_table_, headers);
     
-    response_stream << "\r\n";
+    // Split blocks larger than a frame across CONTINUATION
+    uint8_t end_stream = stream.body_length == 0 && stream.body_complete ? H2_FLAG_END_STREAM : 0;
+    size_t offset = 0;
+    bool first = true;
+    do {
+        size_t chunk = min<size_t>(block.size() - offset, peer_max_frame_size_);
+        bool last = offset + chunk == block.size();
+        uint8_t flags = (last ? H2_FLAG_END_HEADERS : 0) | (first ? end_stream : 0);
+        queue_frame(first ? H2_HEADERS : H2_CONTINUATION, flags, stream.id,
+                    string_view(block).substr(offset, chunk));
+        offset += chunk;
+        first = false;
+    } while (offset < block.size());
     
-    // Send headers
-    string headers = response_stream.str();
-    if (send(client_socket, headers.c_str(), headers.length(), MSG_NOSIGNAL) == -1) {
-        return false;
+    if (end_stream) {
+        if (!stream.remote_closed) {
+            queue_rst_stream(stream.id, H2_NO_ERROR);  // We don't need the rest of the body
+        }
+        close_stream(stream.id);
     }
+    return true;
+}
+
+// Pick the next stream to get a DATA frame: among streams with data and
+// window, skip those whose ancestor could send instead, then take the
+// lowest weighted virtual time
+Http2Stream* Http2Session::next_stream_to_send() {
+    auto sendable = [](const Http2Stream& stream) {
+        return stream.response_ready && stream.body_offset < stream.body_length && stream.send_window > 0;
+    };
     
-    // Send body
-    if (content_length > 0) {
-        if (response.is_binary) {
-            if (send(client_socket, response.binary_data.data(), response.binary_data.size(), MSG_NOSIGNAL) == -1) {
-                return false;
+    Http2Stream* best = nullptr;
+    for (auto& [id, stream] : streams_) {
+        if (!sendable(*stream)) {
+            continue;
+        }
+        bool ancestor_sendable = false;
+        uint32_t ancestor = stream->depends_on;
+        for (size_t depth = 0; ancestor != 0 && depth < streams_.size(); ++depth) {
+            auto it = streams_.find(ancestor);
+            if (it == streams_.end()) {
+                break;
             }
-        } else {
-            if (send(client_socket, response.body.c_str(), response.body.length(), MSG_NOSIGNAL) == -1) {
-                return false;
+            if (sendable(*it->second)) {
+                ancestor_sendable = true;
+                break;
             }
+            ancestor = it->second->depends_on;
+        }
+        if (!ancestor_sendable && (!best || stream->virtual_time < best->virtual_time)) {
+            best = stream.get();
         }
     }
-    
-    return true;
+    return best;
 }
 
-// Read request with timeout
-string read_request_with_timeout(int client_socket) {
-    string request;
-    char buffer[1024];
-    
-    fd_set read_fds;
-    struct timeval timeout;
-    
-    while (request.length() < MAX_REQUEST_SIZE) {
-        FD_ZERO(&read_fds);
-        FD_SET(client_socket, &read_fds);
-        timeout.tv_sec = REQUEST_TIMEOUT_SECONDS;
-        timeout.tv_usec = 0;
+bool Http2Session::send_pending() {
+    while (send_window_ > 0) {
+        Http2Stream* stream = next_stream_to_send();
+        if (!stream) {
+            break;
+        }
         
-        int select_result = select(client_socket + 1, &read_fds, nullptr, nullptr, &timeout);
+        // Sent bytes are dropped from the chain, so the front slice is next.
+        // A DATA frame never spans two slices.
+        const BufferSlice& slice = stream->response.body.slices().front();
+        size_t chunk = min<size_t>({slice.length,
+                                    static_cast<size_t>(stream->send_window),
+                                    static_cast<size_t>(send_window_),
+                                    peer_max_frame_size_});
         
-        if (select_result <= 0) {
-            break;  // Timeout or error
+        // The connection is one egress flow; the frame shrinks to its grant.
+        // Pending frames go out first so no grant is held while waiting.
+        EgressGrant grant;
+        if (conn_.egress) {
+            if (!flush() || !conn_.wait_writable(REQUEST_TIMEOUT_SECONDS * 1000)) {
+                return false;
+            }
+            // Leave room for the 9-byte frame header
+            size_t space = conn_.send_space();
+            chunk = min(chunk, max<size_t>(space > 9 ? space - 9 : 0, 1));
+            bool small = stream->body_complete && stream->body_length <= EGRESS_SMALL_RESPONSE;
+            bool priority = small || stream->body_offset < EGRESS_QUANTUM;
+            if (!small && priority) {
+                chunk = min(chunk, EGRESS_QUANTUM - stream->body_offset);
+            }
+            grant = egress_scheduler.acquire(*conn_.egress, chunk,
+                                             priority ? EgressClass::Priority : EgressClass::Bulk);
+            chunk = grant.bytes;
         }
+        bool last = stream->body_complete && stream->body_offset + chunk == stream->body_length;
         
-        ssize_t bytes_received = recv(client_socket, buffer, sizeof(buffer) - 1, 0);
-        if (bytes_received <= 0) {
-            break;
+        if (slice.is_file()) {
+            // Frame header from memory, payload straight from the file
+            queue_frame(H2_DATA, last ? H2_FLAG_END_STREAM : 0, stream->id, "");
+            output_[output_.size() - 9] = static_cast<char>((chunk >> 16) & 0xff);
+            output_[output_.size() - 8] = static_cast<char>((chunk >> 8) & 0xff);
+            output_[output_.size() - 7] = static_cast<char>(chunk & 0xff);
+            if (!flush() || !conn_.send_file(slice.file->fd, slice.offset, chunk)) {
+                return false;
+            }
+        } else {
+            queue_frame(H2_DATA, last ? H2_FLAG_END_STREAM : 0, stream->id, string_view(slice.data, chunk));
+        }
+        if (grant.bytes > 0) {
+            bool written = flush();
+            egress_scheduler.release(grant);
+            if (!written) {
+                return false;
+            }
         }
         
-        buffer[bytes_received] = '\0';
-        request += buffer;
+        stream->response.body.remove_prefix(chunk);
+        if (stream->response.stream && stream->body_offset >= stream->stream_offset) {
+            lock_guard<mutex> lock(stream->body_mutex);
+            stream->send_buffered -= chunk;
+            stream->send_ready.notify_all();
+        }
+        stream->body_offset += chunk;
+        stream->send_window -= chunk;
+        send_window_ -= chunk;
+        scheduler_clock_ = stream->virtual_time;
+        stream->virtual_time += chunk * 256 / stream->weight;
         
-        // Check if we have complete headers
-        if (request.find("\r\n\r\n") != string::npos) {
-            break;
+        if (last) {
+            if (!stream->remote_closed) {
+                queue_rst_stream(stream->id, H2_NO_ERROR);
+            }
+            close_stream(stream->id);
+        }
+        if (output_.size() >= BODY_BUFFER_SIZE * 4 && !flush()) {
+            return false;
         }
     }
-    
-    return request;
+    return output_.empty() || flush();
+}
+
+// Whether an HTTP/1.1 request asks to switch to cleartext HTTP/2. Requests
+// with a body are served over HTTP/1.1 so nothing needs replaying.
+bool wants_h2c_upgrade(const HttpRequest& request) {
+    auto upgrade = request.headers.find("upgrade");
+    auto connection = request.headers.find("connection");
+    if (!request.valid || request.has_body() || request.version != "HTTP/1.1" ||
+        upgrade == request.headers.end() || connection == request.headers.end() ||
+        !request.headers.count("http2-settings")) {
+        return false;
+    }
+    string connection_options = connection->second;
+    transform(connection_options.begin(), connection_options.end(), connection_options.begin(), ::tolower);
+    return upgrade->second.find("h2c") != string::npos &&
+           connection_options.find("http2-settings") != string::npos;
 }
 
 // Handle client connection
-void handle_client(int client_socket, const string& client_ip) {
+void handle_client(int client_socket, const string& client_ip, bool use_tls) {
     // Increment active thread count
     active_threads++;
     
@@ -627,30 +6167,141 @@ void handle_client(int client_socket, const string& client_ip) {
         ip_connections[client_ip]++;
     }
     
+    // Bound blocking handshakes and sends to a stalled peer
+    struct timeval socket_timeout = {REQUEST_TIMEOUT_SECONDS, 0};
+    setsockopt(client_socket, SOL_SOCKET, SO_RCVTIMEO, &socket_timeout, sizeof(socket_timeout));
+    setsockopt(client_socket, SOL_SOCKET, SO_SNDTIMEO, &socket_timeout, sizeof(socket_timeout));
+    
+    // Keep the kernel's unsent queue short so the egress scheduler, not the
+    // socket buffer, decides which response goes next
+    EgressFlow egress_flow;
+    if (EGRESS_SCHEDULER) {
+        int lowat = EGRESS_NOTSENT_LOWAT;
+        setsockopt(client_socket, IPPROTO_TCP, TCP_NOTSENT_LOWAT, &lowat, sizeof(lowat));
+    }
+    
+    Connection conn;
+    conn.fd = client_socket;
+    if (EGRESS_SCHEDULER) {
+        conn.egress = &egress_flow;
+    }
+    RequestTraceScope trace;
+    auto arrival = chrono::steady_clock::now();
+    
     try {
+        bool ready = true;
+        bool alpn_h2 = false;
+#ifdef ENABLE_TLS
+        if (use_tls) {
+            TraceSpan span("tls_handshake");
+            ready = accept_tls(conn, client_ip);
+            const unsigned char* alpn = nullptr;
+            unsigned int alpn_len = 0;
+            if (ready) {
+                SSL_get0_alpn_selected(conn.ssl, &alpn, &alpn_len);
+            }
+            alpn_h2 = alpn_len == 2 && memcmp(alpn, "h2", 2) == 0;
+        }
+#else
+        (void)use_tls;
+#endif
+        
         // Read request with timeout
-        string raw_request = read_request_with_timeout(client_socket);
+        string raw_request;
+        if (ready && !alpn_h2) {
+            TraceSpan span("read_request");
+            raw_request = read_request_with_timeout(conn);
+        }
         
-        if (raw_request.empty()) {
+        if (!ready) {
+            // Handshake failure already logged
+        } else if (alpn_h2 || raw_request.starts_with("PRI * HTTP/2.0\r\n")) {
+            // Negotiated h2, or h2c with prior knowledge; streams are traced individually
+            trace.discard();
+            Http2Session(conn, client_ip, raw_request).run(nullptr);
+        } else if (raw_request.empty()) {
             log_error("Empty or timeout request from " + client_ip);
         } else {
             // Parse and process request
-            HttpRequest request = parse_request(raw_request);
-            HttpResponse response = process_request(request, client_ip);
-            
-            // Send response
-            if (!send_response(client_socket, response)) {
-                log_error("Failed to send response to " + client_ip);
+            HttpRequest request;
+            {
+                TraceSpan span("parse_request");
+                request = parse_request(raw_request);
             }
+            trace.set_label(request.method, request.path);
             
-            log_info("Served " + request.method + " " + request.path + " to " + client_ip + 
-                    " (Status: " + to_string(response.status_code) + ")");
+            if (!use_tls && wants_h2c_upgrade(request)) {
+                trace.discard();
+                // The upgrade request itself is answered over HTTP/2 as stream 1
+                static const char switching[] = "HTTP/1.1 101 Switching Protocols\r\n"
+                                                "Connection: Upgrade\r\n"
+                                                "Upgrade: h2c\r\n\r\n";
+                if (conn.send_all(switching, sizeof(switching) - 1)) {
+                    size_t header_end = raw_request.find("\r\n\r\n") + 4;
+                    Http2Session(conn, client_ip, raw_request.substr(header_end)).run(&request);
+                }
+            } else {
+                // Raw request bytes for the capture file, body included as it is read
+                bool capturing = traffic_capture.enabled();
+                string captured_request;
+                if (capturing) {
+                    captured_request = raw_request.substr(0, CAPTURE_MAX_REQUEST_BYTES);
+                }
+                
+                // Body bytes already received stay buffered; the rest is streamed on demand
+                unique_ptr<BodyReader> body;
+                if (request.valid && request.has_body()) {
+                    size_t header_end = raw_request.find("\r\n\r\n") + 4;
+                    auto expect = request.headers.find("expect");
+                    bool expect_continue = expect != request.headers.end() &&
+                                           strcasecmp(expect->second.c_str(), "100-continue") == 0 &&
+                                           request.version == "HTTP/1.1";
+                    body = make_unique<BodyReader>(conn, raw_request.substr(header_end),
+                                                   request.content_length, request.chunked, expect_continue);
+                    request.body = body.get();
+                    if (capturing) {
+                        body->tap(&captured_request, CAPTURE_MAX_REQUEST_BYTES);
+                    }
+                }
+                
+                HttpResponse response;
+                {
+                    TraceSpan span("process_request");
+                    response = process_request(request, client_ip);
+                }
+                
+                // Send response
+                bool sent;
+                {
+                    TraceSpan span("send_response");
+                    sent = send_response(conn, response);
+                }
+                if (!sent) {
+                    log_error("Failed to send response to " + client_ip);
+                }
+                
+                log_info("Served " + request.method + " " + request.path + " to " + client_ip + 
+                        " (Status: " + to_string(response.status_code) + ")");
+                
+                // A body the handler didn't read to the end can't be replayed faithfully
+                if (capturing) {
+                    bool truncated = raw_request.size() > CAPTURE_MAX_REQUEST_BYTES ||
+                                     (body && (body->tap_overflowed() || !body->finished()));
+                    traffic_capture.record(arrival, captured_request, truncated, use_tls, response);
+                }
+            }
         }
     } catch (const exception& e) {
         log_error("Exception handling client " + client_ip + ": " + e.what());
     }
     
     // Cleanup
+#ifdef ENABLE_TLS
+    if (conn.ssl) {
+        SSL_shutdown(conn.ssl);
+        SSL_free(conn.ssl);
+    }
+#endif
     close(client_socket);
     
     {
@@ -664,31 +6315,13 @@ void handle_client(int client_socket, const string& client_ip) {
     active_threads--;
 }
 
-// Signal handler for SIGCHLD to prevent zombie processes
-void sigchld_handler(int sig) {
-    (void)sig;  // Suppress unused parameter warning
-    while (waitpid(-1, nullptr, WNOHANG) > 0) {
-        // Reap zombie processes
-    }
-}
-
-// Main server function
-int main() {
-    // Install SIGCHLD handler
-    struct sigaction sa;
-    sa.sa_handler = sigchld_handler;
-    sigemptyset(&sa.sa_mask);
-    sa.sa_flags = SA_RESTART | SA_NOCLDSTOP;
-    if (sigaction(SIGCHLD, &sa, nullptr) == -1) {
-        log_error("Failed to install SIGCHLD handler");
-        return 1;
-    }
-    
+// Create a listening socket on the given port
+int create_listener(int port) {
     // Create socket
-    int server_socket = socket(AF_INET, SOCK_STREAM, 0);
+    int server_socket = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
     if (server_socket == -1) {
         log_error("Failed to create socket: " + string(strerror(errno)));
-        return 1;
+        return -1;
     }
     
     // Set socket options
@@ -696,7 +6329,7 @@ int main() {
     if (setsockopt(server_socket, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt)) == -1) {
         log_error("Failed to set socket options: " + string(strerror(errno)));
         close(server_socket);
-        return 1;
+        return -1;
     }
     
     // Bind socket
@@ -704,31 +6337,108 @@ int main() {
     memset(&server_addr, 0, sizeof(server_addr));
     server_addr.sin_family = AF_INET;
     server_addr.sin_addr.s_addr = INADDR_ANY;
-    server_addr.sin_port = htons(SERVER_PORT);
+    server_addr.sin_port = htons(port);
     
     if (bind(server_socket, (struct sockaddr*)&server_addr, sizeof(server_addr)) == -1) {
         log_error("Failed to bind socket: " + string(strerror(errno)));
         close(server_socket);
-        return 1;
+        return -1;
     }
     
     // Listen for connections
     if (listen(server_socket, 128) == -1) {
         log_error("Failed to listen: " + string(strerror(errno)));
         close(server_socket);
+        return -1;
+    }
+    
+    return server_socket;
+}
+
+// Main server function
+// The test programs include this file for its parsers and bring their own main
+#ifndef HTTP_SERVER_NO_MAIN
+int main() {
+    // Writes to a PHP script that stopped reading stdin must fail with EPIPE, not kill us
+    signal(SIGPIPE, SIG_IGN);
+    
+    // No SIGCHLD reaper: execute_php() waits for every child it forks, and a
+    // handler calling waitpid(-1) would steal the exit status from it
+    
+    // SIGUSR1 is taken synchronously by the trace dumper; block it before any
+    // other thread exists so they all inherit the mask
+    sigset_t trace_signals;
+    sigemptyset(&trace_signals);
+    sigaddset(&trace_signals, SIGUSR1);
+    pthread_sigmask(SIG_BLOCK, &trace_signals, nullptr);
+    thread(trace_dump_thread).detach();
+    
+    thread([] { traffic_capture.writer_loop(); }).detach();
+    if (CAPTURE_ON_START) {
+        traffic_capture.start();
+    }
+    
+    int server_socket = create_listener(SERVER_PORT);
+    if (server_socket == -1) {
         return 1;
     }
     
     log_info("Secure HTTP Server started on port " + to_string(SERVER_PORT));
+    
+    // The TLS listener only comes up when a certificate is configured
+    int tls_socket = -1;
+#ifdef ENABLE_TLS
+    if (fs::exists(TLS_CERT_FILE) && fs::exists(TLS_KEY_FILE)) {
+        tls_context = create_tls_context();
+        if (tls_context) {
+            tls_socket = create_listener(TLS_PORT);
+        }
+        if (tls_socket != -1) {
+            log_info("TLS enabled on port " + to_string(TLS_PORT));
+        }
+    } else {
+        log_info("TLS disabled: " + string(TLS_CERT_FILE) + " or " + string(TLS_KEY_FILE) + " not found");
+    }
+#endif
+    
+    // Upstream routes are validated before any traffic is accepted
+    try {
+        for (const UpstreamRoute& route : upstream_routes) {
+            upstreams.push_back(make_unique<Upstream>(route));
+            log_info("Proxying " + string(route.prefix) + " to " + to_string(route.backends.size()) + " backend(s)");
+        }
+    } catch (const invalid_argument& e) {
+        log_error("Invalid upstream route: " + string(e.what()));
+        return 1;
+    }
+    try {
+        register_native_routes();
+    } catch (const invalid_argument& e) {
+        log_error("Invalid native route: " + string(e.what()));
+        return 1;
+    }
+    
+    // A bad pack is logged and skipped; the filesystem still serves everything
+    if (fs::exists(ASSET_PACK_FILE) && asset_pack.open(ASSET_PACK_FILE)) {
+        log_info("Serving " + to_string(asset_pack.size()) + " packed paths from " + string(ASSET_PACK_FILE));
+    }
+    
     log_info("Web root: " + string(WEB_ROOT));
     log_info("Max threads: " + to_string(MAX_CONCURRENT_THREADS));
     
     // Main server loop
     while (true) {
+        struct pollfd listeners[2] = {{server_socket, POLLIN, 0}, {tls_socket, POLLIN, 0}};
+        if (poll(listeners, tls_socket != -1 ? 2 : 1, -1) <= 0) {
+            continue;  // Interrupted by signal
+        }
+        bool use_tls = !(listeners[0].revents & POLLIN);
+        int listen_socket = use_tls ? tls_socket : server_socket;
+        
         struct sockaddr_in client_addr;
         socklen_t client_addr_len = sizeof(client_addr);
         
-        int client_socket = accept(server_socket, (struct sockaddr*)&client_addr, &client_addr_len);
+        int client_socket = accept4(listen_socket, (struct sockaddr*)&client_addr, &client_addr_len, SOCK_CLOEXEC);
         if (client_socket == -1) {
             if (errno == EINTR) {
                 continue;  // Interrupted by signal, continue
@@ -744,6 +6454,12 @@ int main() {
         if (active_threads >= MAX_CONCURRENT_THREADS) {
             log_error("Thread limit reached, rejecting connection from " + client_ip);
             
+            // A plaintext reply would be garbage to a TLS client
+            if (use_tls) {
+                close(client_socket);
+                continue;
+            }
+            
             string error_response = "HTTP/1.1 503 Service Unavailable\r\n"
                                   "Content-Type: text/html\r\n"
                                   "Content-Length: 82\r\n"
@@ -760,6 +6476,11 @@ int main() {
             if (ip_connections[client_ip] >= MAX_CONNECTIONS_PER_IP) {
                 log_error("Too many connections from " + client_ip);
                 
+                if (use_tls) {
+                    close(client_socket);
+                    continue;
+                }
+                
                 string error_response = "HTTP/1.1 429 Too Many Requests\r\n"
                                       "Content-Type: text/html\r\n"
                                       "Content-Length: 86\r\n"
@@ -772,10 +6493,14 @@ int main() {
         }
         
         // Handle client in new thread
-        thread client_thread(handle_client, client_socket, client_ip);
+        thread client_thread(handle_client, client_socket, client_ip, use_tls);
         client_thread.detach();
     }
     
     close(server_socket);
+    if (tls_socket != -1) {
+        close(tls_socket);
+    }
     return 0;
-}
\ No newline at end of file
+}
+#endif
\ No newline at end of file
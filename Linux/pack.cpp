@@ -0,0 +1,248 @@
+// Compiles a web root into an asset pack (see pack.h) for the server to map
+// at startup: a path index, MIME types, ETags and gzip variants of
+// compressible files, so a fresh deploy serves warm from the first request.
+//
+// g++ -std=c++23 -O2 -o pack pack.cpp -lz
+// ./pack ./www site.pack
+//
+// The pack is written next to the output and renamed into place, so a
+// running server never sees a partly written or truncated file.
+
+#include <iostream>
+#include <fstream>
+#include <string>
+#include <vector>
+#include <map>
+#include <algorithm>
+#include <filesystem>
+#include <cstring>
+
+#include <zlib.h>
+
+#include "pack.h"
+
+using namespace std;
+namespace fs = std::filesystem;
+
+// Same limits and types as the server; anything it wouldn't serve from disk
+// is left out of the pack
+constexpr size_t MAX_FILE_SIZE = 10 * 1024 * 1024;
+
+const map<string, string> mime_types = {
+    {".html", "text/html"},
+    {".htm", "text/html"},
+    {".css", "text/css"},
+    {".js", "application/javascript"},
+    {".json", "application/json"},
+    {".png", "image/png"},
+    {".jpg", "image/jpeg"},
+    {".jpeg", "image/jpeg"},
+    {".gif", "image/gif"},
+    {".svg", "image/svg+xml"},
+    {".ico", "image/x-icon"},
+    {".txt", "text/plain"},
+    {".pdf", "application/pdf"},
+    {".xml", "application/xml"}
+};
+
+struct Options {
+    string web_root;
+    string output;
+    bool gzip = true;
+};
+
+void usage() {
+    cerr << "Usage: pack <web root> <output file> [--no-gzip]\n";
+}
+
+bool parse_options(int argc, char* argv[], Options& options) {
+    vector<string> positional;
+    for (int i = 1; i < argc; ++i) {
+        string arg = argv[i];
+        if (arg == "--no-gzip") {
+            options.gzip = false;
+        } else if (arg.starts_with("--")) {
+            return false;
+        } else {
+            positional.push_back(arg);
+        }
+    }
+    if (positional.size() != 2) {
+        return false;
+    }
+    options.web_root = positional[0];
+    options.output = positional[1];
+    return true;
+}
+
+// The server's is_forbidden_file() rules, applied to one path component
+bool is_forbidden_name(const string& name) {
+    static const vector<string> forbidden_patterns = {
+        ".htaccess", ".htpasswd", ".git", ".svn", ".env",
+        "web.config", ".DS_Store", "__pycache__"
+    };
+    if (name.empty() || name[0] == '.' || name == "Thumbs.db" || name == "desktop.ini") {
+        return true;
+    }
+    return any_of(forbidden_patterns.begin(), forbidden_patterns.end(),
+                  [&](const string& pattern) { return name.find(pattern) != string::npos; });
+}
+
+string mime_type(const fs::path& path) {
+    string ext = path.extension().string();
+    transform(ext.begin(), ext.end(), ext.begin(), ::tolower);
+    auto it = mime_types.find(ext);
+    return it != mime_types.end() ? it->second : "application/octet-stream";
+}
+
+bool is_compressible(const string& mime) {
+    return mime.starts_with("text/") || mime == "application/javascript" || mime == "application/json" ||
+           mime == "application/xml" || mime == "image/svg+xml";
+}
+
+// gzip at maximum compression; empty on failure
+string gzip_compress(const string& content) {
+    z_stream zs = {};
+    if (deflateInit2(&zs, Z_BEST_COMPRESSION, Z_DEFLATED, 15 + 16, 9, Z_DEFAULT_STRATEGY) != Z_OK) {
+        return "";
+    }
+    string out(deflateBound(&zs, content.size()), '\0');
+    zs.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(content.data()));
+    zs.avail_in = static_cast<uInt>(content.size());
+    zs.next_out = reinterpret_cast<Bytef*>(out.data());
+    zs.avail_out = static_cast<uInt>(out.size());
+    int result = deflate(&zs, Z_FINISH);
+    out.resize(zs.total_out);
+    deflateEnd(&zs);
+    return result == Z_STREAM_END ? out : "";
+}
+
+bool read_file(const fs::path& path, string& content) {
+    ifstream file(path, ios::binary);
+    content.assign(istreambuf_iterator<char>(file), istreambuf_iterator<char>());
+    return !file.bad();
+}
+
+// Collect every servable file under the web root, plus aliases that let a
+// directory URL hit its index page the way handle_directory() would
+bool collect_assets(const Options& options, vector<PackAsset>& assets, map<string, size_t>& aliases) {
+    fs::path root = options.web_root;
+    error_code error;
+    string canonical_root = fs::canonical(root, error).string();
+    map<string, size_t> by_path;
+    vector<string> directories = {""};
+
+    for (auto it = fs::recursive_directory_iterator(root, fs::directory_options::skip_permission_denied, error);
+         it != fs::recursive_directory_iterator(); it.increment(error)) {
+        if (error) {
+            cerr << root.string() << ": " << error.message() << "\n";
+            return false;
+        }
+        string name = it->path().filename().string();
+        string url = "/" + fs::relative(it->path(), root).generic_string();
+        if (is_forbidden_name(name)) {
+            if (it->is_directory()) {
+                it.disable_recursion_pending();
+            }
+            continue;
+        }
+        if (it->is_directory()) {
+            directories.push_back(url);
+            continue;
+        }
+        // PHP is always executed, never served as a file
+        if (!it->is_regular_file() || it->path().extension() == ".php" || it->file_size() > MAX_FILE_SIZE) {
+            continue;
+        }
+        // Like sanitize_path(), refuse symlinks that lead out of the web root
+        if (!fs::canonical(it->path(), error).string().starts_with(canonical_root)) {
+            continue;
+        }
+
+        PackAsset asset;
+        asset.path = url;
+        asset.mime = mime_type(it->path());
+        if (!read_file(it->path(), asset.content)) {
+            cerr << it->path().string() << ": read failed\n";
+            return false;
+        }
+        asset.etag = pack_etag(asset.content);
+        if (options.gzip && is_compressible(asset.mime)) {
+            pack_add_gzip(asset, gzip_compress(asset.content));
+        }
+        by_path[url] = assets.size();
+        assets.push_back(move(asset));
+    }
+
+    // The first index file that exists wins; an index.php keeps the directory dynamic
+    for (const string& directory : directories) {
+        for (const char* index : {"index.html", "index.htm", "index.php"}) {
+            if (!fs::is_regular_file(root / fs::path(directory.empty() ? "" : directory.substr(1)) / index)) {
+                continue;
+            }
+            auto target = by_path.find(directory + "/" + index);
+            if (target != by_path.end()) {
+                aliases[directory + "/"] = target->second;
+                if (!directory.empty()) {
+                    aliases[directory] = target->second;
+                }
+            }
+            break;
+        }
+    }
+    return true;
+}
+
+// Lay out and write the pack, then rename it over the output
+bool write_pack(const Options& options, const vector<PackAsset>& assets, const map<string, size_t>& aliases) {
+    string temp_path = options.output + ".tmp";
+    {
+        ofstream out(temp_path, ios::binary | ios::trunc);
+        out << encode_pack(layout_pack(assets, aliases));
+        if (!out.flush()) {
+            cerr << temp_path << ": write failed\n";
+            return false;
+        }
+    }
+
+    error_code error;
+    fs::rename(temp_path, options.output, error);
+    if (error) {
+        cerr << options.output << ": " << error.message() << "\n";
+        return false;
+    }
+    return true;
+}
+
+int main(int argc, char* argv[]) {
+    Options options;
+    if (!parse_options(argc, argv, options)) {
+        usage();
+        return 2;
+    }
+    if (!fs::is_directory(options.web_root)) {
+        cerr << options.web_root << ": not a directory\n";
+        return 2;
+    }
+
+    vector<PackAsset> assets;
+    map<string, size_t> aliases;
+    if (!collect_assets(options, assets, aliases) || !write_pack(options, assets, aliases)) {
+        return 1;
+    }
+
+    size_t content_bytes = 0;
+    size_t gzip_count = 0;
+    size_t gzip_saved = 0;
+    for (const PackAsset& asset : assets) {
+        content_bytes += asset.content.size();
+        if (!asset.gzip.empty()) {
+            gzip_count++;
+            gzip_saved += asset.content.size() - asset.gzip.size();
+        }
+    }
+    cout << "Packed " << assets.size() << " files (" << content_bytes << " bytes) and " << aliases.size()
+         << " directory aliases into " << options.output << " (" << fs::file_size(options.output) << " bytes)\n"
+         << "gzip variants: " << gzip_count << ", saving " << gzip_saved << " bytes\n";
+    return 0;
+}
@@ -0,0 +1,238 @@
+// Static asset pack format, shared by pack.cpp (writer) and the server (reader).
+//
+// File:    header, bucket table, entry table, then strings and file data
+// Header:  8-byte magic, entry count, bucket count (a power of two), file size
+// Buckets: one u32 per bucket, an entry index + 1 or 0 when empty. Lookups
+//          probe linearly from pack_hash(path) & (bucket count - 1).
+// Entry:   fixed-size record (see PackEntry); offsets are from the start of
+//          the file and every range lies within it
+// Integers are little-endian regardless of host byte order.
+#pragma once
+
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <map>
+#include <string>
+#include <string_view>
+#include <vector>
+
+constexpr char PACK_MAGIC[8] = {'H', 'T', 'P', 'A', 'C', 'K', '0', '2'};
+constexpr size_t PACK_HEADER_SIZE = 24;
+constexpr size_t PACK_ENTRY_SIZE = 88;
+
+struct PackHeader {
+    uint32_t entry_count = 0;
+    uint32_t bucket_count = 0;
+    uint64_t file_size = 0;
+};
+
+struct PackEntry {
+    uint64_t path_hash = 0;
+    uint64_t path_offset = 0;    // URL path, e.g. "/css/site.css"; directories appear as "/docs" and "/docs/"
+    uint32_t path_length = 0;
+    uint64_t mime_offset = 0;    // Content-Type value
+    uint32_t mime_length = 0;
+    uint64_t etag_offset = 0;    // Quoted ETag value
+    uint32_t etag_length = 0;
+    uint64_t data_offset = 0;    // File content
+    uint64_t data_length = 0;
+    uint64_t gzip_offset = 0;    // gzip variant; gzip_length is 0 when there is none
+    uint64_t gzip_length = 0;
+    uint64_t gzip_etag_offset = 0;  // Quoted ETag of the gzip variant, distinct from etag
+    uint32_t gzip_etag_length = 0;
+};
+
+// FNV-1a, 64-bit
+inline uint64_t pack_hash(std::string_view data) {
+    uint64_t hash = 14695981039346656037ull;
+    for (unsigned char c : data) {
+        hash = (hash ^ c) * 1099511628211ull;
+    }
+    return hash;
+}
+
+inline void pack_put(std::string& out, uint64_t value, int bytes) {
+    for (int i = 0; i < bytes; ++i) {
+        out += static_cast<char>((value >> (8 * i)) & 0xff);
+    }
+}
+
+inline uint64_t pack_get(const char* data, int bytes) {
+    uint64_t value = 0;
+    for (int i = 0; i < bytes; ++i) {
+        value |= static_cast<uint64_t>(static_cast<unsigned char>(data[i])) << (8 * i);
+    }
+    return value;
+}
+
+inline std::string encode_pack_header(const PackHeader& header) {
+    std::string out(PACK_MAGIC, sizeof(PACK_MAGIC));
+    pack_put(out, header.entry_count, 4);
+    pack_put(out, header.bucket_count, 4);
+    pack_put(out, header.file_size, 8);
+    return out;
+}
+
+// Parse a header from PACK_HEADER_SIZE bytes; false when the magic is wrong
+inline bool decode_pack_header(const char* data, PackHeader& header) {
+    if (memcmp(data, PACK_MAGIC, sizeof(PACK_MAGIC)) != 0) {
+        return false;
+    }
+    header.entry_count = static_cast<uint32_t>(pack_get(data + 8, 4));
+    header.bucket_count = static_cast<uint32_t>(pack_get(data + 12, 4));
+    header.file_size = pack_get(data + 16, 8);
+    return true;
+}
+
+inline std::string encode_pack_entry(const PackEntry& entry) {
+    std::string out;
+    out.reserve(PACK_ENTRY_SIZE);
+    pack_put(out, entry.path_hash, 8);
+    pack_put(out, entry.path_offset, 8);
+    pack_put(out, entry.path_length, 4);
+    pack_put(out, entry.mime_offset, 8);
+    pack_put(out, entry.mime_length, 4);
+    pack_put(out, entry.etag_offset, 8);
+    pack_put(out, entry.etag_length, 4);
+    pack_put(out, entry.data_offset, 8);
+    pack_put(out, entry.data_length, 8);
+    pack_put(out, entry.gzip_offset, 8);
+    pack_put(out, entry.gzip_length, 8);
+    pack_put(out, entry.gzip_etag_offset, 8);
+    pack_put(out, entry.gzip_etag_length, 4);
+    return out;
+}
+
+// Parse an entry from PACK_ENTRY_SIZE bytes
+inline PackEntry decode_pack_entry(const char* data) {
+    PackEntry entry;
+    entry.path_hash = pack_get(data, 8);
+    entry.path_offset = pack_get(data + 8, 8);
+    entry.path_length = static_cast<uint32_t>(pack_get(data + 16, 4));
+    entry.mime_offset = pack_get(data + 20, 8);
+    entry.mime_length = static_cast<uint32_t>(pack_get(data + 28, 4));
+    entry.etag_offset = pack_get(data + 32, 8);
+    entry.etag_length = static_cast<uint32_t>(pack_get(data + 40, 4));
+    entry.data_offset = pack_get(data + 44, 8);
+    entry.data_length = pack_get(data + 52, 8);
+    entry.gzip_offset = pack_get(data + 60, 8);
+    entry.gzip_length = pack_get(data + 68, 8);
+    entry.gzip_etag_offset = pack_get(data + 76, 8);
+    entry.gzip_etag_length = static_cast<uint32_t>(pack_get(data + 84, 4));
+    return entry;
+}
+
+// ---------------------------------------------------------------------------
+// Writer: everything pack.cpp does short of reading and writing files
+// ---------------------------------------------------------------------------
+
+constexpr double PACK_MIN_GZIP_SAVING = 0.1;  // Keep a gzip variant only if it is this much smaller
+
+// One file as it goes into the pack
+struct PackAsset {
+    std::string path;     // URL path
+    std::string mime;
+    std::string etag;
+    std::string content;
+    std::string gzip;     // Empty when not worth compressing
+    std::string gzip_etag;
+};
+
+// Strong ETag from the content, so it survives repacking unchanged files
+inline std::string pack_etag(std::string_view content) {
+    char etag[19];
+    snprintf(etag, sizeof(etag), "\"%016llx\"", static_cast<unsigned long long>(pack_hash(content)));
+    return etag;
+}
+
+// A different representation needs its own strong validator
+inline std::string pack_gzip_etag(const std::string& etag) {
+    return etag.substr(0, etag.size() - 1) + "-gz\"";
+}
+
+// Attach a gzip variant if it saves at least PACK_MIN_GZIP_SAVING
+inline void pack_add_gzip(PackAsset& asset, std::string compressed) {
+    if (!compressed.empty() && compressed.size() <= asset.content.size() * (1 - PACK_MIN_GZIP_SAVING)) {
+        asset.gzip = std::move(compressed);
+        asset.gzip_etag = pack_gzip_etag(asset.etag);
+    }
+}
+
+// The index and blob of a pack, before encoding
+struct PackLayout {
+    PackHeader header;
+    std::vector<uint32_t> buckets;
+    std::vector<PackEntry> entries;
+    std::string blob;  // Strings and file data
+};
+
+// Lay out assets plus aliases (extra paths for an asset, by index). Each
+// string and file is stored once; aliases reuse their target's ranges.
+inline PackLayout layout_pack(const std::vector<PackAsset>& assets, const std::map<std::string, size_t>& aliases) {
+    PackLayout layout;
+    size_t entry_count = assets.size() + aliases.size();
+    uint32_t bucket_count = 16;
+    while (bucket_count < entry_count * 2) {
+        bucket_count *= 2;
+    }
+    uint64_t blob_start = PACK_HEADER_SIZE + 4ull * bucket_count + PACK_ENTRY_SIZE * entry_count;
+    auto store = [&](const std::string& bytes, uint64_t& offset) {
+        offset = blob_start + layout.blob.size();
+        layout.blob += bytes;
+    };
+
+    std::vector<PackEntry>& entries = layout.entries;
+    for (const PackAsset& asset : assets) {
+        PackEntry entry;
+        entry.path_hash = pack_hash(asset.path);
+        store(asset.path, entry.path_offset);
+        entry.path_length = static_cast<uint32_t>(asset.path.size());
+        store(asset.mime, entry.mime_offset);
+        entry.mime_length = static_cast<uint32_t>(asset.mime.size());
+        store(asset.etag, entry.etag_offset);
+        entry.etag_length = static_cast<uint32_t>(asset.etag.size());
+        store(asset.content, entry.data_offset);
+        entry.data_length = asset.content.size();
+        if (!asset.gzip.empty()) {
+            store(asset.gzip, entry.gzip_offset);
+            entry.gzip_length = asset.gzip.size();
+            store(asset.gzip_etag, entry.gzip_etag_offset);
+            entry.gzip_etag_length = static_cast<uint32_t>(asset.gzip_etag.size());
+        }
+        entries.push_back(entry);
+    }
+    for (const auto& [path, target] : aliases) {
+        PackEntry entry = entries[target];
+        entry.path_hash = pack_hash(path);
+        store(path, entry.path_offset);
+        entry.path_length = static_cast<uint32_t>(path.size());
+        entries.push_back(entry);
+    }
+
+    layout.buckets.assign(bucket_count, 0);
+    for (size_t i = 0; i < entries.size(); ++i) {
+        size_t slot = entries[i].path_hash & (bucket_count - 1);
+        while (layout.buckets[slot] != 0) {
+            slot = (slot + 1) & (bucket_count - 1);
+        }
+        layout.buckets[slot] = static_cast<uint32_t>(i + 1);
+    }
+
+    layout.header.entry_count = static_cast<uint32_t>(entries.size());
+    layout.header.bucket_count = bucket_count;
+    layout.header.file_size = blob_start + layout.blob.size();
+    return layout;
+}
+
+// The file bytes for a layout
+inline std::string encode_pack(const PackLayout& layout) {
+    std::string out = encode_pack_header(layout.header);
+    for (uint32_t bucket : layout.buckets) {
+        pack_put(out, bucket, 4);
+    }
+    for (const PackEntry& entry : layout.entries) {
+        out += encode_pack_entry(entry);
+    }
+    return out + layout.blob;
+}
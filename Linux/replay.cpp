@@ -0,0 +1,350 @@
+// Replays a traffic capture recorded by the server (see /__admin/capture)
+// against a running instance and diffs every response against the original:
+// status code always, body length and hash where the capture recorded them.
+//
+// g++ -std=c++23 -O2 -pthread -o replay replay.cpp
+// ./replay capture.bin --speed 4 --connections 64
+
+#include <iostream>
+#include <fstream>
+#include <string>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <chrono>
+#include <algorithm>
+#include <cstring>
+#include <cerrno>
+
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+
+#include "capture.h"
+
+using namespace std;
+
+// Defaults
+constexpr const char* DEFAULT_HOST = "127.0.0.1";
+constexpr int DEFAULT_PORT = 8080;
+constexpr int DEFAULT_CONNECTIONS = 32;
+constexpr int DEFAULT_SHOW = 10;
+constexpr int RESPONSE_TIMEOUT_SECONDS = 30;
+
+struct Options {
+    string capture_file;
+    string host = DEFAULT_HOST;
+    int port = DEFAULT_PORT;
+    double speed = 1.0;  // 0 means as fast as possible
+    int connections = DEFAULT_CONNECTIONS;
+    int show = DEFAULT_SHOW;
+};
+
+struct Entry {
+    CaptureRecord record;
+    string request;
+    size_t index = 0;  // Position in the capture file, for reporting
+};
+
+enum class Outcome { Match, StatusMismatch, BodyMismatch, Error, Skipped };
+
+struct Result {
+    Outcome outcome = Outcome::Skipped;
+    int status = 0;
+    uint64_t length = 0;
+    uint64_t hash = 0;
+    chrono::nanoseconds latency{0};
+    chrono::nanoseconds lag{0};  // How late the request went out
+    string error;
+};
+
+void usage() {
+    cerr << "Usage: replay <capture file> [options]\n"
+         << "  --host ADDR        Server address (default " << DEFAULT_HOST << ")\n"
+         << "  --port N           Server port (default " << DEFAULT_PORT << ")\n"
+         << "  --speed S          1 = recorded pace (default), N = N times faster, max = no pacing\n"
+         << "  --connections N    Requests in flight at once (default " << DEFAULT_CONNECTIONS << ")\n"
+         << "  --show N           Mismatches to print (default " << DEFAULT_SHOW << ")\n";
+}
+
+bool parse_options(int argc, char* argv[], Options& options) {
+    for (int i = 1; i < argc; ++i) {
+        string arg = argv[i];
+        bool has_value = i + 1 < argc;
+        try {
+            if (arg == "--host" && has_value) {
+                options.host = argv[++i];
+            } else if (arg == "--port" && has_value) {
+                options.port = stoi(argv[++i]);
+            } else if (arg == "--speed" && has_value) {
+                string value = argv[++i];
+                options.speed = value == "max" ? 0 : stod(value);
+                if (options.speed < 0) {
+                    return false;
+                }
+            } else if (arg == "--connections" && has_value) {
+                options.connections = max(1, stoi(argv[++i]));
+            } else if (arg == "--show" && has_value) {
+                options.show = stoi(argv[++i]);
+            } else if (!arg.starts_with("--") && options.capture_file.empty()) {
+                options.capture_file = arg;
+            } else {
+                return false;
+            }
+        } catch (...) {
+            return false;
+        }
+    }
+    return !options.capture_file.empty();
+}
+
+// Read every record of a capture file and put them in arrival order. The
+// server writes a record when its response is done, so the file is in
+// completion order: a slow request lands after faster ones that came later.
+bool load_capture(const string& path, vector<Entry>& entries) {
+    ifstream file(path, ios::binary);
+    char magic[sizeof(CAPTURE_MAGIC)];
+    if (!file.read(magic, sizeof(magic)) || memcmp(magic, CAPTURE_MAGIC, sizeof(magic)) != 0) {
+        cerr << path << ": not a capture file\n";
+        return false;
+    }
+
+    char header[CAPTURE_RECORD_HEADER_SIZE];
+    while (file.read(header, sizeof(header))) {
+        Entry entry;
+        entry.index = entries.size();
+        entry.record = decode_capture_record(header);
+        entry.request.resize(entry.record.request_length);
+        if (!file.read(entry.request.data(), entry.request.size())) {
+            cerr << path << ": truncated record " << entries.size() << ", ignoring the rest\n";
+            break;
+        }
+        entries.push_back(move(entry));
+    }
+    stable_sort(entries.begin(), entries.end(), [](const Entry& a, const Entry& b) {
+        return a.record.arrival_ns < b.record.arrival_ns;
+    });
+    return true;
+}
+
+// Send one request on a fresh connection and read the response to EOF; the
+// server closes every connection after its response
+bool exchange(const Options& options, const sockaddr_in& address, const string& request, string& response,
+              string& error) {
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd == -1) {
+        error = strerror(errno);
+        return false;
+    }
+    struct timeval timeout = {RESPONSE_TIMEOUT_SECONDS, 0};
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+    bool ok = connect(fd, (const struct sockaddr*)&address, sizeof(address)) == 0;
+    if (!ok) {
+        error = "connect to " + options.host + ":" + to_string(options.port) + ": " + strerror(errno);
+    }
+    for (size_t sent = 0; ok && sent < request.size();) {
+        ssize_t result = send(fd, request.data() + sent, request.size() - sent, MSG_NOSIGNAL);
+        if (result <= 0) {
+            error = string("send: ") + strerror(errno);
+            ok = false;
+        } else {
+            sent += result;
+        }
+    }
+
+    char buffer[16384];
+    while (ok) {
+        ssize_t received = recv(fd, buffer, sizeof(buffer), 0);
+        if (received == 0) {
+            break;
+        }
+        if (received < 0) {
+            error = string("recv: ") + strerror(errno);
+            ok = false;
+        } else {
+            response.append(buffer, received);
+        }
+    }
+    close(fd);
+    return ok;
+}
+
+// Status and body of a raw response, skipping interim 1xx responses
+bool parse_response(const string& response, int& status, string_view& body) {
+    size_t pos = 0;
+    while (true) {
+        size_t head_end = response.find("\r\n\r\n", pos);
+        if (head_end == string::npos || response.compare(pos, 5, "HTTP/") != 0) {
+            return false;
+        }
+        size_t space = response.find(' ', pos);
+        if (space == string::npos || space > head_end) {
+            return false;
+        }
+        status = atoi(response.c_str() + space + 1);
+        pos = head_end + 4;
+        if (status >= 200) {
+            body = string_view(response).substr(pos);
+            return true;
+        }
+    }
+}
+
+void replay_one(const Options& options, const sockaddr_in& address, const Entry& entry, Result& result) {
+    const CaptureRecord& record = entry.record;
+    if (record.flags & CAPTURE_TRUNCATED) {
+        result.outcome = Outcome::Skipped;
+        return;
+    }
+
+    auto started = chrono::steady_clock::now();
+    string response;
+    if (!exchange(options, address, entry.request, response, result.error)) {
+        result.outcome = Outcome::Error;
+        return;
+    }
+    result.latency = chrono::steady_clock::now() - started;
+
+    string_view body;
+    if (!parse_response(response, result.status, body)) {
+        result.outcome = Outcome::Error;
+        result.error = "malformed response";
+        return;
+    }
+    result.length = body.size();
+    result.hash = capture_hash(CAPTURE_HASH_SEED, body.data(), body.size());
+
+    if (result.status != record.status) {
+        result.outcome = Outcome::StatusMismatch;
+    } else if (((record.flags & CAPTURE_LENGTH_KNOWN) && result.length != record.response_length) ||
+               ((record.flags & CAPTURE_BODY_HASHED) && result.hash != record.body_hash)) {
+        result.outcome = Outcome::BodyMismatch;
+    } else {
+        result.outcome = Outcome::Match;
+    }
+}
+
+// First line of a request, for reports
+string request_line(const string& request) {
+    return request.substr(0, min(request.find("\r\n"), size_t(200)));
+}
+
+double to_ms(chrono::nanoseconds duration) {
+    return duration.count() / 1e6;
+}
+
+int main(int argc, char* argv[]) {
+    Options options;
+    if (!parse_options(argc, argv, options)) {
+        usage();
+        return 2;
+    }
+
+    sockaddr_in address = {};
+    address.sin_family = AF_INET;
+    address.sin_port = htons(options.port);
+    if (inet_pton(AF_INET, options.host.c_str(), &address.sin_addr) != 1) {
+        cerr << "Invalid host address: " << options.host << "\n";
+        return 2;
+    }
+
+    vector<Entry> entries;
+    if (!load_capture(options.capture_file, entries)) {
+        return 2;
+    }
+    if (entries.empty()) {
+        cerr << "Capture is empty\n";
+        return 2;
+    }
+
+    // Workers take records in arrival order and send each at its offset from
+    // the earliest arrival, divided by the speed-up
+    vector<Result> results(entries.size());
+    atomic<size_t> next{0};
+    auto start = chrono::steady_clock::now();
+    uint64_t first_arrival = entries.front().record.arrival_ns;
+
+    vector<thread> workers;
+    for (int i = 0; i < options.connections; ++i) {
+        workers.emplace_back([&] {
+            size_t index;
+            while ((index = next++) < entries.size()) {
+                const Entry& entry = entries[index];
+                auto due = start;
+                if (options.speed > 0) {
+                    due += chrono::nanoseconds(static_cast<int64_t>(
+                        (entry.record.arrival_ns - first_arrival) / options.speed));
+                    this_thread::sleep_until(due);
+                }
+                results[index].lag = max(chrono::nanoseconds(0), chrono::steady_clock::now() - due);
+                replay_one(options, address, entry, results[index]);
+            }
+        });
+    }
+    for (thread& worker : workers) {
+        worker.join();
+    }
+    auto elapsed = chrono::steady_clock::now() - start;
+
+    // Report
+    size_t counts[5] = {};
+    vector<chrono::nanoseconds> latencies;
+    chrono::nanoseconds max_lag{0};
+    int shown = 0;
+    for (size_t i = 0; i < entries.size(); ++i) {
+        const Result& result = results[i];
+        counts[static_cast<int>(result.outcome)]++;
+        if (result.outcome == Outcome::Skipped) {
+            continue;
+        }
+        max_lag = max(max_lag, result.lag);
+        if (result.outcome == Outcome::Error) {
+            if (shown++ < options.show) {
+                cout << "#" << entries[i].index << " " << request_line(entries[i].request) << ": error: "
+                     << result.error << "\n";
+            }
+            continue;
+        }
+        latencies.push_back(result.latency);
+        if (result.outcome != Outcome::Match && shown++ < options.show) {
+            const CaptureRecord& record = entries[i].record;
+            cout << "#" << entries[i].index << " " << request_line(entries[i].request) << ": ";
+            if (result.outcome == Outcome::StatusMismatch) {
+                cout << "status " << record.status << " -> " << result.status << "\n";
+            } else {
+                cout << "body " << record.response_length << " bytes -> " << result.length << " bytes"
+                     << (result.length == record.response_length ? " (content differs)" : "") << "\n";
+            }
+        }
+    }
+
+    sort(latencies.begin(), latencies.end());
+    auto percentile = [&latencies](double p) {
+        return latencies.empty() ? 0.0 : to_ms(latencies[min(latencies.size() - 1, size_t(p * latencies.size()))]);
+    };
+    double seconds = chrono::duration<double>(elapsed).count();
+    size_t replayed = entries.size() - counts[static_cast<int>(Outcome::Skipped)];
+
+    cout << "\nReplayed " << replayed << " of " << entries.size() << " requests in " << seconds << "s ("
+         << (seconds > 0 ? replayed / seconds : 0) << " req/s)\n"
+         << "  match:           " << counts[static_cast<int>(Outcome::Match)] << "\n"
+         << "  status mismatch: " << counts[static_cast<int>(Outcome::StatusMismatch)] << "\n"
+         << "  body mismatch:   " << counts[static_cast<int>(Outcome::BodyMismatch)] << "\n"
+         << "  errors:          " << counts[static_cast<int>(Outcome::Error)] << "\n"
+         << "  skipped:         " << counts[static_cast<int>(Outcome::Skipped)] << " (truncated captures)\n"
+         << "Latency ms: p50 " << percentile(0.5) << "  p90 " << percentile(0.9) << "  p99 " << percentile(0.99)
+         << "  max " << (latencies.empty() ? 0.0 : to_ms(latencies.back())) << "\n";
+    if (options.speed > 0) {
+        cout << "Max schedule lag: " << to_ms(max_lag) << " ms"
+             << (to_ms(max_lag) > 100 ? " (raise --connections to keep pace)" : "") << "\n";
+    }
+
+    bool clean = counts[static_cast<int>(Outcome::StatusMismatch)] == 0 &&
+                 counts[static_cast<int>(Outcome::BodyMismatch)] == 0 &&
+                 counts[static_cast<int>(Outcome::Error)] == 0;
+    return clean ? 0 : 1;
+}
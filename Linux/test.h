@@ -0,0 +1,29 @@
+// Minimal checking for the standalone test programs (test_*.cpp). They
+// include http.cpp with HTTP_SERVER_NO_MAIN defined, so they exercise the
+// server's own parsers rather than copies of them.
+#pragma once
+
+#include <iostream>
+
+inline int test_failures = 0;
+
+// Record a failed expectation and keep going, so one run reports them all
+#define CHECK(condition) test_check((condition), #condition, __FILE__, __LINE__)
+
+inline bool test_check(bool ok, const char* expression, const char* file, int line) {
+    if (!ok) {
+        std::cerr << file << ":" << line << ": check failed: " << expression << "\n";
+        test_failures++;
+    }
+    return ok;
+}
+
+// Print the result and return the exit status for main
+inline int test_summary(const char* name) {
+    if (test_failures > 0) {
+        std::cerr << name << ": " << test_failures << " check(s) failed\n";
+        return 1;
+    }
+    std::cout << name << ": ok\n";
+    return 0;
+}
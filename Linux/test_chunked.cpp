@@ -0,0 +1,176 @@
+// Tests for chunked request framing: parse_chunk_size() on its own, and
+// BodyReader decoding bodies fed through a socket pair, whole or in pieces.
+//
+// g++ -std=c++23 -O2 -pthread -o test_chunked test_chunked.cpp
+// ./test_chunked
+
+#define HTTP_SERVER_NO_MAIN
+#include "http.cpp"
+#include "test.h"
+
+bool chunk_size_is(string_view line, uint64_t expected) {
+    uint64_t size = 0;
+    return parse_chunk_size(line, size) && size == expected;
+}
+
+bool chunk_size_rejected(string_view line) {
+    uint64_t size = 0;
+    return !parse_chunk_size(line, size);
+}
+
+void test_chunk_size() {
+    CHECK(chunk_size_is("0", 0));
+    CHECK(chunk_size_is("5", 5));
+    CHECK(chunk_size_is("a", 10));
+    CHECK(chunk_size_is("Ff", 255));
+    CHECK(chunk_size_is("000000000000001a", 26));
+    CHECK(chunk_size_is("ffffffffffffffff", UINT64_MAX));
+    CHECK(chunk_size_is("1;name=value", 1));
+    CHECK(chunk_size_is("1;name=\"quoted value\";other", 1));
+    CHECK(chunk_size_is("1;tab\there", 1));
+
+    CHECK(chunk_size_rejected(""));
+    CHECK(chunk_size_rejected(";ext"));
+    CHECK(chunk_size_rejected(" 5"));
+    CHECK(chunk_size_rejected("5 "));
+    CHECK(chunk_size_rejected("5 ;ext"));
+    CHECK(chunk_size_rejected("+5"));
+    CHECK(chunk_size_rejected("-0"));
+    CHECK(chunk_size_rejected("0x5"));
+    CHECK(chunk_size_rejected("5g"));
+    CHECK(chunk_size_rejected("5\r"));
+    CHECK(chunk_size_rejected("10000000000000000"));  // 17 digits
+    CHECK(chunk_size_rejected("00000000000000000"));  // Leading zeros count too
+    CHECK(chunk_size_rejected(string_view("5;\0", 3)));
+    CHECK(chunk_size_rejected("5;\x01"));
+    CHECK(chunk_size_rejected("5;\x7f"));
+}
+
+struct Decoded {
+    string body;
+    bool ok = false;
+    bool too_large = false;
+};
+
+// Send wire as a chunked body, close the sender and read it back
+Decoded decode_chunked(const string& wire, size_t max_size = MAX_BODY_SIZE) {
+    int fds[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == -1) {
+        perror("socketpair");
+        exit(2);
+    }
+    send(fds[1], wire.data(), wire.size(), 0);
+    close(fds[1]);
+
+    Connection conn;
+    conn.fd = fds[0];
+    BodyReader reader(conn, "", 0, true, false, max_size, 1);
+    Decoded decoded;
+    char buffer[7];  // Small, so bodies cross several reads
+    ssize_t n;
+    while ((n = reader.read(buffer, sizeof(buffer))) > 0) {
+        decoded.body.append(buffer, n);
+    }
+    decoded.ok = n == 0 && reader.finished() && reader.total() == decoded.body.size();
+    decoded.too_large = reader.too_large();
+    close(fds[0]);
+    return decoded;
+}
+
+bool decodes_to(const string& wire, const string& expected) {
+    Decoded decoded = decode_chunked(wire);
+    return decoded.ok && decoded.body == expected;
+}
+
+bool rejected(const string& wire) {
+    return !decode_chunked(wire).ok;
+}
+
+void test_body_reader() {
+    CHECK(decodes_to("0\r\n\r\n", ""));
+    CHECK(decodes_to("5\r\nhello\r\n0\r\n\r\n", "hello"));
+    CHECK(decodes_to("5\r\nhello\r\n7\r\n, world\r\n0\r\n\r\n", "hello, world"));
+    CHECK(decodes_to("5;ext=1\r\nhello\r\n0;last\r\n\r\n", "hello"));
+    CHECK(decodes_to("00005\r\nhello\r\n0\r\n\r\n", "hello"));
+    CHECK(decodes_to("5\r\nhello\r\n0\r\nX-Checksum: 1\r\nX-Other: 2\r\n\r\n", "hello"));
+
+    // Bare LF and stray CR anywhere in the framing
+    CHECK(rejected("5\nhello\r\n0\r\n\r\n"));
+    CHECK(rejected("5\r\nhello\n0\r\n\r\n"));
+    CHECK(rejected("5\r\nhello\r\n0\n\r\n"));
+    CHECK(rejected("5\r\nhello\r\n0\r\n\n"));
+    CHECK(rejected("5\r\nhello\r\n0\r\nX-Trailer: 1\n\r\n"));
+    CHECK(rejected("5\r\r\nhello\r\n0\r\n\r\n"));
+
+    // Size lines a lenient parser would accept
+    CHECK(rejected(" 5\r\nhello\r\n0\r\n\r\n"));
+    CHECK(rejected("5 \r\nhello\r\n0\r\n\r\n"));
+    CHECK(rejected("0x5\r\nhello\r\n0\r\n\r\n"));
+    CHECK(rejected("\r\nhello\r\n0\r\n\r\n"));
+
+    // Data that doesn't match its size line
+    CHECK(rejected("5\r\nhello!\r\n0\r\n\r\n"));
+    CHECK(rejected("6\r\nhello\r\n0\r\n\r\n"));
+
+    // Truncated bodies
+    CHECK(rejected(""));
+    CHECK(rejected("5\r\nhel"));
+    CHECK(rejected("5\r\nhello\r\n"));
+    CHECK(rejected("5\r\nhello\r\n0\r\n"));
+
+    // Over the body limit, including sizes that would overflow a running total
+    Decoded large = decode_chunked("5\r\nhello\r\n0\r\n\r\n", 4);
+    CHECK(!large.ok && large.too_large);
+    large = decode_chunked("3\r\nabc\r\n3\r\ndef\r\n0\r\n\r\n", 5);
+    CHECK(!large.ok && large.too_large);
+    large = decode_chunked("ffffffffffffffff\r\nhello\r\n0\r\n\r\n");
+    CHECK(!large.ok && large.too_large);
+
+    // A size line that never ends
+    CHECK(rejected(string(MAX_CHUNK_LINE * 2, '0')));
+}
+
+// A body that arrives in pieces: read_some() with no wait reports
+// WOULD_BLOCK at every boundary, loses nothing and picks up where it left off
+void test_resumable_reads() {
+    int fds[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == -1) {
+        perror("socketpair");
+        exit(2);
+    }
+    Connection conn;
+    conn.fd = fds[0];
+    BodyReader reader(conn, "", 0, true, false, MAX_BODY_SIZE, 1);
+    CHECK(reader.wait_fd() == fds[0]);
+
+    const char* pieces[] = {"5", ";ext", "\r", "\nhel", "lo", "\r", "\n", "3\r\nabc", "\r\n0\r", "\nX-T: 1\r\n", "\r"};
+    string body;
+    char buffer[64];
+    for (const char* piece : pieces) {
+        send(fds[1], piece, strlen(piece), 0);
+        ssize_t n;
+        while ((n = reader.read_some(buffer, sizeof(buffer), 0)) > 0) {
+            body.append(buffer, n);
+        }
+        CHECK(n == RequestBody::WOULD_BLOCK);
+        CHECK(!reader.finished() && !reader.failed());
+    }
+    send(fds[1], "\n", 1, 0);
+    CHECK(reader.read_some(buffer, sizeof(buffer), 0) == 0);
+    CHECK(reader.finished() && body == "helloabc");
+
+    // Blocking reads still give up on a stalled client, as an error
+    BodyReader stalled(conn, "", 0, true, false, MAX_BODY_SIZE, 1);
+    send(fds[1], "5\r\nhel", 6, 0);
+    CHECK(stalled.read(buffer, sizeof(buffer)) == 3);
+    CHECK(stalled.read(buffer, sizeof(buffer)) == -1 && stalled.failed());
+    close(fds[0]);
+    close(fds[1]);
+}
+
+int main() {
+    test_chunk_size();
+    test_body_reader();
+    test_resumable_reads();
+    return test_summary("test_chunked");
+}
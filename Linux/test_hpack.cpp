@@ -0,0 +1,207 @@
+// Tests for the HPACK codec against the examples in RFC 7541 Appendix C,
+// plus malformed header blocks the decoder must refuse.
+//
+// g++ -std=c++23 -O2 -pthread -o test_hpack test_hpack.cpp
+// ./test_hpack
+
+#define HTTP_SERVER_NO_MAIN
+#include "http.cpp"
+#include "test.h"
+
+using Headers = vector<pair<string, string>>;
+
+// Bytes from the hex dumps in the RFC; whitespace is ignored
+string from_hex(string_view hex) {
+    string bytes;
+    int high = -1;
+    for (char c : hex) {
+        if (!isxdigit(static_cast<unsigned char>(c))) {
+            continue;
+        }
+        int nibble = c <= '9' ? c - '0' : (c | 0x20) - 'a' + 10;
+        if (high < 0) {
+            high = nibble;
+        } else {
+            bytes += static_cast<char>(high << 4 | nibble);
+            high = -1;
+        }
+    }
+    return bytes;
+}
+
+bool decodes_to(HpackTable& table, size_t size_limit, string_view hex, const Headers& expected) {
+    Headers headers;
+    if (!hpack_decode(table, size_limit, from_hex(hex), headers, MAX_REQUEST_SIZE)) {
+        cerr << "  decode failed: " << hex << "\n";
+        return false;
+    }
+    if (headers != expected) {
+        for (const auto& [name, value] : headers) {
+            cerr << "  decoded " << name << ": " << value << "\n";
+        }
+        return false;
+    }
+    return true;
+}
+
+// The dynamic table, newest entry first, must hold exactly expected
+bool table_is(const HpackTable& table, const Headers& expected) {
+    pair<string, string> header;
+    for (size_t i = 0; i < expected.size(); ++i) {
+        if (!table.lookup(HPACK_STATIC_TABLE_SIZE + 1 + i, header) || header != expected[i]) {
+            return false;
+        }
+    }
+    return !table.lookup(HPACK_STATIC_TABLE_SIZE + 1 + expected.size(), header);
+}
+
+bool rejected(string_view hex, size_t max_list_size = MAX_REQUEST_SIZE) {
+    HpackTable table;
+    Headers headers;
+    return !hpack_decode(table, 4096, from_hex(hex), headers, max_list_size);
+}
+
+// C.2: one literal representation of each kind, and an indexed field
+void test_field_representations() {
+    HpackTable table;
+    CHECK(decodes_to(table, 4096, "400a 6375 7374 6f6d 2d6b 6579 0d63 7573 746f 6d2d 6865 6164 6572",
+                     {{"custom-key", "custom-header"}}));
+    CHECK(table_is(table, {{"custom-key", "custom-header"}}));
+
+    HpackTable unindexed;
+    CHECK(decodes_to(unindexed, 4096, "040c 2f73 616d 706c 652f 7061 7468", {{":path", "/sample/path"}}));
+    CHECK(table_is(unindexed, {}));
+
+    HpackTable never_indexed;
+    CHECK(decodes_to(never_indexed, 4096, "1008 7061 7373 776f 7264 0673 6563 7265 74", {{"password", "secret"}}));
+    CHECK(table_is(never_indexed, {}));
+
+    HpackTable indexed;
+    CHECK(decodes_to(indexed, 4096, "82", {{":method", "GET"}}));
+    CHECK(table_is(indexed, {}));
+}
+
+const Headers request1 = {{":method", "GET"}, {":scheme", "http"}, {":path", "/"}, {":authority", "www.example.com"}};
+const Headers request2 = {{":method", "GET"}, {":scheme", "http"}, {":path", "/"}, {":authority", "www.example.com"},
+                          {"cache-control", "no-cache"}};
+const Headers request3 = {{":method", "GET"}, {":scheme", "https"}, {":path", "/index.html"},
+                          {":authority", "www.example.com"}, {"custom-key", "custom-value"}};
+const Headers request_table = {{"custom-key", "custom-value"}, {"cache-control", "no-cache"},
+                               {":authority", "www.example.com"}};
+
+// C.3 and C.4: three requests on one connection, sharing a dynamic table
+void test_requests() {
+    HpackTable table;
+    CHECK(decodes_to(table, 4096, "8286 8441 0f77 7777 2e65 7861 6d70 6c65 2e63 6f6d", request1));
+    CHECK(table_is(table, {{":authority", "www.example.com"}}));
+    CHECK(decodes_to(table, 4096, "8286 84be 5808 6e6f 2d63 6163 6865", request2));
+    CHECK(table_is(table, {{"cache-control", "no-cache"}, {":authority", "www.example.com"}}));
+    CHECK(decodes_to(table, 4096,
+                     "8287 85bf 400a 6375 7374 6f6d 2d6b 6579 0c63 7573 746f 6d2d 7661 6c75 65", request3));
+    CHECK(table_is(table, request_table));
+
+    HpackTable huffman;
+    CHECK(decodes_to(huffman, 4096, "8286 8441 8cf1 e3c2 e5f2 3a6b a0ab 90f4 ff", request1));
+    CHECK(decodes_to(huffman, 4096, "8286 84be 5886 a8eb 1064 9cbf", request2));
+    CHECK(decodes_to(huffman, 4096, "8287 85bf 4088 25a8 49e9 5ba9 7d7f 8925 a849 e95b b8e8 b4bf", request3));
+    CHECK(table_is(huffman, request_table));
+}
+
+const Headers response1 = {{":status", "302"}, {"cache-control", "private"},
+                           {"date", "Mon, 21 Oct 2013 20:13:21 GMT"}, {"location", "https://www.example.com"}};
+const Headers response2 = {{":status", "307"}, {"cache-control", "private"},
+                           {"date", "Mon, 21 Oct 2013 20:13:21 GMT"}, {"location", "https://www.example.com"}};
+const Headers response3 = {{":status", "200"}, {"cache-control", "private"},
+                           {"date", "Mon, 21 Oct 2013 20:13:22 GMT"}, {"location", "https://www.example.com"},
+                           {"content-encoding", "gzip"},
+                           {"set-cookie", "foo=ASDJKHQKBZXOQWEOPIUAXQWEOIU; max-age=3600; version=1"}};
+const Headers response_table = {{"set-cookie", "foo=ASDJKHQKBZXOQWEOPIUAXQWEOIU; max-age=3600; version=1"},
+                                {"content-encoding", "gzip"}, {"date", "Mon, 21 Oct 2013 20:13:22 GMT"}};
+
+// C.5 and C.6: three responses with a 256-byte table, so entries are evicted
+void test_responses() {
+    HpackTable table;
+    table.set_max_size(256);
+    CHECK(decodes_to(table, 256,
+                     "4803 3330 3258 0770 7269 7661 7465 611d 4d6f 6e2c 2032 3120 4f63 7420 3230 3133"
+                     "2032 303a 3133 3a32 3120 474d 546e 1768 7474 7073 3a2f 2f77 7777 2e65 7861 6d70"
+                     "6c65 2e63 6f6d",
+                     response1));
+    CHECK(table_is(table, {{"location", "https://www.example.com"}, {"date", "Mon, 21 Oct 2013 20:13:21 GMT"},
+                           {"cache-control", "private"}, {":status", "302"}}));
+    CHECK(decodes_to(table, 256, "4803 3330 37c1 c0bf", response2));
+    CHECK(table_is(table, {{":status", "307"}, {"location", "https://www.example.com"},
+                           {"date", "Mon, 21 Oct 2013 20:13:21 GMT"}, {"cache-control", "private"}}));
+    CHECK(decodes_to(table, 256,
+                     "88c1 611d 4d6f 6e2c 2032 3120 4f63 7420 3230 3133 2032 303a 3133 3a32 3220 474d"
+                     "54c0 5a04 677a 6970 7738 666f 6f3d 4153 444a 4b48 514b 425a 584f 5157 454f 5049"
+                     "5541 5851 5745 4f49 553b 206d 6178 2d61 6765 3d33 3630 303b 2076 6572 7369 6f6e"
+                     "3d31",
+                     response3));
+    CHECK(table_is(table, response_table));
+
+    HpackTable huffman;
+    huffman.set_max_size(256);
+    CHECK(decodes_to(huffman, 256,
+                     "4882 6402 5885 aec3 771a 4b61 96d0 7abe 9410 54d4 44a8 2005 9504 0b81 66e0 82a6"
+                     "2d1b ff6e 919d 29ad 1718 63c7 8f0b 97c8 e9ae 82ae 43d3",
+                     response1));
+    CHECK(decodes_to(huffman, 256, "4883 640e ffc1 c0bf", response2));
+    CHECK(decodes_to(huffman, 256,
+                     "88c1 6196 d07a be94 1054 d444 a820 0595 040b 8166 e084 a62d 1bff c05a 839b d9ab"
+                     "77ad 94e7 821d d7f2 e6c7 b335 dfdf cd5b 3960 d5af 2708 7f36 72c1 ab27 0fb5 291f"
+                     "9587 3160 65c0 03ed 4ee5 b106 3d50 07",
+                     response3));
+    CHECK(table_is(huffman, response_table));
+}
+
+// Whatever the encoder emits, a decoder with its own table reads back
+void test_round_trip() {
+    HpackTable encoder;
+    HpackTable decoder;
+    for (const Headers* headers : {&response1, &response2, &response3, &response1, &request3}) {
+        Headers decoded;
+        CHECK(hpack_decode(decoder, 4096, hpack_encode(encoder, *headers), decoded, MAX_REQUEST_SIZE));
+        CHECK(decoded == *headers);
+    }
+
+    // Fully indexed fields take one byte; repeats come from the dynamic table
+    HpackTable table;
+    CHECK(hpack_encode(table, {{":status", "200"}}) == "\x88");
+    string first = hpack_encode(table, {{"content-type", "text/html"}});
+    CHECK(first.size() > 1);
+    CHECK(hpack_encode(table, {{"content-type", "text/html"}}) == "\xbe");
+
+    // Per-response values are never indexed
+    hpack_encode(table, {{"etag", "\"abc\""}, {"content-length", "12"}});
+    CHECK(table_is(table, {{"content-type", "text/html"}}));
+}
+
+void test_malformed() {
+    CHECK(rejected("80"));                  // Index 0
+    CHECK(rejected("be"));                  // Dynamic index with an empty table
+    CHECK(rejected("ff"));                  // Integer cut short
+    CHECK(rejected("ff80 8080 8080 8080 8080 8001"));  // Integer overflows 64 bits
+    CHECK(rejected("400a 6375 7374"));      // String past the end of the block
+    CHECK(rejected("0482 1fff"));           // Huffman "a" followed by a full byte of padding
+    CHECK(rejected("0481 18"));             // Huffman "a" padded with zeros
+    CHECK(rejected("0484 ffff ffff"));      // EOS inside a Huffman string
+    CHECK(!rejected("0481 1f"));            // Huffman "a" with its three padding bits
+    CHECK(rejected("3fe2 1f"));             // Table size update above the advertised 4096
+    CHECK(rejected("8220"));                // Table size update after a field
+    CHECK(rejected("40"));                  // Literal with no name
+    CHECK(!rejected("3fe1 1f82"));          // Update to exactly 4096 is allowed
+
+    // The decoded list counts 32 bytes of overhead per field
+    CHECK(rejected("8286", 84));
+    CHECK(!rejected("8286", 85));
+}
+
+int main() {
+    test_field_representations();
+    test_requests();
+    test_responses();
+    test_round_trip();
+    test_malformed();
+    return test_summary("test_hpack");
+}
@@ -0,0 +1,237 @@
+// Tests for the asset pack: the writer pack.cpp uses (pack.h), lookups in
+// the packs it lays out, and every kind of truncated or corrupt file
+// AssetPack::open() must refuse before a lookup can read outside the mapping.
+//
+// g++ -std=c++23 -O2 -pthread -o test_pack test_pack.cpp
+// ./test_pack
+
+#define HTTP_SERVER_NO_MAIN
+#include "http.cpp"
+#include "test.h"
+
+// Lay out a pack with pack.cpp's own writer; tamper can corrupt it before it is encoded
+string build_pack(const vector<PackAsset>& assets, const map<string, size_t>& aliases = {},
+                  function<void(PackLayout&)> tamper = nullptr) {
+    PackLayout layout = layout_pack(assets, aliases);
+    if (tamper) {
+        tamper(layout);
+    }
+    return encode_pack(layout);
+}
+
+PackAsset make_asset(const string& path, const string& mime, const string& content, const string& gzip = "") {
+    PackAsset asset;
+    asset.path = path;
+    asset.mime = mime;
+    asset.content = content;
+    asset.etag = pack_etag(content);
+    pack_add_gzip(asset, gzip);
+    return asset;
+}
+
+string pack_file;
+
+// Open path, capturing the logged reason instead of printing it
+bool open_quietly(AssetPack& pack, const string& path, string* error = nullptr) {
+    stringstream log;
+    streambuf* saved = cerr.rdbuf(log.rdbuf());
+    bool opened = pack.open(path);
+    cerr.rdbuf(saved);
+    if (error) {
+        *error = log.str();
+    }
+    return opened;
+}
+
+// Write bytes to the scratch file and open it
+bool open_pack(AssetPack& pack, const string& bytes, string* error = nullptr) {
+    ofstream(pack_file, ios::binary | ios::trunc) << bytes;
+    return open_quietly(pack, pack_file, error);
+}
+
+// The pack must be refused, with reason in the log
+bool refused(const string& bytes, const string& reason) {
+    AssetPack pack;
+    string error;
+    if (open_pack(pack, bytes, &error) || pack.loaded()) {
+        return false;
+    }
+    if (error.find(reason) == string::npos) {
+        cerr << "  expected \"" << reason << "\", logged: " << error;
+        return false;
+    }
+    return true;
+}
+
+const string home = "<html><body><h1>home</h1><p>" + string(200, 'x') + "</p></body></html>";
+
+const vector<PackAsset> site = {
+    make_asset("/index.html", "text/html", home, "gzipped home"),
+    make_asset("/styles.css", "text/css", "body{}"),
+    make_asset("/empty.txt", "text/plain", ""),
+    make_asset("/docs/index.html", "text/html", "docs"),
+};
+
+// Directory URLs the packer adds for index pages
+const map<string, size_t> site_aliases = {{"/", 0}, {"/docs", 3}, {"/docs/", 3}};
+
+void test_writer() {
+    // ETags are quoted content hashes; the gzip variant gets its own
+    CHECK(pack_etag("abc") == pack_etag("abc"));
+    CHECK(pack_etag("abc") != pack_etag("abd"));
+    CHECK(pack_etag("abc").size() == 18 && pack_etag("abc").front() == '"' && pack_etag("abc").back() == '"');
+    CHECK(pack_gzip_etag("\"0123\"") == "\"0123-gz\"");
+
+    // A variant is kept only when it saves at least 10%
+    PackAsset asset = make_asset("/a.txt", "text/plain", string(100, 'a'));
+    pack_add_gzip(asset, string(91, 'z'));
+    CHECK(asset.gzip.empty() && asset.gzip_etag.empty());
+    pack_add_gzip(asset, "");
+    CHECK(asset.gzip.empty());
+    pack_add_gzip(asset, string(90, 'z'));
+    CHECK(asset.gzip.size() == 90 && asset.gzip_etag == pack_gzip_etag(asset.etag));
+
+    // At least twice as many buckets as entries, and never fewer than 16
+    PackLayout layout = layout_pack(site, site_aliases);
+    CHECK(layout.header.entry_count == 7 && layout.header.bucket_count == 16);
+    CHECK(layout.header.file_size == encode_pack(layout).size());
+    vector<PackAsset> many(20, make_asset("/", "text/plain", "x"));
+    for (size_t i = 0; i < many.size(); ++i) {
+        many[i].path = "/" + to_string(i);
+    }
+    CHECK(layout_pack(many, {}).header.bucket_count == 64);
+
+    // Aliases share their target's data rather than storing it again
+    CHECK(layout.entries[4].data_offset == layout.entries[0].data_offset);
+    CHECK(layout.entries[4].gzip_etag_offset == layout.entries[0].gzip_etag_offset);
+    CHECK(layout.blob.find(home) == layout.blob.rfind(home));
+}
+
+void test_lookups() {
+    AssetPack pack;
+    CHECK(!pack.loaded());
+    CHECK(!pack.find("/index.html"));
+    CHECK(open_pack(pack, build_pack(site, site_aliases)));
+    CHECK(pack.loaded() && pack.size() == site.size() + site_aliases.size());
+
+    vector<pair<string, const PackAsset*>> expected_paths;
+    for (const PackAsset& asset : site) {
+        expected_paths.emplace_back(asset.path, &asset);
+    }
+    for (const auto& [path, target] : site_aliases) {
+        expected_paths.emplace_back(path, &site[target]);
+    }
+    for (const auto& [path, expected] : expected_paths) {
+        optional<AssetPack::Asset> asset = pack.find(path);
+        if (!CHECK(asset.has_value())) {
+            continue;
+        }
+        CHECK(asset->mime == expected->mime);
+        CHECK(asset->etag == expected->etag);
+        CHECK(asset->data == expected->content);
+        CHECK(asset->gzip == expected->gzip);
+        CHECK(asset->gzip_etag == expected->gzip_etag);
+    }
+    CHECK(pack.find("/")->gzip_etag == pack_gzip_etag(site[0].etag));
+
+    // Lookups are exact: no normalisation, case folding or prefix matches
+    CHECK(!pack.find("/Index.html"));
+    CHECK(!pack.find("/index.htm"));
+    CHECK(!pack.find("/index.html/"));
+    CHECK(!pack.find("/docs/index"));
+    CHECK(!pack.find("/styles.css?v=1"));
+    CHECK(!pack.find(""));
+}
+
+// Enough entries that lookups probe past collisions, and misses run until
+// an empty bucket
+void test_probing() {
+    vector<PackAsset> many;
+    for (int i = 0; i < 200; ++i) {
+        many.push_back(make_asset("/file" + to_string(i) + ".txt", "text/plain", "content " + to_string(i)));
+    }
+    AssetPack pack;
+    CHECK(open_pack(pack, build_pack(many)));
+    size_t found = 0;
+    for (const PackAsset& expected : many) {
+        optional<AssetPack::Asset> asset = pack.find(expected.path);
+        found += asset && asset->data == expected.content;
+    }
+    CHECK(found == many.size());
+    for (int i = 200; i < 400; ++i) {
+        CHECK(!pack.find("/file" + to_string(i) + ".txt"));
+    }
+}
+
+void test_corrupt() {
+    string good = build_pack(site, site_aliases);
+    AssetPack pack;
+    CHECK(open_pack(pack, good));
+
+    // Truncated anywhere, from an empty file to one byte short
+    CHECK(refused("", "truncated"));
+    CHECK(refused(good.substr(0, PACK_HEADER_SIZE - 1), "truncated"));
+    CHECK(refused(good.substr(0, PACK_HEADER_SIZE), "size mismatch"));
+    CHECK(refused(good.substr(0, good.size() / 2), "size mismatch"));
+    CHECK(refused(good.substr(0, good.size() - 1), "size mismatch"));
+    CHECK(refused(good + "x", "size mismatch"));
+
+    string bad_magic = good;
+    bad_magic[7] = '1';
+    CHECK(refused(bad_magic, "bad magic"));
+    CHECK(refused(string(PACK_HEADER_SIZE, '\0'), "bad magic"));
+
+    auto tampered = [](function<void(PackLayout&)> tamper) { return build_pack(site, site_aliases, tamper); };
+    CHECK(refused(tampered([](PackLayout& p) { p.header.bucket_count = 12; }), "bad bucket count"));
+    CHECK(refused(tampered([](PackLayout& p) { p.header.bucket_count = 0; }), "bad bucket count"));
+    CHECK(refused(tampered([](PackLayout& p) { p.header.entry_count = 16; }), "bad bucket count"));
+    CHECK(refused(tampered([](PackLayout& p) { p.header.bucket_count = 1u << 31; }), "index past end of file"));
+    CHECK(refused(tampered([](PackLayout& p) { p.header.entry_count = 15; }), "index past end of file"));
+    CHECK(refused(tampered([](PackLayout& p) { p.buckets[3] = 8; }), "bucket 3 out of range"));
+
+    // Each range of an entry is checked, including lengths that wrap around
+    CHECK(refused(tampered([](PackLayout& p) {
+                      p.entries[0].path_offset = p.header.file_size;
+                      p.entries[0].path_length = 1;
+                  }),
+                  "entry 0 out of range"));
+    CHECK(refused(tampered([](PackLayout& p) { p.entries[1].mime_offset = p.header.file_size + 1; }),
+                  "entry 1 out of range"));
+    CHECK(refused(tampered([](PackLayout& p) { p.entries[2].etag_length = 1u << 20; }), "entry 2 out of range"));
+    CHECK(refused(tampered([](PackLayout& p) { p.entries[3].data_length = UINT64_MAX; }), "entry 3 out of range"));
+    CHECK(refused(tampered([](PackLayout& p) { p.entries[4].data_offset = UINT64_MAX; }), "entry 4 out of range"));
+    CHECK(refused(tampered([](PackLayout& p) { p.entries[0].gzip_length = UINT64_MAX - 100; }),
+                  "entry 0 out of range"));
+    CHECK(refused(tampered([](PackLayout& p) { p.entries[0].gzip_etag_offset = UINT64_MAX; }),
+                  "entry 0 out of range"));
+    CHECK(refused(tampered([](PackLayout& p) { p.entries[6].etag_offset = p.header.file_size; }),
+                  "entry 6 out of range"));
+
+    // A refused pack doesn't replace one that is already loaded
+    CHECK(!open_pack(pack, bad_magic));
+    CHECK(pack.loaded() && pack.find("/styles.css"));
+
+    AssetPack missing;
+    string error;
+    CHECK(!open_quietly(missing, pack_file + ".missing", &error) && !missing.loaded());
+    CHECK(error.find("Cannot open") != string::npos);
+}
+
+int main() {
+    char scratch[] = "/tmp/test_pack.XXXXXX";
+    int fd = mkstemp(scratch);
+    if (fd == -1) {
+        perror("mkstemp");
+        return 2;
+    }
+    close(fd);
+    pack_file = scratch;
+
+    test_writer();
+    test_lookups();
+    test_probing();
+    test_corrupt();
+
+    unlink(pack_file.c_str());
+    return test_summary("test_pack");
+}
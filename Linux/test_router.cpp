@@ -0,0 +1,184 @@
+// Tests for the native route trie: literal over parameter over catch-all
+// precedence, backtracking out of dead ends, method matching and the
+// patterns Router::add() must refuse.
+//
+// g++ -std=c++23 -O2 -pthread -o test_router test_router.cpp
+// ./test_router
+
+#define HTTP_SERVER_NO_MAIN
+#include "http.cpp"
+#include "test.h"
+
+// Each route answers with its own status code, so a lookup shows which one matched
+NativeHandler route(int id) {
+    return [id](const RequestView&) {
+        HttpResponse response;
+        response.status_code = id;
+        return response;
+    };
+}
+
+struct Lookup {
+    int route = 0;      // 0 when nothing matched
+    bool path_matched = false;
+    string allow;
+    string params;      // name=value pairs joined with spaces
+};
+
+Lookup lookup(const Router& router, string_view method, const string& path) {
+    HttpRequest request;
+    request.method = string(method);
+    request.path = path;
+    string client_ip = "127.0.0.1";
+    RequestView view(request, client_ip);
+
+    Router::Match match = router.find(method, view.path, view.params);
+    Lookup result;
+    result.path_matched = match.path_matched;
+    result.allow = match.allow;
+    if (match.handler) {
+        result.route = (*match.handler)(view).status_code;
+    }
+    for (const auto& [name, value] : view.params) {
+        result.params += (result.params.empty() ? "" : " ") + string(name) + "=" + string(value);
+    }
+    return result;
+}
+
+bool matches(const Router& router, const string& path, int route, const string& params = "") {
+    Lookup result = lookup(router, "GET", path);
+    if (result.route != route || result.params != params) {
+        cerr << "  GET " << path << " matched route " << result.route << " with [" << result.params << "]\n";
+        return false;
+    }
+    return true;
+}
+
+bool misses(const Router& router, const string& path) {
+    Lookup result = lookup(router, "GET", path);
+    return result.route == 0 && !result.path_matched && result.params.empty();
+}
+
+void test_precedence() {
+    Router router;
+    router.add("GET", "/", route(1));
+    router.add("GET", "/users/me", route(2));
+    router.add("GET", "/users/{id}", route(3));
+    router.add("GET", "/users/{id}/posts", route(4));
+    router.add("GET", "/users/{id}/posts/{post}", route(5));
+    router.add("GET", "/user", route(6));
+    router.add("GET", "/files/{path...}", route(7));
+    router.add("GET", "/files/index", route(8));
+    router.add("GET", "/files/{name}/meta", route(9));
+
+    CHECK(matches(router, "/", 1));
+    CHECK(matches(router, "/user", 6));
+
+    // A literal segment beats a parameter at the same position
+    CHECK(matches(router, "/users/me", 2));
+    CHECK(matches(router, "/users/42", 3, "id=42"));
+    CHECK(matches(router, "/users/mee", 3, "id=mee"));
+    CHECK(matches(router, "/users/m", 3, "id=m"));
+
+    // The literal "me" dead-ends, so the parameter branch is tried instead
+    CHECK(matches(router, "/users/me/posts", 4, "id=me"));
+    CHECK(matches(router, "/users/42/posts/7", 5, "id=42 post=7"));
+
+    // Parameters take exactly one non-empty segment and stay percent-encoded
+    CHECK(matches(router, "/users/a%2Fb", 3, "id=a%2Fb"));
+    CHECK(misses(router, "/users/"));
+    CHECK(misses(router, "/users//posts"));
+    CHECK(misses(router, "/users/42/"));
+    CHECK(misses(router, "/users/42/comments"));
+
+    // Literal, then parameter, then catch-all
+    CHECK(matches(router, "/files/index", 8));
+    CHECK(matches(router, "/files/report/meta", 9, "name=report"));
+    CHECK(matches(router, "/files/report", 7, "path=report"));
+    CHECK(matches(router, "/files/a/b/c", 7, "path=a/b/c"));
+    CHECK(matches(router, "/files/index/meta", 9, "name=index"));
+    CHECK(matches(router, "/files/report/meta/x", 7, "path=report/meta/x"));
+
+    // Split edges match only whole prefixes
+    CHECK(misses(router, "/use"));
+    CHECK(misses(router, "/userz"));
+    CHECK(misses(router, "/fil"));
+    CHECK(misses(router, ""));
+}
+
+// Backtracking has to undo parameters bound on the abandoned branch
+void test_backtracking() {
+    Router router;
+    router.add("GET", "/a/b/d", route(1));
+    router.add("GET", "/a/{x}/c", route(2));
+    router.add("GET", "/a/{x}/{y}/e", route(3));
+    router.add("GET", "/{first}/{rest...}", route(4));
+
+    CHECK(matches(router, "/a/b/d", 1));
+    CHECK(matches(router, "/a/b/c", 2, "x=b"));
+    CHECK(matches(router, "/a/b/c/e", 3, "x=b y=c"));
+    CHECK(matches(router, "/a/b/c/f", 4, "first=a rest=b/c/f"));
+    CHECK(matches(router, "/z/y", 4, "first=z rest=y"));
+    CHECK(misses(router, "/a"));
+}
+
+void test_methods() {
+    Router router;
+    router.add("GET", "/items/{id}", route(1));
+    router.add("POST", "/items/{id}", route(2));
+    router.add("DELETE", "/items", route(3));
+
+    CHECK(lookup(router, "POST", "/items/9").route == 2);
+    CHECK(lookup(router, "HEAD", "/items/9").route == 1);  // HEAD falls back to GET
+
+    Lookup wrong = lookup(router, "PUT", "/items/9");
+    CHECK(wrong.route == 0 && wrong.path_matched && wrong.allow == "GET, POST");
+    wrong = lookup(router, "HEAD", "/items");
+    CHECK(wrong.route == 0 && wrong.path_matched && wrong.allow == "DELETE");
+
+    CHECK(lookup(router, "GET", "/items/9?verbose=1").route == 1);
+    CHECK(!lookup(router, "GET", "/item").path_matched);
+}
+
+bool refused(Router& router, string_view method, string_view pattern) {
+    try {
+        router.add(method, pattern, route(99));
+    } catch (const invalid_argument&) {
+        return true;
+    }
+    return false;
+}
+
+void test_bad_patterns() {
+    Router router;
+    CHECK(router.empty());
+    router.add("GET", "/users/{id}", route(1));
+    router.add("GET", "/files/{path...}", route(2));
+
+    CHECK(refused(router, "GET", "users"));
+    CHECK(refused(router, "GET", ""));
+    CHECK(refused(router, "GET", "/users/{id}"));             // Duplicate
+    CHECK(refused(router, "GET", "/users/{name}/posts"));     // Clashes with {id}
+    CHECK(refused(router, "GET", "/files/{rest...}"));        // Clashes with {path...}
+    CHECK(refused(router, "GET", "/x{id}"));
+    CHECK(refused(router, "GET", "/x/{id}y"));
+    CHECK(refused(router, "GET", "/x/{id"));
+    CHECK(refused(router, "GET", "/x/{}"));
+    CHECK(refused(router, "GET", "/x/{...}"));
+    CHECK(refused(router, "GET", "/x/{a{b}"));
+    CHECK(refused(router, "GET", "/x/{rest...}/more"));
+
+    // A refused pattern leaves the existing routes working
+    CHECK(matches(router, "/users/7", 1, "id=7"));
+    CHECK(matches(router, "/files/a/b", 2, "path=a/b"));
+    router.add("POST", "/users/{id}", route(3));
+    CHECK(lookup(router, "POST", "/users/7").route == 3);
+}
+
+int main() {
+    test_precedence();
+    test_backtracking();
+    test_methods();
+    test_bad_patterns();
+    return test_summary("test_router");
+}